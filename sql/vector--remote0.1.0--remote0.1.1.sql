@@ -0,0 +1,8 @@
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "ALTER EXTENSION vector UPDATE TO 'remote0.1.1'" to load this file. \quit
+
+CREATE FUNCTION pinecone_host_stats(OUT host text, OUT queries int8, OUT failures int8,
+	OUT hedged int8, OUT hedge_wins int8, OUT deadline_exceeded int8,
+	OUT p50_ms float8, OUT p95_ms float8, OUT p99_ms float8, OUT breaker text,
+	OUT upsert_bytes int8, OUT upsert_bytes_sent int8, OUT throttled int8, OUT upsert_retries int8) RETURNS SETOF record
+	AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT PARALLEL RESTRICTED;
@@ -133,6 +133,12 @@ CREATE FUNCTION pinecone_print_index(text) RETURNS int4
 CREATE FUNCTION pinecone_index_get_host(text) RETURNS text
 	AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
 
+CREATE FUNCTION pinecone_host_stats(OUT host text, OUT queries int8, OUT failures int8,
+	OUT hedged int8, OUT hedge_wins int8, OUT deadline_exceeded int8,
+	OUT p50_ms float8, OUT p95_ms float8, OUT p99_ms float8, OUT breaker text,
+	OUT upsert_bytes int8, OUT upsert_bytes_sent int8, OUT throttled int8, OUT upsert_retries int8) RETURNS SETOF record
+	AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT PARALLEL RESTRICTED;
+
 -- CREATE FUNCTION pinecone_print_index_stats(text) RETURNS int4
 	-- AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
 
@@ -1,9 +1,11 @@
 #include "pinecone.h"
 
+#include "access/genam.h"
 #include "utils/guc.h"
 #include <access/reloptions.h>
 
 #include <float.h>  
+#include <limits.h>
 
 
 #if PG_VERSION_NUM < 150000
@@ -16,10 +18,35 @@ int pinecone_vectors_per_request = 100;
 int pinecone_requests_per_batch = 10;
 int pinecone_max_buffer_scan = 10000; // maximum number of tuples to search in the buffer
 int pinecone_max_fetched_vectors_for_liveness_check = 10;
+double pinecone_hedge_percentile = 0;
+int pinecone_query_deadline = 0;
+int pinecone_query_deadline_action = PINECONE_DEADLINE_ERROR;
+int pinecone_breaker_failure_threshold = 5;
+int pinecone_breaker_cooldown = 30000;
+bool pinecone_compress_upserts = false;
+int pinecone_upsert_max_retries = 5;
+int pinecone_request_timeout = 0;
+int pinecone_stall_timeout = 30;
 #ifdef PINECONE_MOCK
 bool pinecone_use_mock_response = false;
 #endif
 
+static const struct config_enum_entry pinecone_deadline_action_options[] = {
+    {"error", PINECONE_DEADLINE_ERROR, false},
+    {"local_only", PINECONE_DEADLINE_LOCAL_ONLY, false},
+    {NULL, 0, false}
+};
+
+static bool check_compress_upserts(bool *newval, void **extra, GucSource source) {
+#ifndef HAVE_LIBZ
+    if (*newval) {
+        GUC_check_errdetail("This build of vector was compiled without zlib.");
+        return false;
+    }
+#endif
+    return true;
+}
+
 // todo: principled batch sizes. Do we ever want the buffer to be bigger than a multi-insert? Possibly if we want to let the buffer fill up when the remote index is down.
 static relopt_kind pinecone_relopt_kind;
 
@@ -44,6 +71,11 @@ void PineconeInit(void)
     add_bool_reloption(pinecone_relopt_kind, "skip_build",
                             "Do not upload vectors from the base table.",
                             false, AccessExclusiveLock);
+    add_string_reloption(pinecone_relopt_kind, "inline_vectors",
+                            "Store vectors in the buffer next to their heap tids (off, float4 or float16) so that scanning the buffer doesn't read the heap",
+                            DEFAULT_INLINE_VECTORS,
+                            pinecone_inline_vectors_validator,
+                            AccessExclusiveLock);
     // todo: allow for specifying a hostname instead of asking to create it
     // todo: you can have a relopts_validator which validates the whole relopt set. This could be used to check that exactly one of spec or host is set
     DefineCustomStringVariable("pinecone.api_key", "Pinecone API key", "Pinecone API key",
@@ -75,6 +107,97 @@ void PineconeInit(void)
                             10, 0, 100, // more than 100 is useless and won't fit in the 2048 chars allotted for the URL
                             PGC_USERSET,
                             0, NULL, NULL, NULL);
+    DefineCustomBoolVariable("pinecone.network_worker", "Send Pinecone requests through a shared network worker",
+                            "Requires vector in shared_preload_libraries. All backends share the worker's HTTP/2 connections.",
+                            &pinecone_network_worker,
+                            false,
+                            PGC_POSTMASTER,
+                            0, NULL, NULL, NULL);
+    DefineCustomRealVariable("pinecone.hedge_percentile", "Latency percentile after which a query is sent again",
+                            "A query that hasn't been answered after this percentile of the recent query latencies to the same host is sent a second time and the first response wins. 0 disables hedging.",
+                            &pinecone_hedge_percentile,
+                            0, 0, 100,
+                            PGC_USERSET,
+                            0, NULL, NULL, NULL);
+    DefineCustomIntVariable("pinecone.query_deadline", "Maximum time to wait for Pinecone to answer a query",
+                            "0 waits indefinitely.",
+                            &pinecone_query_deadline,
+                            0, 0, INT_MAX,
+                            PGC_USERSET,
+                            GUC_UNIT_MS, NULL, NULL, NULL);
+    DefineCustomEnumVariable("pinecone.query_deadline_action", "What to do when pinecone.query_deadline passes",
+                            "error aborts the query, local_only returns results from the local buffer only.",
+                            &pinecone_query_deadline_action,
+                            PINECONE_DEADLINE_ERROR,
+                            pinecone_deadline_action_options,
+                            PGC_USERSET,
+                            0, NULL, NULL, NULL);
+    DefineCustomIntVariable("pinecone.breaker_failure_threshold", "Consecutive failed requests after which a Pinecone host is considered down",
+                            "While a host is down, the planner does not use pinecone indexes on it. 0 disables the circuit breaker.",
+                            &pinecone_breaker_failure_threshold,
+                            5, 0, 1000,
+                            PGC_USERSET,
+                            0, NULL, NULL, NULL);
+    DefineCustomIntVariable("pinecone.breaker_cooldown", "Time before a Pinecone host that is down is tried again",
+                            NULL,
+                            &pinecone_breaker_cooldown,
+                            30000, 0, INT_MAX,
+                            PGC_USERSET,
+                            GUC_UNIT_MS, NULL, NULL, NULL);
+    DefineCustomBoolVariable("pinecone.compress_upserts", "Gzip the bodies of upsert requests",
+                            "A host that rejects compressed bodies is sent uncompressed ones for the rest of the session.",
+                            &pinecone_compress_upserts,
+                            false,
+                            PGC_USERSET,
+                            0, check_compress_upserts, NULL, NULL);
+    DefineCustomBoolVariable("pinecone.background_flush", "Flush the buffer to Pinecone in a background worker",
+                            "Requires vector in shared_preload_libraries. Inserting backends then only append to the buffer.",
+                            &pinecone_background_flush,
+                            false,
+                            PGC_SIGHUP,
+                            0, NULL, NULL, NULL);
+    DefineCustomIntVariable("pinecone.flush_naptime", "Time the background flusher sleeps between rounds",
+                            NULL,
+                            &pinecone_flush_naptime,
+                            1000, 10, INT_MAX,
+                            PGC_SIGHUP,
+                            GUC_UNIT_MS, NULL, NULL, NULL);
+    DefineCustomIntVariable("pinecone.liveness_max_age", "Age after which a query no longer trusts the shared view of which checkpoints Pinecone has indexed",
+                            "An older view is refreshed by fetching the newer checkpoints along with the query. 0 fetches with every query. Without vector in shared_preload_libraries, each backend has its own view.",
+                            &pinecone_liveness_max_age,
+                            1000, 0, INT_MAX,
+                            PGC_USERSET,
+                            GUC_UNIT_MS, NULL, NULL, NULL);
+    DefineCustomRealVariable("pinecone.presume_ready_factor", "Multiple of Pinecone's indexing lag after which a flushed batch is presumed indexed",
+                            "Queries don't scan the local copy of batches flushed longer ago than this times the indexing lag learned from liveness fetches. 0 only trusts liveness fetches.",
+                            &pinecone_presume_ready_factor,
+                            2, 0, 1000,
+                            PGC_USERSET,
+                            0, NULL, NULL, NULL);
+    DefineCustomBoolVariable("pinecone.wal_rmgr", "Log changes to the buffer with Pinecone's own WAL records",
+                            "Requires PostgreSQL 15 or later and vector in shared_preload_libraries. Both must stay set, on standbys too, until the records are behind a checkpoint.",
+                            &pinecone_wal_rmgr,
+                            false,
+                            PGC_POSTMASTER,
+                            0, NULL, NULL, NULL);
+    DefineCustomIntVariable("pinecone.upsert_max_retries", "Times a failed or throttled upsert request is sent again",
+                            "When the retries are exhausted the flush stops with a warning and the vectors stay in the buffer.",
+                            &pinecone_upsert_max_retries,
+                            5, 0, 100,
+                            PGC_USERSET,
+                            0, NULL, NULL, NULL);
+    DefineCustomIntVariable("pinecone.request_timeout", "Maximum time a request to Pinecone may take",
+                            "0 lets requests take as long as they need.",
+                            &pinecone_request_timeout,
+                            0, 0, INT_MAX,
+                            PGC_USERSET,
+                            GUC_UNIT_MS, NULL, NULL, NULL);
+    DefineCustomIntVariable("pinecone.stall_timeout", "Time after which a request to Pinecone that has stopped sending and receiving data is aborted",
+                            "0 waits on a stalled request indefinitely.",
+                            &pinecone_stall_timeout,
+                            30, 0, INT_MAX,
+                            PGC_USERSET,
+                            GUC_UNIT_S, NULL, NULL, NULL);
     #ifdef PINECONE_MOCK
     DefineCustomBoolVariable("pinecone.use_mock_response", "Pinecone use mock response", "Pinecone use mock response",
                             &pinecone_use_mock_response,
@@ -83,6 +206,9 @@ void PineconeInit(void)
                             0, NULL, NULL, NULL);
     #endif
     MarkGUCPrefixReserved("pinecone");
+
+    PineconeWorkerInit();
+    PineconeXLogInit();
 }
 
 void no_costestimate(PlannerInfo *root, IndexPath *path, double loop_count,
@@ -90,12 +216,24 @@ void no_costestimate(PlannerInfo *root, IndexPath *path, double loop_count,
 					Selectivity *indexSelectivity, double *indexCorrelation,
 					double *indexPages)
 {
-    // todo: consider running a health check on the remote index and return infinity if it is not healthy
     if (list_length(path->indexorderbycols) == 0 || linitial_int(path->indexorderbycols) != 0) {
         elog(DEBUG1, "Pinecone index must be ordered by distance. Returning infinity.");
         *indexTotalCost = DBL_MAX;
         return;
     }
+
+    // don't plan to use the index while its host is down so that we fall back to another index or a sequential scan
+    if (pinecone_any_breaker_open()) {
+        Relation index = index_open(path->indexinfo->indexoid, NoLock);
+        PineconeStaticMetaPageData meta = PineconeSnapshotStaticMeta(index);
+        index_close(index, NoLock);
+        if (pinecone_breaker_is_open(pinecone_get_host_stats(meta.host))) {
+            elog(DEBUG1, "Pinecone host %s is down. Returning infinity.", meta.host);
+            *indexStartupCost = DBL_MAX;
+            *indexTotalCost = DBL_MAX;
+            return;
+        }
+    }
 };
 
 bytea * pinecone_options(Datum reloptions, bool validate)
@@ -104,7 +242,8 @@ bytea * pinecone_options(Datum reloptions, bool validate)
 		{"spec", RELOPT_TYPE_STRING, offsetof(PineconeOptions, spec)},
         {"host", RELOPT_TYPE_STRING, offsetof(PineconeOptions, host)},
         {"overwrite", RELOPT_TYPE_BOOL, offsetof(PineconeOptions, overwrite)},
-        {"skip_build", RELOPT_TYPE_BOOL, offsetof(PineconeOptions, skip_build)}
+        {"skip_build", RELOPT_TYPE_BOOL, offsetof(PineconeOptions, skip_build)},
+        {"inline_vectors", RELOPT_TYPE_STRING, offsetof(PineconeOptions, inline_vectors)}
 
 	};
     static bool first_time = true;
@@ -170,6 +309,9 @@ Datum pineconehandler(PG_FUNCTION_ARGS)
     amroutine->ambuild = pinecone_build;
     amroutine->ambuildempty = pinecone_buildempty;
     amroutine->aminsert = pinecone_insert;
+#if PG_VERSION_NUM >= 170000
+    amroutine->aminsertcleanup = pinecone_insert_cleanup;
+#endif
     amroutine->ambulkdelete = pinecone_bulkdelete;
     amroutine->amvacuumcleanup = no_vacuumcleanup;
     // used to indicate if we support index-only scans; takes a attno and returns a bool;
@@ -187,7 +329,7 @@ Datum pineconehandler(PG_FUNCTION_ARGS)
     amroutine->amrescan = pinecone_rescan;
     amroutine->amgettuple = pinecone_gettuple;
     amroutine->amgetbitmap = NULL; // an alternative to amgettuple that returns a bitmap of matching tuples
-    amroutine->amendscan = no_endscan;
+    amroutine->amendscan = pinecone_endscan;
     amroutine->ammarkpos = NULL;
     amroutine->amrestrpos = NULL;
 
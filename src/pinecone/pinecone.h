@@ -13,6 +13,8 @@
 #include <utils/array.h>
 #include "access/relscan.h"
 #include "storage/block.h"
+#include "lib/stringinfo.h"
+#include "utils/timestamp.h"
 
 #define PINECONE_DEFAULT_BUFFER_THRESHOLD 2000
 #define PINECONE_MIN_BUFFER_THRESHOLD 1
@@ -22,8 +24,15 @@
 #define PINECONE_BUFFER_METAPAGE_BLKNO 1
 #define PINECONE_BUFFER_HEAD_BLKNO 2
 
+#define PINECONE_INSERT_STRIPES 16 // inserters append to one of this many pages, each with its own lock
+// indexes created before stripes existed have zeros where the stripe pages go
+#define PineconeStripePageIsValid(blkno) (BlockNumberIsValid(blkno) && (blkno) > PINECONE_BUFFER_METAPAGE_BLKNO)
+
 #define INVALID_CHECKPOINT_NUMBER -1
 
+#define PINECONE_RECENT_FLUSHES 16 // flush times kept in the buffer meta, by checkpoint_no modulo this
+#define PINECONE_MIN_LAG_SAMPLES 5 // don't presume checkpoints ready until we have seen pinecone index this many
+
 #define PineconePageGetOpaque(page)	((PineconeBufferOpaque) PageGetSpecialPointer(page))
 #define PineconePageGetStaticMeta(page)	((PineconeStaticMetaPage) PageGetContents(page))
 #define PineconePageGetBufferMeta(page)    ((PineconeBufferMetaPage) PageGetContents(page))
@@ -35,32 +44,95 @@
 
 #define DEFAULT_SPEC "{}"
 #define DEFAULT_HOST ""
+#define DEFAULT_INLINE_VECTORS "off"
+
+// how the buffer stores vectors next to their heap tids (inline_vectors reloption)
+#define PINECONE_INLINE_VECTORS_OFF 0 // only the tid; the vector is read from the heap
+#define PINECONE_INLINE_VECTORS_FLOAT4 1
+#define PINECONE_INLINE_VECTORS_FLOAT16 2
 
 // strategy numbers
 #define PINECONE_STRATEGY_ARRAY_OVERLAP 7
 #define PINECONE_STRATEGY_ARRAY_CONTAINS 2
 
 // structs
+typedef struct PineconeMatch
+{
+    ItemPointerData tid;
+    float score; // as reported by pinecone (similarity or squared distance depending on the metric)
+} PineconeMatch;
+
+#define PINECONE_PARSER_MAX_DEPTH 32
+#define PINECONE_PARSER_TOKEN_LENGTH 256
+
+// incremental decoder for the matches of a /query response
+typedef struct PineconeMatchParser
+{
+    // output
+    PineconeMatch* matches;
+    int n_matches;
+    int capacity;
+    bool found_matches;
+    bool failed; // the response is not valid json or was cut off
+    char message[256]; // top-level message of an error response
+
+    // tokenizer
+    int depth;
+    char containers[PINECONE_PARSER_MAX_DEPTH]; // '{' or '[' for each open container
+    bool expect_key;
+    bool in_matches;
+    int field; // what the next value at the current depth is
+    int token_state;
+    char token[PINECONE_PARSER_TOKEN_LENGTH];
+    int token_len;
+
+    // match being decoded
+    PineconeMatch current;
+    bool have_id;
+    bool have_score;
+} PineconeMatchParser;
+
+typedef struct PineconeCheckpoint
+{
+    int checkpoint_no; // unused by fetch_ids
+    BlockNumber blkno; // unused in the page's opaque data
+    ItemPointerData tid; // unused in the buffer meta
+    int n_preceding_tuples; 
+    bool is_checkpoint;
+} PineconeCheckpoint;
+
+typedef struct PineconeBufferCandidate
+{
+    double distance;
+    ItemPointerData tid;
+} PineconeBufferCandidate;
+
 typedef struct PineconeScanOpaqueData
 {
     int dimensions;
     VectorMetric metric;
+    int inline_vectors;
     bool first;
 
-    // sorting
-    Tuplesortstate *sortstate;
-    TupleDesc tupdesc;
-    TupleTableSlot *slot; // TODO ??
-    bool isnull;
-    bool more_buffer_tuples;
-    char* bloom_filter;
-    size_t bloom_filter_size;
-
-    // support functions
-    FmgrInfo *procinfo;
+    // the best pinecone.top_k tuples of the local buffer, a max-heap while the buffer is scanned and then sorted
+    PineconeBufferCandidate* buffer_candidates; // NULL until the scan finds a tuple
+    int n_buffer_candidates;
+    int buffer_candidate_index; // next candidate to return
+    struct pinecone_tidset_hash *buffer_tids; // every tid in the local buffer, to drop pinecone's matches that are in it
+
+    // remote query, in flight until the first call to gettuple
+    PineconeQueryRequest* query;
+    PineconeMatchParser parser;
+    char* query_body;
+    PineconeCheckpoint* fetch_checkpoints; // empty if the query isn't accompanied by a liveness fetch
+    PineconeCheckpoint known_ready_checkpoint; // the newest checkpoint a fetch has found
+    PineconeCheckpoint ready_checkpoint; // where the scan of the buffer starts; may be presumed ready
+    TimestampTz liveness_checked_at;
 
     // results
-    cJSON* pinecone_results;
+    PineconeMatch* pinecone_matches;
+    int n_pinecone_matches;
+    int pinecone_match_index; // next match to return
 
 } PineconeScanOpaqueData;
 typedef PineconeScanOpaqueData *PineconeScanOpaque;
@@ -73,12 +145,25 @@ typedef struct PineconeStaticMetaPageData
     char host[PINECONE_HOST_MAX_LENGTH + 1];
     char pinecone_index_name[PINECONE_NAME_MAX_LENGTH + 1];
     VectorMetric metric;
+    int inline_vectors; // fixed when the index is built; zero (off) for indexes created before it existed
 } PineconeStaticMetaPageData;
 typedef PineconeStaticMetaPageData *PineconeStaticMetaPage;
+
+// upsert request bodies under construction, at most vectors_per_request vectors each
+typedef struct PineconeUpsertBatch
+{
+    int vectors_per_request;
+    int n_vectors; // total across all requests
+    int n_requests;
+    int n_in_request; // vectors in the last request
+    int requests_capacity;
+    StringInfoData* requests;
+} PineconeUpsertBatch;
+
 typedef struct PineconeBuildState
 {
     int64 indtuples; // total number of tuples indexed
-    cJSON *json_vectors; // array of json vectors
+    PineconeUpsertBatch batch; // encoded request bodies waiting to be upserted
     char host[100];
 } PineconeBuildState;
 
@@ -89,16 +174,16 @@ typedef struct PineconeOptions
     int         host;
     bool        overwrite; // todo: should this be int?
     bool        skip_build;
+    int         inline_vectors; // off, float4 or float16
 }			PineconeOptions;
 
-typedef struct PineconeCheckpoint
+// when the flush checkpoint reached checkpoint, i.e. everything before it had been upserted
+typedef struct PineconeFlushTime
 {
-    int checkpoint_no; // unused by fetch_ids
-    BlockNumber blkno; // unused in the page's opaque data
-    ItemPointerData tid; // unused in the buffer meta
-    int n_preceding_tuples; 
-    bool is_checkpoint;
-} PineconeCheckpoint;
+    PineconeCheckpoint checkpoint;
+    TimestampTz flushed_at;
+    ItemPointerData representative_tid; // the first row that flush upserted, invalid if it upserted none (all were rolled back or deleted)
+} PineconeFlushTime;
 
 typedef struct PineconeBufferMetaPageData
 {
@@ -107,9 +192,15 @@ typedef struct PineconeBufferMetaPageData
     PineconeCheckpoint flush_checkpoint;
     PineconeCheckpoint latest_checkpoint;
 
-    // INSERT PAGE
+    // INSERT PAGE (the last page in the list)
     BlockNumber insert_page;
     int n_tuples_since_last_checkpoint; // (does not include the tuples on the insert page)
+
+    // STRIPES: the pages inserters are filling; a full page is linked after the insert page
+    BlockNumber stripe_pages[PINECONE_INSERT_STRIPES];
+
+    // FLUSH TIMES of the latest checkpoints, for presuming them ready (zeros in indexes created before they were kept)
+    PineconeFlushTime recent_flushes[PINECONE_RECENT_FLUSHES];
 } PineconeBufferMetaPageData;
 typedef PineconeBufferMetaPageData *PineconeBufferMetaPage;
 
@@ -132,6 +223,41 @@ typedef struct PineconeBufferTuple
 } PineconeBufferTuple;
 #define PINECONE_BUFFER_TUPLE_VACUUMED 1 << 0
 
+// Buffer pages are packed arrays of heap tids from the end of the page header to pd_lower, without line pointers.
+// With inline vectors, the vector of the i-th tid is the i-th (maxaligned) slot down from pd_special, and pd_upper
+// is the end of the last one.
+// Pages written before that hold a PineconeBufferTuple per line pointer: 4 bytes of line pointer below pd_lower for
+// every 8 bytes of tuple above pd_upper. A packed page can't look like that because vector slots are a multiple of 8.
+#define PineconePageIsPacked(page) (((PageHeader) (page))->pd_upper == ((PageHeader) (page))->pd_special || \
+    ((PageHeader) (page))->pd_special - ((PageHeader) (page))->pd_upper != 2 * (((PageHeader) (page))->pd_lower - SizeOfPageHeaderData))
+#define PINECONE_BUFFER_ENTRIES_PER_PAGE(vector_size) \
+    ((BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(PineconeBufferOpaqueData))) / (sizeof(ItemPointerData) + (vector_size)))
+#define PINECONE_PACKED_TIDS_PER_PAGE PINECONE_BUFFER_ENTRIES_PER_PAGE(0)
+#define PineconePageGetInlineVector(page, i, vector_size) \
+    ((char *) (page) + ((PageHeader) (page))->pd_special - ((i) + 1) * (vector_size))
+
+// prefetches the heap blocks of a block-sorted array of tids ahead of their fetch
+typedef struct PineconeHeapPrefetch
+{
+    Relation heap;
+    ItemPointer tids;
+    int n_tids;
+    int distance; // blocks to stay ahead by; 0 to not prefetch
+    int next; // next tid whose block may need prefetching
+    BlockNumber last_prefetched;
+    BlockNumber current;
+    int n_prefetched; // blocks
+    int n_consumed; // blocks
+} PineconeHeapPrefetch;
+
+typedef enum PineconeDeadlineAction
+{
+    PINECONE_DEADLINE_ERROR,
+    PINECONE_DEADLINE_LOCAL_ONLY // answer from the local buffer only
+} PineconeDeadlineAction;
+
+#define PINECONE_MIN_HEDGE_SAMPLES 20 // don't hedge until we have seen this many queries to the host
+
 // GUC variables
 extern char* pinecone_api_key;
 extern int pinecone_top_k;
@@ -139,6 +265,21 @@ extern int pinecone_vectors_per_request;
 extern int pinecone_requests_per_batch;
 extern int pinecone_max_buffer_scan;
 extern int pinecone_max_fetched_vectors_for_liveness_check;
+extern bool pinecone_network_worker;
+extern double pinecone_hedge_percentile;
+extern int pinecone_query_deadline;
+extern int pinecone_query_deadline_action;
+extern int pinecone_breaker_failure_threshold;
+extern int pinecone_breaker_cooldown;
+extern bool pinecone_compress_upserts;
+extern int pinecone_upsert_max_retries;
+extern int pinecone_request_timeout;
+extern int pinecone_stall_timeout;
+extern bool pinecone_background_flush;
+extern bool pinecone_wal_rmgr;
+extern int pinecone_flush_naptime;
+extern int pinecone_liveness_max_age;
+extern double pinecone_presume_ready_factor;
 #define PINECONE_BATCH_SIZE pinecone_vectors_per_request * pinecone_requests_per_batch
 // GUC variables for testing
 #ifdef PINECONE_MOCK
@@ -156,6 +297,25 @@ void no_costestimate(PlannerInfo *root, IndexPath *path, double loop_count,
 					Selectivity *indexSelectivity, double *indexCorrelation,
 					double *indexPages);
 
+// network worker
+void PineconeWorkerInit(void); // shared memory and background worker registration
+PGDLLEXPORT void pinecone_network_worker_main(Datum main_arg);
+
+// background flusher
+Size pinecone_flush_shmem_size(void);
+void pinecone_flush_shmem_init(void);
+bool pinecone_flush_in_background(void);
+PGDLLEXPORT void pinecone_flush_worker_main(Datum main_arg);
+
+// liveness cache
+Size pinecone_liveness_shmem_size(void);
+void pinecone_liveness_shmem_request(void);
+void pinecone_liveness_shmem_init(void);
+bool pinecone_liveness_lookup(Relation index, PineconeCheckpoint* ready_checkpoint);
+void pinecone_liveness_presume(Relation index, PineconeCheckpoint* ready_checkpoint);
+PineconeCheckpoint pinecone_liveness_observe(Relation index, PineconeCheckpoint known_ready_checkpoint, PineconeCheckpoint* fetched_checkpoints, cJSON* fetch_response, TimestampTz observed_at);
+void pinecone_liveness_poll(Relation index);
+
 // build
 void generateRandomAlphanumeric(char *s, const int length);
 char* get_pinecone_index_name(Relation index);
@@ -163,21 +323,26 @@ IndexBuildResult *pinecone_build(Relation heap, Relation index, IndexInfo *index
 char* CreatePineconeIndexAndWait(Relation index, cJSON* spec_json, VectorMetric metric, char* pinecone_index_name, int dimensions);
 void InsertBaseTable(Relation heap, Relation index, IndexInfo *indexInfo, char* host, IndexBuildResult *result);
 void pinecone_build_callback(Relation index, ItemPointer tid, Datum *values, bool *isnull, bool tupleIsAlive, void *state);
-void InitIndexPages(Relation index, VectorMetric metric, int dimensions, char *pinecone_index_name, char *host, int forkNum);
+void InitIndexPages(Relation index, VectorMetric metric, int dimensions, int inline_vectors, char *pinecone_index_name, char *host, int forkNum);
 void pinecone_buildempty(Relation index);
 void no_buildempty(Relation index); // for some reason this is never called even when the base table is empty
 VectorMetric get_opclass_metric(Relation index);
 
 // insert
-bool AppendBufferTupleInCtx(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid, Relation heapRel, IndexUniqueCheck checkUnique, IndexInfo *indexInfo);
 void PineconePageInit(Page page, Size pageSize);
-bool AppendBufferTuple(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid, Relation heapRel);
+bool AppendBufferTuples(Relation index, ItemPointer heap_tids, char* vectors, int vector_size, int n_tids);
+void AppendPendingBufferTuples(Relation index);
+void FlushLeftBehindCheckpoints(Relation index);
+bool LinkIdleStripePages(Relation index);
 bool pinecone_insert(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid,
                      Relation heap, IndexUniqueCheck checkUnique, 
 #if PG_VERSION_NUM >= 140000
                      bool indexUnchanged, 
 #endif
                      IndexInfo *indexInfo);
+#if PG_VERSION_NUM >= 170000
+void pinecone_insert_cleanup(Relation index, IndexInfo *indexInfo);
+#endif
 void FlushToPinecone(Relation index);
 
 // scan
@@ -186,14 +351,66 @@ cJSON* pinecone_build_filter(Relation index, ScanKey keys, int nkeys);
 void pinecone_rescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, int norderbys);
 void load_buffer_into_sort(Relation index, PineconeScanOpaque so, Datum query_datum, TupleDesc index_tupdesc);
 bool pinecone_gettuple(IndexScanDesc scan, ScanDirection dir);
-void no_endscan(IndexScanDesc scan);
-PineconeCheckpoint* get_checkpoints_to_fetch(Relation index);
+void pinecone_endscan(IndexScanDesc scan);
+PineconeCheckpoint* get_checkpoints_to_fetch(Relation index, PineconeCheckpoint ready_checkpoint);
 PineconeCheckpoint get_best_fetched_checkpoint(Relation index, PineconeCheckpoint* checkpoints, cJSON* fetch_results);
 cJSON *fetch_ids_from_checkpoints(PineconeCheckpoint *checkpoints);
-#define BUFFER_BLOOM_K 20 // bloom filter k 
 
 
 
+// wal
+#define PINECONE_RMGR_ID 128 // RM_EXPERIMENTAL_ID, only registered with pinecone.wal_rmgr on
+#define PINECONE_WAL_MAX_BUFFERS 4
+#define XLOG_PINECONE_APPEND 0x00 // add tids to a stripe page
+#define XLOG_PINECONE_INIT_STRIPE 0x10 // give a stripe its first page
+#define XLOG_PINECONE_LINK 0x20 // link a stripe page after the insert page and give the stripe a new page
+#define XLOG_PINECONE_SET_META 0x30 // set the buffer meta (e.g. advance the flush checkpoint)
+
+typedef struct xl_pinecone_append
+{
+    int n_tids;
+    int vector_size; // of each inline vector, which follow the tids
+    ItemPointerData tids[FLEXIBLE_ARRAY_MEMBER];
+} xl_pinecone_append;
+#define SizeOfPineconeAppend(n_tids, vector_size) (offsetof(xl_pinecone_append, tids) + (n_tids) * (sizeof(ItemPointerData) + (vector_size)))
+#define XLogPineconeAppendGetVectors(xlrec) ((char *) &(xlrec)->tids[(xlrec)->n_tids])
+
+typedef struct xl_pinecone_init_stripe
+{
+    int stripe;
+} xl_pinecone_init_stripe;
+
+typedef struct xl_pinecone_link
+{
+    int stripe;
+    bool create_checkpoint;
+    int n_tuples_since_last_checkpoint; // the meta's, after the link
+    BlockNumber prev_checkpoint_blkno; // for the stripe page, if it is a new checkpoint
+    PineconeCheckpoint checkpoint;
+} xl_pinecone_link;
+
+typedef struct PineconeWalState
+{
+    Relation index;
+    struct GenericXLogState *generic; // NULL when we write our own records
+    int n_buffers;
+    Buffer buffers[PINECONE_WAL_MAX_BUFFERS];
+    bool will_init[PINECONE_WAL_MAX_BUFFERS];
+} PineconeWalState;
+
+void PineconeXLogInit(void);
+void pinecone_wal_start(PineconeWalState* wal, Relation index);
+Page pinecone_wal_register(PineconeWalState* wal, Buffer buf, bool will_init);
+void pinecone_wal_begin_changes(PineconeWalState* wal);
+void pinecone_wal_finish(PineconeWalState* wal, uint8 info, char* data, int len);
+void pinecone_page_add_tids(Page page, ItemPointer tids, char* vectors, int vector_size, int n_tids);
+int PineconePageGetNTids(Page page);
+ItemPointer PineconePageGetTids(Page page, int *n_tids);
+int PineconePageGetTidRoom(Page page, int vector_size);
+void pinecone_apply_init_stripe(Page buffer_meta_page, int stripe, BlockNumber blkno);
+void pinecone_apply_set_meta(Page buffer_meta_page, PineconeBufferMetaPageData* buffer_meta);
+void pinecone_apply_link(Page stripe_page, BlockNumber stripe_blkno, Page insert_page, Page buffer_meta_page, BlockNumber new_blkno, xl_pinecone_link *xlrec);
+
 // vacuum
 IndexBulkDeleteResult *pinecone_bulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
                                      IndexBulkDeleteCallback callback, void *callback_state);
@@ -202,15 +419,26 @@ IndexBulkDeleteResult *no_vacuumcleanup(IndexVacuumInfo *info, IndexBulkDeleteRe
 // validate
 void pinecone_spec_validator(const PineconeOptions *opts);
 void pinecone_host_validator(const char *spec);
+void pinecone_inline_vectors_validator(const char *value);
+int pinecone_inline_vectors_from_string(const char *value);
 void validate_api_key(void);
 void validate_vector_nonzero(Vector* vector);
 bool no_validate(Oid opclassoid);
 
+// json
+// encoding request bodies
+void pinecone_append_vector_json(StringInfo buf, TupleDesc tup_desc, Datum *values, bool *isnull, ItemPointerData heap_tid);
+void pinecone_upsert_batch_init(PineconeUpsertBatch *batch, int vectors_per_request);
+void pinecone_upsert_batch_add(PineconeUpsertBatch *batch, TupleDesc tup_desc, Datum *values, bool *isnull, ItemPointerData heap_tid);
+char** pinecone_upsert_batch_bodies(PineconeUpsertBatch *batch);
+void pinecone_upsert_batch_reset(PineconeUpsertBatch *batch);
+char* pinecone_query_body(Vector *vector, int top_k, cJSON *filter);
+// decoding query responses
+void pinecone_match_parser_init(PineconeMatchParser *parser);
+void pinecone_match_parser_finish(PineconeMatchParser *parser);
+
 // utils
-// converting between postgres tuples and json vectors
-cJSON* tuple_get_pinecone_vector(TupleDesc tup_desc, Datum *values, bool *isnull, char *vector_id);
-cJSON* index_tuple_get_pinecone_vector(Relation index, IndexTuple itup);
-cJSON* heap_tuple_get_pinecone_vector(Relation heap, HeapTuple htup);
+// converting between postgres tuples and pinecone ids
 char* pinecone_id_from_heap_tid(ItemPointerData heap_tid);
 ItemPointerData pinecone_id_get_heap_tid(char *id);
 cJSON* text_array_get_json(Datum value);
@@ -218,12 +446,20 @@ cJSON* text_array_get_json(Datum value);
 PineconeStaticMetaPageData PineconeSnapshotStaticMeta(Relation index);
 PineconeBufferMetaPageData PineconeSnapshotBufferMeta(Relation index);
 PineconeBufferOpaqueData PineconeSnapshotBufferOpaque(Relation index, BlockNumber blkno);
+// inline vectors
+int pinecone_inline_vector_size(int inline_vectors, int dimensions);
+void pinecone_encode_inline_vector(Vector* vector, int inline_vectors, char* out);
+void pinecone_decode_inline_vector(char* in, int inline_vectors, Vector* out);
 void set_buffer_meta_page(Relation index, PineconeCheckpoint* ready_checkpoint, PineconeCheckpoint* flush_checkpoint, PineconeCheckpoint* latest_checkpoint, BlockNumber* insert_page, int* n_tuples_since_last_checkpoint);
 char* checkpoint_to_string(PineconeCheckpoint checkpoint);
 char* buffer_meta_to_string(PineconeBufferMetaPageData buffer_meta);
 char* buffer_opaque_to_string(PineconeBufferOpaqueData buffer_opaque);
 void pinecone_print_relation(Relation index);
-// hashing and bloom filters
+// reading the heap in block order
+void pinecone_sort_tids(ItemPointer tids, int n_tids);
+void pinecone_heap_prefetch_init(PineconeHeapPrefetch* prefetch, Relation heap, ItemPointer tids, int n_tids);
+void pinecone_heap_prefetch(PineconeHeapPrefetch* prefetch, int current);
+// hashing
 uint64 murmurhash64(uint64 data);
 uint32 hash_tid(ItemPointerData tid, int seed);
 
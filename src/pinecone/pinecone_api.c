@@ -1,6 +1,11 @@
 #include "pinecone_api.h"
 #include "pinecone.h"
 #include "postgres.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "portability/instr_time.h"
+#include "storage/latch.h"
+#include "utils/memutils.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -8,32 +13,50 @@
 #include "src/cJSON.h"
 
 #include <time.h>
+#include <math.h>
 
 #include <stdlib.h>
 
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
 
 
+#define PINECONE_MIN_RESPONSE_CAPACITY 1024
+#define PINECONE_MAX_RESPONSE_PRESIZE (64 * 1024 * 1024) // don't trust a larger Content-Length up front
+
 size_t write_callback(char *contents, size_t size, size_t nmemb, void *userdata) {
     size_t real_size = size * nmemb; // Size of the response
     ResponseData *response_data = (ResponseData *)userdata; // Cast the userdata to the specific structure
+    size_t needed = response_data->length + real_size + 1;
 
-    // Attempt to resize the buffer
-    char *new_data = realloc(response_data->data, response_data->length + real_size + 1);
-    if (new_data != NULL) {
-        response_data->data = new_data;
-        memcpy(response_data->data + response_data->length, contents, real_size); // Append new data
-        response_data->length += real_size;
-        response_data->data[response_data->length] = '\0'; // Null terminate the string
+    if (response_data->match_parser != NULL) {
+        pinecone_match_parser_feed(response_data->match_parser, contents, real_size);
+        return real_size;
     }
 
-    if (response_data->request_body != NULL) {
-        // free the request body
-        elog(DEBUG1, "Freeing request body");
-        free(response_data->request_body);
-        response_data->request_body = NULL; // so that subsequent calls to write_callback don't free the request body again
+    // grow the buffer geometrically, starting from the announced length
+    if (needed > response_data->capacity) {
+        MemoryContext context = (response_data->context != NULL) ? (MemoryContext) response_data->context : CurrentMemoryContext;
+        size_t capacity = Max(response_data->capacity * 2, PINECONE_MIN_RESPONSE_CAPACITY);
+        char *new_data;
+        if (response_data->data == NULL) capacity = Max(capacity, Min(response_data->expected_length, PINECONE_MAX_RESPONSE_PRESIZE) + 1);
+        while (capacity < needed) capacity *= 2;
+        // we can't raise an error inside curl; returning short makes the transfer fail with CURLE_WRITE_ERROR
+        new_data = MemoryContextAllocExtended(context, capacity, MCXT_ALLOC_HUGE | MCXT_ALLOC_NO_OOM);
+        if (new_data == NULL) return 0;
+        if (response_data->data != NULL) {
+            memcpy(new_data, response_data->data, response_data->length);
+            pfree(response_data->data);
+        }
+        response_data->data = new_data;
+        response_data->capacity = capacity;
     }
+    memcpy(response_data->data + response_data->length, contents, real_size); // Append new data
+    response_data->length += real_size;
+    response_data->data[response_data->length] = '\0'; // Null terminate the string
 
-    elog(DEBUG1, "Response (write_callback): %s", contents);
+    elog(DEBUG1, "Response (write_callback): %.*s", (int) real_size, contents);
 
     return real_size;
 }
@@ -47,57 +70,296 @@ struct curl_slist *create_common_headers(const char *api_key) {
     return headers;
 }
 
+// remember the Content-Length so that write_callback can allocate the whole body at once, and the Retry-After of a 429
+size_t header_callback(char *buffer, size_t size, size_t nitems, void *userdata) {
+    ResponseData *response_data = (ResponseData *)userdata;
+    size_t real_size = size * nitems;
+    const char *name = "content-length:";
+    const char *retry_after = "retry-after:";
+    if (real_size > strlen(name) && pg_strncasecmp(buffer, name, strlen(name)) == 0) {
+        char header[32];
+        strlcpy(header, buffer + strlen(name), Min(real_size - strlen(name) + 1, sizeof(header)));
+        response_data->expected_length = strtoull(header, NULL, 10);
+    }
+    if (real_size > strlen(retry_after) && pg_strncasecmp(buffer, retry_after, strlen(retry_after)) == 0) {
+        char header[32];
+        strlcpy(header, buffer + strlen(retry_after), Min(real_size - strlen(retry_after) + 1, sizeof(header)));
+        response_data->retry_after_ms = strtod(header, NULL) * 1000; // a date (rather than seconds) parses as 0
+    }
+    return real_size;
+}
+
 void set_curl_options(CURL *hnd, const char *api_key, const char *url, const char *method, ResponseData *response_data) {
-    struct curl_slist *headers = create_common_headers(api_key);
-    curl_easy_setopt(hnd, CURLOPT_HTTPHEADER, headers);
+    response_data->headers = create_common_headers(api_key);
+    curl_easy_setopt(hnd, CURLOPT_HTTPHEADER, response_data->headers);
     curl_easy_setopt(hnd, CURLOPT_CUSTOMREQUEST, method);
     curl_easy_setopt(hnd, CURLOPT_URL, url);
     curl_easy_setopt(hnd, CURLOPT_WRITEDATA, response_data);
     curl_easy_setopt(hnd, CURLOPT_WRITEFUNCTION, write_callback);
+    curl_easy_setopt(hnd, CURLOPT_HEADERDATA, response_data);
+    curl_easy_setopt(hnd, CURLOPT_HEADERFUNCTION, header_callback);
+    set_curl_timeouts(hnd, pinecone_request_timeout, pinecone_stall_timeout);
     strcpy(response_data->method, method); // save the method in the response_data
 }
 
-// Declare the CURL handle as a global variable
-CURL *hnd_t;
+// bound the request by request_timeout_ms, and abort it once less than a byte a second has moved for stall_timeout_s (0 for no limit)
+void set_curl_timeouts(CURL *hnd, int request_timeout_ms, int stall_timeout_s) {
+    curl_easy_setopt(hnd, CURLOPT_TIMEOUT_MS, (long) request_timeout_ms);
+    curl_easy_setopt(hnd, CURLOPT_LOW_SPEED_LIMIT, stall_timeout_s > 0 ? 1L : 0L);
+    curl_easy_setopt(hnd, CURLOPT_LOW_SPEED_TIME, (long) stall_timeout_s);
+}
+
+/*
+ * Per-backend connection cache.
+ *
+ * Every handle we hand out is attached to a single libcurl share object which
+ * holds the DNS cache, the TLS session cache and the connection cache. Both
+ * live for the whole backend, so after the first request to a host, later
+ * queries and flushes reuse a warm keep-alive connection instead of paying for
+ * a new TCP and TLS handshake.
+ * Idle easy handles are pooled per host so that we don't curl_easy_init() (and
+ * leak) a fresh handle for every request.
+ */
+#define PINECONE_MAX_IDLE_HANDLES_PER_HOST 16
+
+typedef struct PineconeHostConnections {
+    char host[PINECONE_HOST_MAX_LENGTH + 1];
+    CURL* idle_handles[PINECONE_MAX_IDLE_HANDLES_PER_HOST];
+    int n_idle;
+    PineconeHostStats stats;
+    struct PineconeHostConnections* next;
+} PineconeHostConnections;
+
+static CURLSH* pinecone_share = NULL;
+static PineconeHostConnections* pinecone_connections = NULL;
+
+static CURLSH* get_pinecone_share(void) {
+    if (pinecone_share == NULL) {
+        pinecone_share = curl_share_init();
+        if (pinecone_share == NULL) {
+            elog(ERROR, "Failed to initialize CURL share handle");
+        }
+        curl_share_setopt(pinecone_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(pinecone_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        curl_share_setopt(pinecone_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    }
+    return pinecone_share;
+}
+
+/*
+ * Copy the host part of a url like https://{host}/path?query into host
+ */
+static void url_get_host(const char *url, char *host) {
+    const char* start = strstr(url, "://");
+    size_t len;
+    start = (start == NULL) ? url : start + 3;
+    len = strcspn(start, "/?");
+    if (len > PINECONE_HOST_MAX_LENGTH) len = PINECONE_HOST_MAX_LENGTH;
+    memcpy(host, start, len);
+    host[len] = '\0';
+}
+
+static PineconeHostConnections* get_host_connections(const char *url) {
+    char host[PINECONE_HOST_MAX_LENGTH + 1];
+    PineconeHostConnections* conns;
+    url_get_host(url, host);
+    for (conns = pinecone_connections; conns != NULL; conns = conns->next) {
+        if (strcmp(conns->host, host) == 0) return conns;
+    }
+    // first request to this host in this backend
+    conns = MemoryContextAllocZero(TopMemoryContext, sizeof(PineconeHostConnections));
+    strcpy(conns->host, host);
+    conns->next = pinecone_connections;
+    pinecone_connections = conns;
+    return conns;
+}
+
+PineconeHostStats* pinecone_get_host_stats(const char *host) {
+    return &get_host_connections(host)->stats;
+}
+
+/*
+ * Iterate over the hosts this backend has talked to
+ */
+bool pinecone_host_stats_at(int i, const char **host, PineconeHostStats **stats) {
+    PineconeHostConnections* conns = pinecone_connections;
+    while (conns != NULL && i-- > 0) conns = conns->next;
+    if (conns == NULL) return false;
+    *host = conns->host;
+    *stats = &conns->stats;
+    return true;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Latency below which percentile percent of the recent queries to the host were answered, -1 if there are no samples
+ */
+double pinecone_latency_percentile(PineconeHostStats* stats, double percentile) {
+    double sorted[PINECONE_LATENCY_SAMPLES];
+    int k;
+    if (stats->n_samples == 0) return -1;
+    memcpy(sorted, stats->latency_ms, sizeof(double) * stats->n_samples);
+    qsort(sorted, stats->n_samples, sizeof(double), compare_doubles);
+    k = (int) ceil(percentile / 100 * stats->n_samples) - 1;
+    return sorted[Max(0, Min(k, stats->n_samples - 1))];
+}
+
+static void record_latency(PineconeHostStats* stats, double latency_ms) {
+    stats->latency_ms[stats->next_sample] = latency_ms;
+    stats->next_sample = (stats->next_sample + 1) % PINECONE_LATENCY_SAMPLES;
+    if (stats->n_samples < PINECONE_LATENCY_SAMPLES) stats->n_samples++;
+}
+
+// wall clock time in milliseconds
+static double pinecone_now_ms(void) {
+    instr_time now;
+    INSTR_TIME_SET_CURRENT(now);
+    return INSTR_TIME_GET_MILLISEC(now);
+}
+
+// transport errors and server errors count against the host; client errors are our fault
+static bool is_failure(const ResponseData* response_data, CURLcode code) {
+    if (code != CURLE_OK) return true;
+    return response_data->status >= 500;
+}
+
+/*
+ * Circuit breaker
+ *
+ * After pinecone.breaker_failure_threshold consecutive failed requests to a host the breaker opens:
+ * the planner stops choosing indexes on that host and scans fail fast instead of waiting on it.
+ * Once pinecone.breaker_cooldown has passed, the next request is let through as a probe (half open).
+ * A success closes the breaker again and a failure reopens it for another cooldown.
+ */
+void pinecone_record_outcome(PineconeHostStats* stats, const char *host, bool failed) {
+    if (!failed) {
+        if (stats->breaker_state != PINECONE_BREAKER_CLOSED) {
+            ereport(LOG, (errmsg("Pinecone host %s is answering again", host)));
+        }
+        stats->breaker_state = PINECONE_BREAKER_CLOSED;
+        stats->consecutive_failures = 0;
+        return;
+    }
+    stats->n_failures++;
+    stats->consecutive_failures++;
+    if (stats->breaker_state == PINECONE_BREAKER_HALF_OPEN ||
+        (stats->breaker_state == PINECONE_BREAKER_CLOSED && pinecone_breaker_failure_threshold > 0 &&
+         stats->consecutive_failures >= pinecone_breaker_failure_threshold)) {
+        stats->breaker_state = PINECONE_BREAKER_OPEN;
+        stats->breaker_opened_ms = pinecone_now_ms();
+        stats->n_breaker_trips++;
+        ereport(WARNING, (errcode(ERRCODE_CONNECTION_FAILURE),
+                          errmsg("Pinecone host %s is unhealthy after %d consecutive failed requests", host, stats->consecutive_failures),
+                          errhint("Queries will not use pinecone indexes on this host for the next %d ms.", pinecone_breaker_cooldown)));
+    }
+}
+
+/*
+ * True if the breaker is open and the cooldown hasn't passed yet
+ */
+bool pinecone_breaker_is_open(PineconeHostStats* stats) {
+    return stats->breaker_state == PINECONE_BREAKER_OPEN && pinecone_now_ms() - stats->breaker_opened_ms < pinecone_breaker_cooldown;
+}
+
+/*
+ * May a request be sent to the host? Lets a probe through once the cooldown has passed.
+ */
+bool pinecone_host_available(PineconeHostStats* stats) {
+    if (pinecone_breaker_is_open(stats)) return false;
+    if (stats->breaker_state == PINECONE_BREAKER_OPEN) stats->breaker_state = PINECONE_BREAKER_HALF_OPEN;
+    return true;
+}
+
+/*
+ * Is any breaker open? Lets the planner skip reading index meta pages in the common case.
+ */
+bool pinecone_any_breaker_open(void) {
+    for (PineconeHostConnections* conns = pinecone_connections; conns != NULL; conns = conns->next) {
+        if (pinecone_breaker_is_open(&conns->stats)) return true;
+    }
+    return false;
+}
+
+/*
+ * Get a handle for a request to url, reusing an idle handle for the same host when there is one.
+ * The handle must be given back with pinecone_release_handle once the request is finished.
+ */
+CURL* pinecone_acquire_handle(const char *url) {
+    PineconeHostConnections* conns = get_host_connections(url);
+    CURL* hnd;
+    if (conns->n_idle > 0) {
+        hnd = conns->idle_handles[--conns->n_idle];
+    } else {
+        elog(DEBUG2, "Initializing CURL handle for %s", conns->host);
+        hnd = curl_easy_init();
+        if (hnd == NULL) {
+            elog(ERROR, "Failed to initialize CURL handle");
+        }
+    }
+    curl_easy_setopt(hnd, CURLOPT_SHARE, get_pinecone_share());
+    curl_easy_setopt(hnd, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(hnd, CURLOPT_PRIVATE, conns); // remember which pool to return the handle to
+    return hnd;
+}
+
+/*
+ * Reset a handle and return it to its host's pool.
+ * Resetting keeps the live connections of the handle (and the share), only the options are cleared.
+ */
+void pinecone_release_handle(CURL* hnd) {
+    PineconeHostConnections* conns = NULL;
+    if (hnd == NULL) return;
+    curl_easy_getinfo(hnd, CURLINFO_PRIVATE, (char**) &conns);
+    curl_easy_reset(hnd);
+    if (conns != NULL && conns->n_idle < PINECONE_MAX_IDLE_HANDLES_PER_HOST) {
+        conns->idle_handles[conns->n_idle++] = hnd;
+    } else {
+        curl_easy_cleanup(hnd);
+    }
+}
 
 cJSON* generic_pinecone_request(const char *api_key, const char *url, const char *method, cJSON *body, bool expect_json_response) {
-    // CURL *hnd = curl_easy_init();
+    CURL *hnd = pinecone_acquire_handle(url);
     ResponseData response_data = {"", NULL, NULL, 0, ""};
+    ResponseData *response_data_ptr = &response_data;
     cJSON *response_json, *error;
     CURLcode ret;
 
-    // Initialize the CURL handle if it hasn't been initialized yet
-    if (hnd_t == NULL) {
-        elog(DEBUG2, "Initializing CURL handle");
-        hnd_t = curl_easy_init();
-        if (hnd_t == NULL) {
-            elog(ERROR, "Failed to initialize CURL handle");
-        }
-    }
+    response_data.context = AllocSetContextCreate(CurrentMemoryContext, "Pinecone response", ALLOCSET_DEFAULT_SIZES);
 
     // prepare the request
-    set_curl_options(hnd_t, api_key, url, method, &response_data);
+    set_curl_options(hnd, api_key, url, method, &response_data);
     if (body != NULL) {
-        char* body_str = cJSON_Print(body);
+        char* body_str = cJSON_PrintUnformatted(body);
         response_data.request_body = body_str;
-        curl_easy_setopt(hnd_t, CURLOPT_POSTFIELDS, body_str);
+        curl_easy_setopt(hnd, CURLOPT_POSTFIELDS, body_str);
     }
 
     // perform the request
     #ifdef PINECONE_MOCK
     if (pinecone_use_mock_response) {
-        lookup_mock_response(hnd_t, &response_data, &ret);
+        lookup_mock_response(hnd, &response_data, &ret);
         elog(DEBUG1, "Mock response: %s", response_data.data);
         elog(DEBUG1, "Mock response ret: %d", ret);
     } else {
     #endif
-    ret = curl_easy_perform(hnd_t);
+    if (!pinecone_network_worker_perform(api_key, &hnd, &response_data_ptr, &ret, 1)) {
+        ret = curl_easy_perform(hnd);
+        curl_easy_getinfo(hnd, CURLINFO_RESPONSE_CODE, &response_data.status);
+    }
     #ifdef PINECONE_MOCK
     }
     #endif
 
     // cleanup
-    curl_easy_reset(hnd_t);
+    pinecone_record_outcome(pinecone_get_host_stats(url), url, is_failure(&response_data, ret));
+    pinecone_release_handle(hnd);
+    curl_slist_free_all(response_data.headers);
+    if (response_data.request_body != NULL) free(response_data.request_body);
 
 
     // TODO: We need check the ret code in the other endpoints as well
@@ -108,6 +370,7 @@ cJSON* generic_pinecone_request(const char *api_key, const char *url, const char
 
     // parse the response
     if (!expect_json_response) {
+        MemoryContextDelete(response_data.context);
         return NULL;
     }
     response_json = cJSON_Parse(response_data.data);
@@ -115,6 +378,7 @@ cJSON* generic_pinecone_request(const char *api_key, const char *url, const char
     if (response_json == NULL) {
         elog(ERROR, "Failed to parse response from Pinecone API. Response: %s", response_data.data);
     }
+    MemoryContextDelete(response_data.context);
     // report if json has an error field
     error = cJSON_GetObjectItemCaseSensitive(response_json, "error");
     if (error != NULL) {
@@ -189,232 +453,663 @@ cJSON* pinecone_create_index(const char *api_key, const char *index_name, const
     return generic_pinecone_request(api_key, "https://api.pinecone.io/indexes", "POST", request, true);
 }
 
-CURL* multi_hnd_for_query;
-cJSON** pinecone_query_with_fetch(const char *api_key, const char *index_host, const int topK, cJSON *query_vector_values, cJSON *filter, bool with_fetch, cJSON* fetch_ids) {
-    CURL *query_handle, *fetch_handle;
-    cJSON** responses = palloc(2 * sizeof(cJSON*)); // allocate space to return two cJSON* pointers for the query and fetch responses
-    ResponseData query_response_data = {"", NULL, NULL, 0, ""};
-    ResponseData fetch_response_data = {"", NULL, NULL, 0, ""};
-    clock_t start, stop;
-    int running;
+/*
+ * Start a query and optionally a fetch of the liveness checkpoint vectors without waiting for them.
+ * The matches are decoded into matches as they arrive. Drive the request with pinecone_query_poll
+ * while doing other work and collect it with pinecone_query_finish (or drop it with pinecone_query_abort).
+ * query_body must stay valid until then.
+ *
+ * When pinecone.hedge_percentile is set and the query hasn't been answered within that percentile of the
+ * host's recent latencies, the same query is sent again and whichever response arrives first is used.
+ */
+PineconeQueryRequest* pinecone_query_start(const char *api_key, const char *index_host, char *query_body, struct PineconeMatchParser *matches, bool with_fetch, cJSON* fetch_ids) {
+    PineconeQueryRequest* request = palloc0(sizeof(PineconeQueryRequest));
 
+    request->api_key = pstrdup(api_key);
+    request->index_host = pstrdup(index_host);
+    request->query_body = query_body;
+    request->matches = matches;
+    request->winner = -1;
+    request->stats = pinecone_get_host_stats(index_host);
+    if (!pinecone_host_available(request->stats)) {
+        ereport(ERROR, (errcode(ERRCODE_CONNECTION_FAILURE),
+                        errmsg("Pinecone host %s is unavailable", index_host),
+                        errdetail("Recent requests to the host failed. The next query will be tried after pinecone.breaker_cooldown."),
+                        errhint("Replan the query to use another index or a sequential scan.")));
+    }
+    request->stats->n_queries++;
+    request->hedge_delay_ms = -1;
+    if (pinecone_hedge_percentile > 0 && request->stats->n_samples >= PINECONE_MIN_HEDGE_SAMPLES) {
+        request->hedge_delay_ms = pinecone_latency_percentile(request->stats, pinecone_hedge_percentile);
+    }
 
+    request->response_datas[PINECONE_QUERY_HANDLE] = (ResponseData) {"", NULL, NULL, 0, "", matches};
+    request->response_datas[PINECONE_FETCH_HANDLE] = (ResponseData) {"", NULL, NULL, 0, ""};
+    // the fetch response is buffered in the request's context until pinecone_query_finish has parsed it
+    request->response_datas[PINECONE_FETCH_HANDLE].context = CurrentMemoryContext;
+    for (int i = 0; i < 3; i++) request->response_data_ptrs[i] = &request->response_datas[i];
+    request->handles[PINECONE_QUERY_HANDLE] = get_pinecone_query_handle(api_key, index_host, query_body, &request->response_datas[PINECONE_QUERY_HANDLE]);
+    request->n_handles = 1;
+    if (with_fetch) {
+        request->handles[PINECONE_FETCH_HANDLE] = get_pinecone_fetch_handle(api_key, index_host, fetch_ids, &request->response_datas[PINECONE_FETCH_HANDLE]);
+        request->n_handles = 2;
+    }
+    request->started_ms[PINECONE_QUERY_HANDLE] = request->started_ms[PINECONE_FETCH_HANDLE] = pinecone_now_ms();
 
-    if (multi_hnd_for_query == NULL) {
-        multi_hnd_for_query = curl_multi_init();
-        if (multi_hnd_for_query == NULL) {
-            elog(ERROR, "Failed to initialize CURL multi handle");
+    #ifdef PINECONE_MOCK
+    // the mocked responses are answered right away but only arrive after their delay (see pinecone_query_poll)
+    if (pinecone_use_mock_response) {
+        for (int i = 0; i < request->n_handles; i++) {
+            lookup_mock_response(request->handles[i], &request->response_datas[i], &request->codes[i]);
         }
+        request->mocked = true;
+        return request;
     }
+    #endif
 
-    query_handle = get_pinecone_query_handle(api_key, index_host, topK, query_vector_values, filter, &query_response_data);
-    curl_multi_add_handle(multi_hnd_for_query, query_handle);
+    // hand the requests to the network worker if there is one (the worker does its own multiplexing, so no hedging)
+    request->network_job = pinecone_network_worker_submit(api_key, request->handles, request->response_data_ptrs, request->codes, request->n_handles);
+    if (request->network_job != NULL) {
+        elog(DEBUG2, "Query and fetch submitted to the network worker");
+        return request;
+    }
 
-    if (with_fetch) {
-        fetch_handle = get_pinecone_fetch_handle(api_key, index_host, fetch_ids, &fetch_response_data);
-        curl_multi_add_handle(multi_hnd_for_query, fetch_handle);
+    // otherwise run them on a multi handle of our own; the connections still come from the connection cache
+    request->multi = pinecone_multi_create();
+    for (int i = 0; i < request->n_handles; i++) {
+        pinecone_multi_add(request->multi, request->handles[i]);
     }
+    pinecone_multi_wait(request->multi, 0); // get the connections going
+    return request;
+}
 
-    // todo: does curl let you specify an allocator like cJSON?
+// send the query a second time
+static void pinecone_query_hedge(PineconeQueryRequest* request) {
+    ResponseData* response_data = &request->response_datas[PINECONE_HEDGE_HANDLE];
+    request->hedge_matches = palloc(sizeof(PineconeMatchParser));
+    pinecone_match_parser_init(request->hedge_matches);
+    *response_data = (ResponseData) {"", NULL, NULL, 0, "", request->hedge_matches};
+    request->handles[PINECONE_HEDGE_HANDLE] = get_pinecone_query_handle(request->api_key, request->index_host, request->query_body, response_data);
+    request->started_ms[PINECONE_HEDGE_HANDLE] = pinecone_now_ms();
+    #ifdef PINECONE_MOCK
+    if (request->mocked) {
+        lookup_mock_response(request->handles[PINECONE_HEDGE_HANDLE], response_data, &request->codes[PINECONE_HEDGE_HANDLE]);
+    } else {
+    #endif
+    pinecone_multi_add(request->multi, request->handles[PINECONE_HEDGE_HANDLE]);
+    #ifdef PINECONE_MOCK
+    }
+    #endif
+    request->hedged = true;
+    request->stats->n_hedged++;
+    elog(DEBUG1, "Pinecone query to %s not answered within %.1f ms, sending it again", request->index_host, request->hedge_delay_ms);
+}
 
+// the query (or its hedge) has answered; drop the other one
+static void pinecone_query_set_winner(PineconeQueryRequest* request, int winner) {
+    int loser = (winner == PINECONE_QUERY_HANDLE) ? PINECONE_HEDGE_HANDLE : PINECONE_QUERY_HANDLE;
+    request->winner = winner;
+    if (request->hedged && !request->completed[loser]) {
+        if (request->multi != NULL) pinecone_multi_remove(request->multi, request->handles[loser]);
+        request->completed[loser] = true;
+    }
+    if (winner == PINECONE_HEDGE_HANDLE) {
+        // the caller reads the matches from its own parser
+        *request->matches = *request->hedge_matches;
+        request->codes[PINECONE_QUERY_HANDLE] = request->codes[PINECONE_HEDGE_HANDLE];
+        request->response_datas[PINECONE_QUERY_HANDLE].status = request->response_datas[PINECONE_HEDGE_HANDLE].status;
+        request->stats->n_hedge_wins++;
+    }
+    if (is_failure(&request->response_datas[winner], request->codes[winner])) {
+        pinecone_record_outcome(request->stats, request->index_host, true);
+    } else {
+        pinecone_record_outcome(request->stats, request->index_host, false);
+        record_latency(request->stats, pinecone_now_ms() - request->started_ms[winner]);
+    }
+}
+
+/*
+ * Make progress on the request without blocking. Returns true once both responses have arrived.
+ */
+bool pinecone_query_poll(PineconeQueryRequest* request) {
+    int n_msgs;
+    CURLMsg* msg;
+    if (request->done) return true;
+    if (request->network_job != NULL) {
+        request->done = pinecone_network_worker_poll(request->network_job, false);
+        if (request->done) {
+            bool failed;
+            request->network_job = NULL;
+            request->winner = PINECONE_QUERY_HANDLE;
+            // the worker filled in the status; our copies of the handles never ran
+            failed = is_failure(&request->response_datas[PINECONE_QUERY_HANDLE], request->codes[PINECONE_QUERY_HANDLE]);
+            pinecone_record_outcome(request->stats, request->index_host, failed);
+            if (!failed) record_latency(request->stats, pinecone_now_ms() - request->started_ms[PINECONE_QUERY_HANDLE]);
+        }
+        return request->done;
+    }
 
-    // perform the request
     #ifdef PINECONE_MOCK
-    if (pinecone_use_mock_response) {
-        CURLcode query_ret, fetch_ret;
-        lookup_mock_response(query_handle, &query_response_data, &query_ret);
-        elog(DEBUG1, "Mock query response: %s", query_response_data.data);
-        if (with_fetch) {
-            lookup_mock_response(fetch_handle, &fetch_response_data, &fetch_ret);
-            elog(DEBUG1, "Mock fetch response: %s", fetch_response_data.data);
+    if (request->mocked) {
+        // a mocked response arrives once its delay has passed
+        for (int i = 0; i < 3; i++) {
+            if (request->handles[i] == NULL || request->completed[i]) continue;
+            if (pinecone_now_ms() - request->started_ms[i] >= request->response_datas[i].mock_delay_ms) request->completed[i] = true;
         }
     } else {
     #endif
-
-    // start time
-    start = clock();
-    // run the handles
-    curl_multi_perform(multi_hnd_for_query, &running);
-    while (running) {
-        CURLMcode mc;
-        int numfds;
-        mc = curl_multi_wait(multi_hnd_for_query, NULL, 0, 8000, &numfds);
-        if (mc != CURLM_OK) {
-            elog(DEBUG1, "curl_multi_wait() failed, code %d.", mc);
-            break;
+    pinecone_multi_wait(request->multi, 0);
+    while ((msg = curl_multi_info_read(request->multi->multi, &n_msgs)) != NULL) {
+        if (msg->msg != CURLMSG_DONE) continue;
+        for (int i = 0; i < 3; i++) {
+            if (request->handles[i] != msg->easy_handle || request->completed[i]) continue;
+            request->completed[i] = true;
+            request->codes[i] = msg->data.result;
+            curl_easy_getinfo(request->handles[i], CURLINFO_RESPONSE_CODE, &request->response_datas[i].status);
         }
-        curl_multi_perform(multi_hnd_for_query, &running);
     }
-    curl_multi_remove_handle(multi_hnd_for_query, query_handle);
-    curl_easy_reset(query_handle);
-    if (with_fetch) {
-        curl_multi_remove_handle(multi_hnd_for_query, fetch_handle);
-        curl_easy_reset(fetch_handle);
-    }
-    // TODO: figure out exactly what is necessary: deleting multi_cleanup or reusing the same multihandle
-    // stop time
-    stop = clock();
-    elog(DEBUG2, "Query and fetch took %f seconds", (double)(stop - start) / CLOCKS_PER_SEC);
-
     #ifdef PINECONE_MOCK
     }
     #endif
 
+    if (request->winner < 0) {
+        bool query_ok = request->completed[PINECONE_QUERY_HANDLE] && !is_failure(&request->response_datas[PINECONE_QUERY_HANDLE], request->codes[PINECONE_QUERY_HANDLE]);
+        bool hedge_ok = request->hedged && request->completed[PINECONE_HEDGE_HANDLE] && !is_failure(&request->response_datas[PINECONE_HEDGE_HANDLE], request->codes[PINECONE_HEDGE_HANDLE]);
+        if (query_ok) pinecone_query_set_winner(request, PINECONE_QUERY_HANDLE);
+        else if (hedge_ok) pinecone_query_set_winner(request, PINECONE_HEDGE_HANDLE);
+        else if (request->completed[PINECONE_QUERY_HANDLE] && (!request->hedged || request->completed[PINECONE_HEDGE_HANDLE])) {
+            // everything we sent failed
+            pinecone_query_set_winner(request, PINECONE_QUERY_HANDLE);
+        } else if (!request->hedged && request->hedge_delay_ms >= 0 &&
+                   pinecone_now_ms() - request->started_ms[PINECONE_QUERY_HANDLE] >= request->hedge_delay_ms) {
+            pinecone_query_hedge(request);
+        }
+    }
+
+    request->done = request->winner >= 0 && (request->n_handles < 2 || request->completed[PINECONE_FETCH_HANDLE]);
+    return request->done;
+}
 
-    // parse the responses
-    start = clock();
-    responses[0] = cJSON_Parse(query_response_data.data);
-    if (with_fetch) {
-        responses[1] = cJSON_Parse(fetch_response_data.data);
-    }
-    stop = clock();
-    elog(DEBUG2, "Parsing responses took %f seconds", (double)(stop - start) / CLOCKS_PER_SEC);
-
-    return responses;
-}
-
-CURL* multi_handle;
-cJSON* pinecone_bulk_upsert(const char *api_key, const char *index_host, cJSON *vectors, int batch_size) {
-    cJSON *batches = batch_vectors(vectors, batch_size);
-    cJSON *batch;
-    CURL* batch_handle;
-    int n_batches = cJSON_GetArraySize(batches);
-    ResponseData* response_data = palloc(sizeof(ResponseData) * n_batches);
-    CURL** handles = palloc(sizeof(CURL*) * n_batches);
-    int running;
-    if (multi_handle == NULL) {
-        multi_handle = curl_multi_init();
-        if (multi_handle == NULL) {
-            elog(ERROR, "Failed to initialize CURL multi handle");
+// return the handles to the connection cache and free the buffered responses
+static void pinecone_query_release(PineconeQueryRequest* request) {
+    for (int i = 0; i < 3; i++) {
+        if (request->response_datas[i].data != NULL) {
+            pfree(request->response_datas[i].data);
+            request->response_datas[i].data = NULL;
         }
+        if (request->handles[i] == NULL) continue;
+        if (request->multi != NULL) pinecone_multi_remove(request->multi, request->handles[i]);
+        pinecone_release_handle(request->handles[i]);
+        request->handles[i] = NULL;
+        curl_slist_free_all(request->response_datas[i].headers);
+        request->response_datas[i].headers = NULL;
     }
+    if (request->multi != NULL) pinecone_multi_destroy(request->multi);
+    request->multi = NULL;
+}
 
-    for (int i = 0; i < n_batches; i++) {
-        batch = cJSON_GetArrayItem(batches, i);
-        response_data[i] = (ResponseData) {"", NULL, NULL, 0, ""};
-        batch_handle = get_pinecone_upsert_handle(api_key, index_host, cJSON_Duplicate(batch, true), &response_data[i]); // TODO: figure out why i have to deepcopy // because batch goes out of scope
-        handles[i] = batch_handle;
-        curl_multi_add_handle(multi_handle, batch_handle);
+/*
+ * Wait for the request to complete and return the parsed fetch response (NULL if there was no fetch).
+ * If pinecone.query_deadline passes first, either raise an error or, with pinecone.query_deadline_action = local_only,
+ * set timed_out and return NULL without any matches.
+ */
+cJSON* pinecone_query_finish(PineconeQueryRequest* request, bool* timed_out) {
+    cJSON* fetch_response = NULL;
+    double start_ms = request->started_ms[PINECONE_QUERY_HANDLE];
+    double deadline_ms = (pinecone_query_deadline > 0) ? start_ms + pinecone_query_deadline : -1;
+
+    *timed_out = false;
+    while (!pinecone_query_poll(request)) {
+        double now_ms = pinecone_now_ms();
+        double timeout_ms = 1000; // wake up regularly to check for interrupts
+        if (deadline_ms >= 0) {
+            if (now_ms >= deadline_ms) {
+                *timed_out = true;
+                break;
+            }
+            timeout_ms = Min(timeout_ms, deadline_ms - now_ms);
+        }
+        if (!request->hedged && request->hedge_delay_ms >= 0 && request->network_job == NULL) {
+            timeout_ms = Min(timeout_ms, Max(start_ms + request->hedge_delay_ms - now_ms, 0));
+        }
+        if (request->network_job != NULL) {
+            (void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH, (long) ceil(timeout_ms), PG_WAIT_EXTENSION);
+            ResetLatch(MyLatch);
+            CHECK_FOR_INTERRUPTS();
+        }
+        #ifdef PINECONE_MOCK
+        else if (request->mocked) {
+            pg_usleep((long) (Min(timeout_ms, 5) * 1000)); // a delayed mock response
+            CHECK_FOR_INTERRUPTS();
+        }
+        #endif
+        else {
+            pinecone_multi_wait(request->multi, (long) ceil(timeout_ms));
+        }
+    }
+    elog(DEBUG2, "Query and fetch took %f ms", pinecone_now_ms() - start_ms);
+
+    if (*timed_out) {
+        request->stats->n_deadline_exceeded++;
+        pinecone_record_outcome(request->stats, request->index_host, true);
+        pinecone_query_abort(request);
+        if (pinecone_query_deadline_action == PINECONE_DEADLINE_ERROR) {
+            ereport(ERROR, (errcode(ERRCODE_CONNECTION_FAILURE),
+                            errmsg("Pinecone query did not complete within pinecone.query_deadline (%d ms)", pinecone_query_deadline)));
+        }
+        ereport(WARNING, (errcode(ERRCODE_CONNECTION_FAILURE),
+                          errmsg("Pinecone query did not complete within pinecone.query_deadline (%d ms)", pinecone_query_deadline),
+                          errdetail("Only the local buffer was searched.")));
+        return NULL;
+    }
+
+    // parse the fetch response (the query response has already been decoded)
+    if (request->n_handles == 2) {
+        fetch_response = cJSON_Parse(request->response_datas[PINECONE_FETCH_HANDLE].data);
     }
-    cJSON_Delete(batches);
+    pinecone_query_release(request);
+    pfree(request);
+    return fetch_response;
+}
+
+/*
+ * Drop a request that is still in flight, e.g. because the scan was ended or restarted
+ */
+void pinecone_query_abort(PineconeQueryRequest* request) {
+    if (request->network_job != NULL) {
+        pinecone_network_worker_cancel(request->network_job);
+        request->network_job = NULL;
+    }
+    pinecone_query_release(request);
+    pfree(request);
+}
+
+/*
+ * Query the index and optionally fetch the liveness checkpoint vectors in parallel.
+ * The matches are decoded into matches as they arrive; the parsed fetch response is returned.
+ */
+cJSON* pinecone_query_with_fetch(const char *api_key, const char *index_host, char *query_body, struct PineconeMatchParser *matches, bool with_fetch, cJSON* fetch_ids) {
+    bool timed_out;
+    return pinecone_query_finish(pinecone_query_start(api_key, index_host, query_body, matches, with_fetch, fetch_ids), &timed_out);
+}
+
+/*
+ * Upsert scheduling
+ *
+ * The number of upserts in flight to a host adapts AIMD style: it grows by one per window of successful
+ * requests and is halved by a 429, a 5xx or a transport error (and cut by a quarter when a request takes
+ * more than twice the recent average). It never exceeds pinecone.requests_per_batch. Failed batches are
+ * resent after the Retry-After the host asked for, or with exponential backoff, up to
+ * pinecone.upsert_max_retries times; after that a flush gives up with a warning and keeps the vectors
+ * in the buffer, while a build fails rather than dropping the batch.
+ */
+#define PINECONE_UPSERT_BACKOFF_MS 100
+#define PINECONE_UPSERT_MAX_BACKOFF_MS 30000
+
+typedef struct PineconeUpsertRequest {
+    char* body;
+    CURL* hnd; // set while the request is in flight
+    PineconeNetworkJob* network_job; // set while the network worker performs the request
+    ResponseData response_data;
+    ResponseData* response_data_ptr;
+    CURLcode code;
+    bool finished; // the transfer is over but we haven't looked at the response yet
+    bool done;
+    int attempts; // failed attempts
+    double started_ms;
+    double not_before_ms; // backoff
+} PineconeUpsertRequest;
+
+struct PineconeUpsertJob {
+    MemoryContext context; // everything the requests allocate (compressed bodies, responses)
+    char* api_key;
+    char* index_host;
+    PineconeHostStats* stats;
+    PineconeMulti* multi;
+    PineconeUpsertRequest* requests;
+    int n_batches;
+    int n_done;
+    int n_in_flight;
+    bool flushing; // a flush of the buffer: a batch that can't be sent is a warning, the flush is tried again later
+    bool failed; // a batch was rejected or ran out of retries while flushing
+};
+
+static void pinecone_upsert_send(const char *api_key, const char *index_host, PineconeUpsertRequest* request, PineconeMulti* multi) {
+    if (request->response_data.data != NULL) pfree(request->response_data.data);
+    request->response_data = (ResponseData) {"", NULL, NULL, 0, ""};
+    request->response_data.context = CurrentMemoryContext;
+    request->response_data_ptr = &request->response_data;
+    request->code = CURLE_OK;
+    request->hnd = get_pinecone_upsert_handle(api_key, index_host, request->body, &request->response_data);
+    request->started_ms = pinecone_now_ms();
 
     #ifdef PINECONE_MOCK
     if (pinecone_use_mock_response) {
-        for (int i = 0; i < n_batches; i++) {
-            CURLcode ret;
-            lookup_mock_response(handles[i], &response_data[i], &ret);
-            elog(DEBUG1, "Mock response: %s", response_data[i].data);
+        lookup_mock_response(request->hnd, &request->response_data, &request->code);
+        elog(DEBUG1, "Mock response: %s", request->response_data.data);
+        request->finished = true;
+        return;
+    }
+    #endif
+
+    request->network_job = pinecone_network_worker_submit(api_key, &request->hnd, &request->response_data_ptr, &request->code, 1);
+    if (request->network_job == NULL) pinecone_multi_add(multi, request->hnd);
+}
+
+/*
+ * Look at the response of a finished upsert and adjust the host's window.
+ * Returns false if the batch has to be sent again (or, while flushing, if it can't be sent at all; then failed is set).
+ */
+static bool pinecone_upsert_completed(PineconeUpsertJob* job, PineconeUpsertRequest* request) {
+    const char* index_host = job->index_host;
+    PineconeHostStats* stats = job->stats;
+    long status = request->response_data.status;
+    double now_ms = pinecone_now_ms();
+    double latency_ms = now_ms - request->started_ms;
+    bool failed = request->code != CURLE_OK || status >= 500;
+    bool throttled = !failed && status == 429;
+    double backoff_ms;
+
+    pinecone_record_outcome(stats, index_host, failed);
+    pinecone_release_handle(request->hnd);
+    request->hnd = NULL;
+    curl_slist_free_all(request->response_data.headers);
+    request->response_data.headers = NULL;
+
+    // success (a mock response without a status counts as one)
+    if (!failed && status < 300) {
+        if (request->response_data.compressed) stats->compression = PINECONE_COMPRESSION_ACCEPTED;
+        if (stats->upsert_latency_ms > 0 && latency_ms > 2 * stats->upsert_latency_ms) {
+            stats->upsert_window = Max(stats->upsert_window * 0.75, 1);
+        } else {
+            stats->upsert_window = Min(stats->upsert_window + 1 / stats->upsert_window, pinecone_requests_per_batch);
         }
+        stats->upsert_latency_ms = (stats->upsert_latency_ms == 0) ? latency_ms : 0.8 * stats->upsert_latency_ms + 0.2 * latency_ms;
+        request->done = true;
+        return true;
+    }
+
+    // until a host has accepted a compressed body, a 400 may also mean it couldn't read it
+    if (request->response_data.compressed && (status == 415 || (status == 400 && stats->compression == PINECONE_COMPRESSION_UNKNOWN))) {
+        elog(DEBUG1, "%s does not accept compressed upserts, sending them uncompressed", index_host);
+        stats->compression = PINECONE_COMPRESSION_REJECTED;
+        return false;
+    }
+
+    if (!failed && !throttled) {
+        ereport(job->flushing ? WARNING : ERROR,
+                (errcode(ERRCODE_DATA_EXCEPTION),
+                 errmsg("Pinecone rejected an upsert to %s with status %ld", index_host, status),
+                 errdetail("%s", request->response_data.data != NULL ? request->response_data.data : ""),
+                 job->flushing ? errhint("The vectors stay in the buffer and are sent with the next flush.") : 0));
+        job->failed = true;
+        return false;
+    }
+
+    // back off and try again
+    stats->upsert_window = Max(stats->upsert_window / 2, 1);
+    if (throttled) stats->n_throttled++;
+    if (++request->attempts > pinecone_upsert_max_retries) {
+        ereport(job->flushing ? WARNING : ERROR,
+                (errcode(ERRCODE_CONNECTION_FAILURE),
+                 errmsg("Pinecone upsert to %s failed after %d attempts", index_host, request->attempts),
+                 request->code != CURLE_OK ? errdetail("%s", curl_easy_strerror(request->code))
+                                           : errdetail("Status %ld: %s", status, request->response_data.data != NULL ? request->response_data.data : ""),
+                 job->flushing ? errhint("The vectors stay in the buffer and are sent with the next flush.")
+                               : errhint("Raise pinecone.upsert_max_retries or try again once %s accepts upserts.", index_host)));
+        job->failed = true;
+        return false;
+    }
+    stats->n_upsert_retries++;
+    if (request->response_data.retry_after_ms > 0) {
+        backoff_ms = Min(request->response_data.retry_after_ms, PINECONE_UPSERT_MAX_BACKOFF_MS);
+        // the host asked us to slow down, so hold back the other batches as well
+        if (throttled) stats->upsert_paused_until_ms = Max(stats->upsert_paused_until_ms, now_ms + backoff_ms);
     } else {
-    #endif
-    
-    // run the handles
-    curl_multi_perform(multi_handle, &running);
-    while (running) {
-        CURLMcode mc;
-        int numfds;
-        mc = curl_multi_wait(multi_handle, NULL, 0, 8000, &numfds);
-        if (mc != CURLM_OK) {
-            elog(DEBUG1, "curl_multi_wait() failed, code %d.", mc);
-            break;
+        backoff_ms = Min(PINECONE_UPSERT_BACKOFF_MS * pow(2, request->attempts - 1), PINECONE_UPSERT_MAX_BACKOFF_MS);
+    }
+    request->not_before_ms = now_ms + backoff_ms;
+    elog(DEBUG1, "Upsert to %s failed (status %ld), retrying in %.0f ms", index_host, status, backoff_ms);
+    return false;
+}
+
+/*
+ * Make progress on the upserts. With wait, return only once all of them have landed (or, while flushing, one has failed).
+ * Returns true once they have all landed.
+ */
+static bool pinecone_upsert_step(PineconeUpsertJob* job, bool wait) {
+    MemoryContext oldcontext = MemoryContextSwitchTo(job->context);
+    PineconeUpsertRequest* requests = job->requests;
+    bool polled = false;
+
+    while (true) {
+        double now_ms;
+        double next_ms = -1; // the earliest end of a backoff
+        bool any_finished = false;
+        bool any_network_job = false;
+        long timeout_ms = -1;
+        CURLMsg* msg;
+        int n_msgs;
+
+        // look at the responses that came in
+        for (int i = 0; i < job->n_batches && !job->failed; i++) {
+            if (!requests[i].finished) continue;
+            requests[i].finished = false;
+            job->n_in_flight--;
+            if (pinecone_upsert_completed(job, &requests[i])) job->n_done++;
+        }
+        if (job->failed || job->n_done == job->n_batches) break;
+
+        // send what the window allows
+        now_ms = pinecone_now_ms();
+        for (int i = 0; i < job->n_batches; i++) {
+            PineconeUpsertRequest* request = &requests[i];
+            double not_before_ms = Max(request->not_before_ms, job->stats->upsert_paused_until_ms);
+            if (request->done || request->hnd != NULL) continue;
+            if (now_ms < not_before_ms) {
+                next_ms = (next_ms < 0) ? not_before_ms : Min(next_ms, not_before_ms);
+                continue;
+            }
+            if (job->n_in_flight >= (int) job->stats->upsert_window) break;
+            pinecone_upsert_send(job->api_key, job->index_host, request, job->multi);
+            job->n_in_flight++;
+            any_finished |= request->finished;
+        }
+        if (any_finished) continue;
+        if (!wait && polled) break;
+
+        // wait for a transfer to complete, the network worker to answer or a backoff to end
+        for (int i = 0; i < job->n_batches; i++) any_network_job |= requests[i].network_job != NULL;
+        if (next_ms >= 0) timeout_ms = (long) ceil(next_ms - now_ms);
+        if (any_network_job) timeout_ms = (timeout_ms < 0) ? 1000 : Min(timeout_ms, 1000);
+        pinecone_multi_wait(job->multi, wait ? timeout_ms : 0);
+        polled = true;
+
+        while ((msg = curl_multi_info_read(job->multi->multi, &n_msgs)) != NULL) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            for (int i = 0; i < job->n_batches; i++) {
+                if (requests[i].hnd != msg->easy_handle || requests[i].network_job != NULL) continue;
+                requests[i].code = msg->data.result;
+                curl_easy_getinfo(requests[i].hnd, CURLINFO_RESPONSE_CODE, &requests[i].response_data.status);
+                pinecone_multi_remove(job->multi, requests[i].hnd);
+                requests[i].finished = true;
+            }
+        }
+        for (int i = 0; i < job->n_batches; i++) {
+            if (requests[i].network_job == NULL || !pinecone_network_worker_poll(requests[i].network_job, false)) continue;
+            requests[i].network_job = NULL;
+            requests[i].finished = true;
         }
-        curl_multi_perform(multi_handle, &running);
+    }
+    MemoryContextSwitchTo(oldcontext);
+    return job->n_done == job->n_batches;
+}
+
+/*
+ * Start sending the already encoded upsert request bodies, no more than the host's window at a time.
+ * The bodies must stay valid until pinecone_bulk_upsert_finish; drive the upserts with pinecone_bulk_upsert_poll meanwhile.
+ * With flushing, a batch that is rejected or runs out of retries is reported as a warning instead of an error.
+ */
+PineconeUpsertJob* pinecone_bulk_upsert_start(const char *api_key, const char *index_host, char** bodies, int n_batches, bool flushing) {
+    MemoryContext upsert_context = AllocSetContextCreate(CurrentMemoryContext, "Pinecone upsert", ALLOCSET_DEFAULT_SIZES);
+    MemoryContext oldcontext = MemoryContextSwitchTo(upsert_context);
+    PineconeUpsertJob* job = palloc0(sizeof(PineconeUpsertJob));
+
+    job->context = upsert_context;
+    job->api_key = pstrdup(api_key);
+    job->index_host = pstrdup(index_host);
+    job->stats = pinecone_get_host_stats(index_host);
+    job->multi = pinecone_multi_create();
+    job->requests = palloc0(sizeof(PineconeUpsertRequest) * n_batches);
+    job->n_batches = n_batches;
+    job->flushing = flushing;
+    if (job->stats->upsert_window < 1 || job->stats->upsert_window > pinecone_requests_per_batch) {
+        job->stats->upsert_window = pinecone_requests_per_batch;
     }
     for (int i = 0; i < n_batches; i++) {
-        curl_easy_reset(handles[i]);
+        job->requests[i].body = bodies[i];
     }
-    #ifdef PINECONE_MOCK
+    MemoryContextSwitchTo(oldcontext);
+
+    pinecone_upsert_step(job, false); // get the first window going
+    return job;
+}
+
+/*
+ * Make progress without blocking. Returns true once every batch has landed.
+ */
+bool pinecone_bulk_upsert_poll(PineconeUpsertJob* job) {
+    return pinecone_upsert_step(job, false);
+}
+
+/*
+ * Wait until every batch has landed (or raise an error once one has run out of retries) and free the job.
+ * Returns false if, while flushing, a batch failed; the batches still in flight are dropped then.
+ */
+bool pinecone_bulk_upsert_finish(PineconeUpsertJob* job) {
+    bool landed = pinecone_upsert_step(job, true);
+    for (int i = 0; i < job->n_batches; i++) {
+        PineconeUpsertRequest* request = &job->requests[i];
+        if (request->hnd == NULL) continue;
+        if (request->network_job != NULL) pinecone_network_worker_cancel(request->network_job);
+        pinecone_multi_remove(job->multi, request->hnd);
+        pinecone_release_handle(request->hnd);
+        curl_slist_free_all(request->response_data.headers);
     }
-    #endif
+    pinecone_multi_destroy(job->multi);
+    MemoryContextDelete(job->context);
+    return landed;
+}
 
-    // todo: check the responses from upsert
-    // todo: free the response.data
-    return NULL;
+/*
+ * Send the already encoded upsert request bodies and wait until all have landed
+ */
+void pinecone_bulk_upsert(const char *api_key, const char *index_host, char** bodies, int n_batches) {
+    pinecone_bulk_upsert_finish(pinecone_bulk_upsert_start(api_key, index_host, bodies, n_batches, false));
 }
 
-CURL* query_handle;
-CURL* get_pinecone_query_handle(const char *api_key, const char *index_host, const int topK, cJSON *query_vector_values, cJSON *filter, ResponseData* response_data) {
-    cJSON *body = cJSON_CreateObject();
-    char* body_str;
+/*
+ * The request bodies are owned by the caller and must outlive the request
+ */
+CURL* get_pinecone_query_handle(const char *api_key, const char *index_host, char *body, ResponseData* response_data) {
+    CURL* query_handle;
     char url[100] = "https://"; strcat(url, index_host); strcat(url, "/query"); // e.g. https://t1-23kshha.svc.apw5-4e34-81fa.pinecone.io/query
-    if (query_handle == NULL) {
-        query_handle = curl_easy_init();
-        if (query_handle == NULL) {
-            elog(ERROR, "Failed to initialize CURL handle");
-        }
-    }
-    cJSON_AddItemToObject(body, "topK", cJSON_CreateNumber(topK));
-    cJSON_AddItemToObject(body, "vector", query_vector_values);
-    cJSON_AddItemToObject(body, "filter", filter);
-    cJSON_AddItemToObject(body, "includeValues", cJSON_CreateFalse());
-    cJSON_AddItemToObject(body, "includeMetadata", cJSON_CreateFalse());
-    query_handle = curl_easy_init();
-    body_str = cJSON_Print(body);
-    elog(DEBUG1, "Querying index %s with payload: %s", index_host, body_str);
-    cJSON_Delete(body);
-    // 
+    query_handle = pinecone_acquire_handle(url);
+    elog(DEBUG1, "Querying index %s with payload: %s", index_host, body);
     strcpy(response_data->message, "querying index");
-    response_data->request_body = body_str;
+    response_data->request_body = body;
     set_curl_options(query_handle, api_key, url, "POST", response_data);
-    curl_easy_setopt(query_handle, CURLOPT_POSTFIELDS, body_str);
+    curl_easy_setopt(query_handle, CURLOPT_POSTFIELDS, body);
     return query_handle;
 }
 
-CURL* get_pinecone_upsert_handle(const char *api_key, const char *index_host, cJSON *vectors, ResponseData* response_data) {
-    CURL *hnd = curl_easy_init();
-    cJSON *body = cJSON_CreateObject();
-    char *body_str;
-    // furthermore, we need to be sure to free the memory allocated for response_data.data (by the writeback) after we are done using it
+#ifdef HAVE_LIBZ
+/*
+ * Gzip a request body. Returns NULL if it couldn't be compressed.
+ */
+static char* pinecone_gzip(const char *body, size_t length, size_t *compressed_length) {
+    z_stream stream = {0};
+    char* compressed;
+    uLong bound;
+    // 16 + MAX_WBITS writes a gzip rather than a zlib header; vectors are mostly digits, so the fastest level does well
+    if (deflateInit2(&stream, Z_BEST_SPEED, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) return NULL;
+    bound = deflateBound(&stream, length);
+    compressed = palloc(bound);
+    stream.next_in = (Bytef*) body;
+    stream.avail_in = length;
+    stream.next_out = (Bytef*) compressed;
+    stream.avail_out = bound;
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&stream);
+        pfree(compressed);
+        return NULL;
+    }
+    *compressed_length = stream.total_out;
+    deflateEnd(&stream);
+    return compressed;
+}
+#endif
+
+/*
+ * With pinecone.compress_upserts the body is sent gzipped, unless the host has rejected a compressed body before.
+ * The network worker sends request_body as is, so bodies going through it are not compressed.
+ */
+CURL* get_pinecone_upsert_handle(const char *api_key, const char *index_host, char *body, ResponseData* response_data) {
+    CURL *hnd;
+    PineconeHostStats* stats = pinecone_get_host_stats(index_host);
+    size_t length = strlen(body);
+    // we need to be sure to free the memory allocated for response_data.data (by the writeback) after we are done using it
     char url[100] = "https://"; strcat(url, index_host); strcat(url, "/vectors/upsert"); // https://t1-23kshha.svc.apw5-4e34-81fa.pinecone.io/vectors/upsert
-    cJSON_AddItemToObject(body, "vectors", vectors);
+    hnd = pinecone_acquire_handle(url);
     set_curl_options(hnd, api_key, url, "POST", response_data);
-    body_str = cJSON_Print(body);
-    cJSON_Delete(body); // free the cJSON object especially including the vectors
-    // save the body_str pointer in response_data so we can free it later in the write_callback
     strcpy(response_data->message, "upserting vectors");
-    response_data->request_body = body_str;
-    curl_easy_setopt(hnd, CURLOPT_POSTFIELDS, body_str);
+    response_data->request_body = body;
+    curl_easy_setopt(hnd, CURLOPT_POSTFIELDS, body);
+    stats->upsert_bytes += length;
+    #ifdef HAVE_LIBZ
+    if (pinecone_compress_upserts && !pinecone_network_worker && stats->compression != PINECONE_COMPRESSION_REJECTED) {
+        size_t compressed_length;
+        char* compressed = pinecone_gzip(body, length, &compressed_length);
+        if (compressed != NULL) {
+            response_data->headers = curl_slist_append(response_data->headers, "content-encoding: gzip");
+            curl_easy_setopt(hnd, CURLOPT_HTTPHEADER, response_data->headers);
+            // the compressed body is freed with the caller's memory context
+            curl_easy_setopt(hnd, CURLOPT_POSTFIELDS, compressed);
+            curl_easy_setopt(hnd, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) compressed_length);
+            response_data->compressed = true;
+            length = compressed_length;
+        }
+    }
+    #endif
+    stats->upsert_bytes_sent += length;
     return hnd;
 }
 
-CURL* fetch_handle;
-CURL* get_pinecone_fetch_handle(const char *api_key, const char *index_host, cJSON* ids, ResponseData* response_data) {
-    char url[2048] = "https://"; // we fetch up to 100 vectors and have 12 chars per vector id + &ids= is 17chars/vec
+// url must hold 2048 bytes: we fetch up to 100 vectors and have 12 chars per vector id + &ids= is 17chars/vec
+static void pinecone_fetch_url(char* url, const char *index_host, cJSON* ids) {
+    strcpy(url, "https://");
     strcat(url, index_host); strcat(url, "/vectors/fetch?"); // https://t1-23kshha.svc.apw5-4e34-81fa.pinecone.io/vectors/upsert
-    if (fetch_handle == NULL) {
-        fetch_handle = curl_easy_init();
-        if (fetch_handle == NULL) {
-            elog(ERROR, "Failed to initialize CURL handle");
-        }
-    }
     cJSON_ArrayForEach(ids, ids) {
         strcat(url, "ids=");
         strcat(url, cJSON_GetStringValue(ids));
         strcat(url, "&");
     }
     url[strlen(url) - 1] = '\0'; // remove the trailing &
-    fetch_handle = curl_easy_init();
+}
+
+CURL* get_pinecone_fetch_handle(const char *api_key, const char *index_host, cJSON* ids, ResponseData* response_data) {
+    CURL* fetch_handle;
+    char url[2048];
+    pinecone_fetch_url(url, index_host, ids);
+    fetch_handle = pinecone_acquire_handle(url);
     strcpy(response_data->message, "fetching vectors");
     response_data->request_body = NULL;
     set_curl_options(fetch_handle, api_key, url, "GET", response_data);
     return fetch_handle;
 }
 
-cJSON* batch_vectors(cJSON *vectors, int batch_size) {
-    // given a list of e.g. 1000 vectors, batch them into groups of 100
-    cJSON *batches = cJSON_CreateArray();
-    cJSON *batch = cJSON_CreateArray();
-    int i = 0;
-    cJSON *vector;
-    cJSON_ArrayForEach(vector, vectors) {
-        if (i == batch_size) {
-            cJSON_AddItemToArray(batches, batch);
-            batch = cJSON_CreateArray();
-            i = 0;
-        }
-        cJSON_AddItemToArray(batch, cJSON_Duplicate(vector, true)); // todo: figure out why i have to deepcopy when using these macros
-        i++;
-    }
-    cJSON_AddItemToArray(batches, batch);
-    return batches;
+cJSON* pinecone_fetch_vectors(const char *api_key, const char *index_host, cJSON* ids) {
+    char url[2048];
+    pinecone_fetch_url(url, index_host, ids);
+    return generic_pinecone_request(api_key, url, "GET", NULL, true);
 }
@@ -8,32 +8,168 @@
 
 typedef CURL** CURLHandleList;
 
+struct PineconeMatchParser; // defined in pinecone.h
+
 typedef struct {
     char message[256];
     char *request_body;
     char *data;
     size_t length;
     char method[10]; // GET, POST, DELETE, etc.
+    struct PineconeMatchParser *match_parser; // when set, the response is decoded as it arrives instead of being buffered
+    bool compressed; // the request body was sent gzipped
+    // the body is allocated in context (a MemoryContext; the current one if NULL), presized from Content-Length
+    void *context;
+    size_t capacity;
+    size_t expected_length;
+    long status; // HTTP status, once the response is complete
+    double retry_after_ms; // Retry-After of a throttled response
+    struct curl_slist *headers; // the request headers, freed once the handle has been released
+    double mock_delay_ms; // with pinecone.use_mock_response, how long the mocked response takes to arrive
 } ResponseData;
 
+typedef struct PineconeNetworkJob PineconeNetworkJob; // defined in pinecone_worker.c
+typedef struct PineconeUpsertJob PineconeUpsertJob; // defined in pinecone_api.c
+
+// per host request statistics of this backend
+#define PINECONE_LATENCY_SAMPLES 128
+typedef struct PineconeHostStats {
+    long long n_queries;
+    long long n_failures; // requests that failed with a transport error, a 5xx response or the query deadline
+    long long n_hedged; // queries for which a second request was sent
+    long long n_hedge_wins; // hedged queries answered by the second request
+    long long n_deadline_exceeded;
+    // circuit breaker
+    int breaker_state;
+    int consecutive_failures;
+    double breaker_opened_ms;
+    long long n_breaker_trips;
+    // upsert request bodies
+    long long upsert_bytes; // before compression
+    long long upsert_bytes_sent;
+    int compression; // PINECONE_COMPRESSION_*
+    // upsert scheduling
+    double upsert_window; // upserts allowed in flight
+    double upsert_latency_ms; // moving average
+    double upsert_paused_until_ms; // set by a Retry-After
+    long long n_throttled; // 429 responses
+    long long n_upsert_retries;
+    double latency_ms[PINECONE_LATENCY_SAMPLES]; // recent query latencies (ring buffer)
+    int n_samples;
+    int next_sample;
+} PineconeHostStats;
+
+#define PINECONE_BREAKER_CLOSED 0
+#define PINECONE_BREAKER_OPEN 1
+#define PINECONE_BREAKER_HALF_OPEN 2 // the next request is a probe
+
+#define PINECONE_COMPRESSION_UNKNOWN 0
+#define PINECONE_COMPRESSION_ACCEPTED 1 // the host has accepted a gzipped body
+#define PINECONE_COMPRESSION_REJECTED 2
+
+#define PINECONE_QUERY_HANDLE 0
+#define PINECONE_FETCH_HANDLE 1
+#define PINECONE_HEDGE_HANDLE 2
+
+// a curl multi handle whose sockets we wait on with a WaitEventSet (pinecone_multi.c)
+#define PINECONE_MAX_SOCKETS 256
+typedef struct PineconeSocket {
+    curl_socket_t sock;
+    int what; // CURL_POLL_IN, CURL_POLL_OUT or both
+    int pos; // of its event in the wait event set, -1 while curl waits on neither
+} PineconeSocket;
+
+typedef struct PineconeMulti {
+    CURLM* multi;
+    struct WaitEventSet* set; // our latch, postmaster death and curl's sockets; only changed by the socket callback
+    PineconeSocket sockets[PINECONE_MAX_SOCKETS];
+    int n_sockets;
+    double timeout_at_ms; // when curl's next timeout expires, -1 if it has none
+    CURL** easy; // attached easy handles, freed if we error out while they are running
+    int n_easy;
+    int easy_capacity;
+    unsigned int subid; // the subtransaction that created the multi
+    struct PineconeMulti* next;
+} PineconeMulti;
+
+// a query (and liveness fetch) that is in flight while the scan does other work
+typedef struct PineconeQueryRequest {
+    PineconeMulti* multi;
+    CURL* handles[3]; // query, fetch, hedged query
+    ResponseData response_datas[3];
+    ResponseData* response_data_ptrs[3];
+    CURLcode codes[3];
+    bool completed[3];
+    double started_ms[3];
+    int n_handles; // query and fetch; the hedge is tracked separately
+    bool done;
+    PineconeNetworkJob* network_job; // set when the network worker performs the requests
+    bool mocked; // the responses come from the pinecone_mock table
+    // hedging and deadline
+    char* api_key;
+    char* index_host;
+    char* query_body;
+    struct PineconeMatchParser* matches; // the caller's parser
+    struct PineconeMatchParser* hedge_matches; // the hedge's response is decoded separately
+    bool hedged;
+    int winner; // the query handle that answered, -1 until one has
+    double hedge_delay_ms; // negative if we don't hedge
+    PineconeHostStats* stats;
+} PineconeQueryRequest;
+
+// connection cache
+CURL* pinecone_acquire_handle(const char *url);
+void pinecone_release_handle(CURL* hnd);
+PineconeHostStats* pinecone_get_host_stats(const char *host);
+bool pinecone_host_stats_at(int i, const char **host, PineconeHostStats **stats);
+double pinecone_latency_percentile(PineconeHostStats* stats, double percentile);
+// circuit breaker
+void pinecone_record_outcome(PineconeHostStats* stats, const char *host, bool failed);
+bool pinecone_breaker_is_open(PineconeHostStats* stats);
+bool pinecone_host_available(PineconeHostStats* stats);
+bool pinecone_any_breaker_open(void);
+
+// curl multi handles
+PineconeMulti* pinecone_multi_create(void);
+void pinecone_multi_destroy(PineconeMulti* pm);
+void pinecone_multi_add(PineconeMulti* pm, CURL* hnd);
+void pinecone_multi_remove(PineconeMulti* pm, CURL* hnd);
+void pinecone_multi_wait(PineconeMulti* pm, long timeout_ms);
+
 size_t write_callback(char *contents, size_t size, size_t nmemb, void *userdata);
+size_t header_callback(char *buffer, size_t size, size_t nitems, void *userdata);
 struct curl_slist *create_common_headers(const char *api_key);
 void set_curl_options(CURL *hnd, const char *api_key, const char *url, const char *method, ResponseData *response_data);
+void set_curl_timeouts(CURL *hnd, int request_timeout_ms, int stall_timeout_s);
 cJSON* generic_pinecone_request(const char *api_key, const char *url, const char *method, cJSON *body, bool expect_json_response);
 cJSON* describe_index(const char *api_key, const char *index_name);
 cJSON* pinecone_get_index_stats(const char *api_key, const char *index_host);
 cJSON* list_indexes(const char *api_key);
 cJSON* pinecone_delete_vectors(const char *api_key, const char *index_host, cJSON *ids);
+cJSON* pinecone_fetch_vectors(const char *api_key, const char *index_host, cJSON* ids);
 cJSON* pinecone_delete_index(const char *api_key, const char *index_name);
 cJSON* pinecone_delete_all(const char *api_key, const char *index_host);
 cJSON* pinecone_list_vectors(const char *api_key, const char *index_host, int limit, char* pagination_token);
 cJSON* pinecone_create_index(const char *api_key, const char *index_name, const int dimension, const char *metric, cJSON *spec);
-cJSON** pinecone_query_with_fetch(const char *api_key, const char *index_host, const int topK, cJSON *query_vector_values, cJSON *filter, bool with_fetch, cJSON* fetch_ids);
-cJSON* pinecone_bulk_upsert(const char *api_key, const char *index_host, cJSON *vectors, int batch_size);
-CURL* get_pinecone_query_handle(const char *api_key, const char *index_host, const int topK, cJSON *query_vector_values, cJSON *filter, ResponseData* response_data);
-CURL* get_pinecone_upsert_handle(const char *api_key, const char *index_host, cJSON *vectors, ResponseData* response_data);
+cJSON* pinecone_query_with_fetch(const char *api_key, const char *index_host, char *query_body, struct PineconeMatchParser *matches, bool with_fetch, cJSON* fetch_ids);
+PineconeQueryRequest* pinecone_query_start(const char *api_key, const char *index_host, char *query_body, struct PineconeMatchParser *matches, bool with_fetch, cJSON* fetch_ids);
+bool pinecone_query_poll(PineconeQueryRequest* request);
+cJSON* pinecone_query_finish(PineconeQueryRequest* request, bool* timed_out);
+void pinecone_query_abort(PineconeQueryRequest* request);
+void pinecone_bulk_upsert(const char *api_key, const char *index_host, char** bodies, int n_batches);
+PineconeUpsertJob* pinecone_bulk_upsert_start(const char *api_key, const char *index_host, char** bodies, int n_batches, bool flushing);
+bool pinecone_bulk_upsert_poll(PineconeUpsertJob* job);
+bool pinecone_bulk_upsert_finish(PineconeUpsertJob* job);
+CURL* get_pinecone_query_handle(const char *api_key, const char *index_host, char *body, ResponseData* response_data);
+CURL* get_pinecone_upsert_handle(const char *api_key, const char *index_host, char *body, ResponseData* response_data);
 CURL* get_pinecone_fetch_handle(const char *api_key, const char *index_host, cJSON* ids, ResponseData* response_data);
-cJSON* batch_vectors(cJSON *vectors, int batch_size);
+// streaming query response parser
+void pinecone_match_parser_feed(struct PineconeMatchParser *parser, const char *data, size_t len);
+// network worker
+bool pinecone_network_worker_perform(const char *api_key, CURL** handles, ResponseData** responses, CURLcode* codes, int n);
+PineconeNetworkJob* pinecone_network_worker_submit(const char *api_key, CURL** handles, ResponseData** responses, CURLcode* codes, int n);
+bool pinecone_network_worker_poll(PineconeNetworkJob* job, bool wait);
+void pinecone_network_worker_cancel(PineconeNetworkJob* job);
 #ifdef PINECONE_MOCK
 void mock_netcall(const char *url, const char *method, cJSON *body, ResponseData *response_data, CURLcode *ret);
 #endif
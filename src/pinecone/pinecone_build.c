@@ -58,11 +58,23 @@ IndexBuildResult *pinecone_build(Relation heap, Relation index, IndexInfo *index
     char* pinecone_index_name;
     char* host;
     int dimensions;
+    int inline_vectors;
     cJSON* describe_index_response;
 
     pinecone_spec_validator(opts);
     spec_json = cJSON_Parse(GET_STRING_RELOPTION(opts, spec));
     dimensions = TupleDescAttr(index->rd_att, 0)->atttypmod;
+    inline_vectors = pinecone_inline_vectors_from_string(GET_STRING_RELOPTION(opts, inline_vectors));
+    if (inline_vectors != PINECONE_INLINE_VECTORS_OFF && dimensions < 1) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                        errmsg("inline_vectors requires a column with dimensions e.g. vector(1536)")));
+    }
+    // a vector and its tid have to fit on a buffer page
+    if (inline_vectors != PINECONE_INLINE_VECTORS_OFF && PINECONE_BUFFER_ENTRIES_PER_PAGE(pinecone_inline_vector_size(inline_vectors, dimensions)) < 1) {
+        ereport(ERROR, (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+                        errmsg("Vectors with %d dimensions are too large to store inline", dimensions),
+                        errhint(inline_vectors == PINECONE_INLINE_VECTORS_FLOAT4 ? "Try inline_vectors = 'float16'." : "Use inline_vectors = 'off'.")));
+    }
     pinecone_index_name = get_pinecone_index_name(index);
     host = GET_STRING_RELOPTION(opts, host);
     validate_api_key();
@@ -89,7 +101,7 @@ IndexBuildResult *pinecone_build(Relation heap, Relation index, IndexInfo *index
     }
 
     // init the index pages: static meta, buffer meta, and buffer head
-    InitIndexPages(index, metric, dimensions, pinecone_index_name, host, MAIN_FORKNUM);
+    InitIndexPages(index, metric, dimensions, inline_vectors, pinecone_index_name, host, MAIN_FORKNUM);
 
     // iterate through the base table and upsert the vectors to the remote index
     if (opts->skip_build) {
@@ -147,14 +159,16 @@ void InsertBaseTable(Relation heap, Relation index, IndexInfo *indexInfo, char*
     int reltuples;
     // initialize the buildstate
     buildstate.indtuples = 0;
-    buildstate.json_vectors = cJSON_CreateArray();
+    pinecone_upsert_batch_init(&buildstate.batch, pinecone_vectors_per_request);
     strcpy(buildstate.host, host);
     // iterate through the base table and upsert the vectors to the remote index
     reltuples = table_index_build_scan(heap, index, indexInfo, true, true, pinecone_build_callback, (void *) &buildstate, NULL);
-    if (cJSON_GetArraySize(buildstate.json_vectors) > 0) {
-        pinecone_bulk_upsert(pinecone_api_key, host, buildstate.json_vectors, pinecone_vectors_per_request);
+    if (buildstate.batch.n_vectors > 0) {
+        char** bodies = pinecone_upsert_batch_bodies(&buildstate.batch);
+        pinecone_bulk_upsert(pinecone_api_key, host, bodies, buildstate.batch.n_requests);
+        pfree(bodies);
     }
-    cJSON_Delete(buildstate.json_vectors);
+    pinecone_upsert_batch_reset(&buildstate.batch);
     // stats
     result->heap_tuples = reltuples;
     result->index_tuples = buildstate.indtuples;
@@ -164,14 +178,12 @@ void pinecone_build_callback(Relation index, ItemPointer tid, Datum *values, boo
 {
     PineconeBuildState *buildstate = (PineconeBuildState *) state;
     TupleDesc itup_desc = index->rd_att;
-    cJSON *json_vector;
-    char* pinecone_id = pinecone_id_from_heap_tid(*tid);
-    json_vector = tuple_get_pinecone_vector(itup_desc, values, isnull, pinecone_id);
-    cJSON_AddItemToArray(buildstate->json_vectors, json_vector);
-    if (cJSON_GetArraySize(buildstate->json_vectors) >= PINECONE_BATCH_SIZE) {
-        pinecone_bulk_upsert(pinecone_api_key, buildstate->host, buildstate->json_vectors, pinecone_vectors_per_request);
-        cJSON_Delete(buildstate->json_vectors);
-        buildstate->json_vectors = cJSON_CreateArray();
+    pinecone_upsert_batch_add(&buildstate->batch, itup_desc, values, isnull, *tid);
+    if (buildstate->batch.n_vectors >= PINECONE_BATCH_SIZE) {
+        char** bodies = pinecone_upsert_batch_bodies(&buildstate->batch);
+        pinecone_bulk_upsert(pinecone_api_key, buildstate->host, bodies, buildstate->batch.n_requests);
+        pfree(bodies);
+        pinecone_upsert_batch_reset(&buildstate->batch);
     }
     buildstate->indtuples++;
 }
@@ -182,7 +194,7 @@ void pinecone_build_callback(Relation index, ItemPointer tid, Datum *values, boo
  * Create the buffer meta page
  * Create the buffer head
  */
-void InitIndexPages(Relation index, VectorMetric metric, int dimensions, char *pinecone_index_name, char *host, int forkNum) {
+void InitIndexPages(Relation index, VectorMetric metric, int dimensions, int inline_vectors, char *pinecone_index_name, char *host, int forkNum) {
     Buffer meta_buf, buffer_meta_buf, buffer_head_buf;
     Page meta_page, buffer_meta_page, buffer_head_page;
     PineconeStaticMetaPage pinecone_static_meta_page;
@@ -210,6 +222,7 @@ void InitIndexPages(Relation index, VectorMetric metric, int dimensions, char *p
     pinecone_static_meta_page = PineconePageGetStaticMeta(meta_page);
     pinecone_static_meta_page->metric = metric;
     pinecone_static_meta_page->dimensions = dimensions;
+    pinecone_static_meta_page->inline_vectors = inline_vectors;
     // You must set pd_lower because GenericXLog ignores any changes in the free space between pd_lower and pd_upper
     ((PageHeader) meta_page)->pd_lower = ((char *) pinecone_static_meta_page - (char *) meta_page) + sizeof(PineconeStaticMetaPageData);
 
@@ -237,6 +250,7 @@ void InitIndexPages(Relation index, VectorMetric metric, int dimensions, char *p
     pinecone_buffer_meta_page->latest_checkpoint = default_checkpoint;
     pinecone_buffer_meta_page->insert_page = PINECONE_BUFFER_HEAD_BLKNO;
     pinecone_buffer_meta_page->n_tuples_since_last_checkpoint = 0;
+    for (int i = 0; i < PINECONE_INSERT_STRIPES; i++) pinecone_buffer_meta_page->stripe_pages[i] = InvalidBlockNumber; // created on first use
     // adjust pd_lower 
     ((PageHeader) buffer_meta_page)->pd_lower = ((char *) pinecone_buffer_meta_page - (char *) buffer_meta_page) + sizeof(PineconeBufferMetaPageData);
 
@@ -0,0 +1,297 @@
+#include "pinecone.h"
+
+#include "access/genam.h"
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "access/table.h"
+#include "access/tableam.h"
+#include "access/xact.h"
+#include "catalog/pg_class.h"
+#include "commands/defrem.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lmgr.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "tcop/tcopprot.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+
+/*
+ * Background flusher
+ *
+ * With pinecone.background_flush on (which requires vector to be in
+ * shared_preload_libraries), a backend that creates a checkpoint leaves it in
+ * the buffer instead of uploading it itself. One worker per database, started
+ * on demand by the first backend that needs it, flushes the checkpoints of
+ * every pinecone index in the database. It is woken when a transaction that
+ * created a checkpoint commits and otherwise looks every pinecone.flush_naptime.
+ *
+ * Rows whose transaction hasn't committed yet are not skipped: FlushToPinecone
+ * stops at their checkpoint and the next round picks it up. Each round also
+ * links the pages of stripes nobody is appending to, so that the rows of
+ * backends that stopped inserting are taken into a checkpoint.
+ *
+ * The worker also keeps the liveness cache of its indexes fresh and persists
+ * their ready checkpoints (see pinecone_liveness.c), so it wakes at least
+ * every half of pinecone.liveness_max_age.
+ */
+
+#define PINECONE_MAX_FLUSH_WORKERS 16
+#define PINECONE_FLUSH_WORKER_START_TIMEOUT 10000 // ms before a worker that never started is launched again
+
+typedef struct PineconeFlushWorkerSlot
+{
+    Oid dboid; // InvalidOid if the slot is free
+    pid_t pid; // 0 until the worker has started
+    Latch* latch;
+    TimestampTz launched_at;
+} PineconeFlushWorkerSlot;
+
+typedef struct PineconeFlushShmemData
+{
+    slock_t mutex;
+    PineconeFlushWorkerSlot slots[PINECONE_MAX_FLUSH_WORKERS];
+} PineconeFlushShmemData;
+
+bool pinecone_background_flush = false;
+int pinecone_flush_naptime = 1000;
+static PineconeFlushShmemData* flush_shmem = NULL;
+static bool flush_wake_pending = false; // wake the worker when this transaction commits
+static bool flush_xact_callback_registered = false;
+static int flush_worker_slot = -1; // in the worker
+
+Size pinecone_flush_shmem_size(void) {
+    return MAXALIGN(sizeof(PineconeFlushShmemData));
+}
+
+// called from the shmem startup hook with AddinShmemInitLock held
+void pinecone_flush_shmem_init(void) {
+    bool found;
+    flush_shmem = ShmemInitStruct("pinecone background flusher", pinecone_flush_shmem_size(), &found);
+    if (!found) {
+        SpinLockInit(&flush_shmem->mutex);
+        for (int i = 0; i < PINECONE_MAX_FLUSH_WORKERS; i++) {
+            flush_shmem->slots[i].dboid = InvalidOid;
+            flush_shmem->slots[i].pid = 0;
+            flush_shmem->slots[i].latch = NULL;
+        }
+    }
+}
+
+static bool pinecone_flush_worker_launch(Oid dboid) {
+    BackgroundWorker worker;
+    BackgroundWorkerHandle* handle;
+
+    memset(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+    worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+    worker.bgw_restart_time = BGW_NEVER_RESTART; // the next checkpoint starts it again
+    strcpy(worker.bgw_library_name, "vector");
+    strcpy(worker.bgw_function_name, "pinecone_flush_worker_main");
+    snprintf(worker.bgw_name, BGW_MAXLEN, "pinecone flusher for database %u", dboid);
+    strcpy(worker.bgw_type, "pinecone flusher");
+    worker.bgw_main_arg = ObjectIdGetDatum(dboid);
+    worker.bgw_notify_pid = 0;
+    return RegisterDynamicBackgroundWorker(&worker, &handle);
+}
+
+/*
+ * Make sure there is a flusher for this database. Returns false if there isn't and we couldn't start one,
+ * in which case the caller flushes the checkpoint itself.
+ */
+static bool pinecone_flush_worker_ensure(void) {
+    PineconeFlushWorkerSlot* slot = NULL;
+    TimestampTz now = GetCurrentTimestamp();
+    bool launch = false;
+
+    SpinLockAcquire(&flush_shmem->mutex);
+    for (int i = 0; i < PINECONE_MAX_FLUSH_WORKERS && slot == NULL; i++) {
+        if (flush_shmem->slots[i].dboid == MyDatabaseId) slot = &flush_shmem->slots[i];
+    }
+    if (slot == NULL) {
+        for (int i = 0; i < PINECONE_MAX_FLUSH_WORKERS && slot == NULL; i++) {
+            if (flush_shmem->slots[i].dboid == InvalidOid) slot = &flush_shmem->slots[i];
+        }
+        if (slot != NULL) {
+            slot->dboid = MyDatabaseId;
+            slot->pid = 0;
+            slot->latch = NULL;
+            slot->launched_at = now;
+            launch = true;
+        }
+    } else if (slot->pid == 0 && TimestampDifferenceExceeds(slot->launched_at, now, PINECONE_FLUSH_WORKER_START_TIMEOUT)) {
+        slot->launched_at = now;
+        launch = true;
+    }
+    SpinLockRelease(&flush_shmem->mutex);
+
+    if (slot == NULL) return false; // every slot is taken by another database
+    if (launch && !pinecone_flush_worker_launch(MyDatabaseId)) {
+        ereport(DEBUG1, (errmsg("Could not start a pinecone flusher, flushing in this backend"),
+                         errhint("You may need to increase max_worker_processes.")));
+        SpinLockAcquire(&flush_shmem->mutex);
+        if (slot->pid == 0) slot->dboid = InvalidOid;
+        SpinLockRelease(&flush_shmem->mutex);
+        return false;
+    }
+    return true;
+}
+
+static void pinecone_flush_xact_callback(XactEvent event, void *arg) {
+    Latch* latch = NULL;
+    if (!flush_wake_pending) return;
+    if (event == XACT_EVENT_COMMIT) {
+        // only spinlocks here, we can't raise an error after commit
+        SpinLockAcquire(&flush_shmem->mutex);
+        for (int i = 0; i < PINECONE_MAX_FLUSH_WORKERS; i++) {
+            if (flush_shmem->slots[i].dboid == MyDatabaseId) latch = flush_shmem->slots[i].latch;
+        }
+        SpinLockRelease(&flush_shmem->mutex);
+        if (latch != NULL) SetLatch(latch);
+        flush_wake_pending = false;
+    } else if (event == XACT_EVENT_ABORT) {
+        flush_wake_pending = false;
+    }
+}
+
+/*
+ * Hand the checkpoint that was just created to the background flusher.
+ * Returns false if the caller has to flush it.
+ */
+bool pinecone_flush_in_background(void) {
+    if (!pinecone_background_flush || flush_shmem == NULL) return false;
+    if (!pinecone_flush_worker_ensure()) return false;
+    if (!flush_xact_callback_registered) {
+        RegisterXactCallback(pinecone_flush_xact_callback, NULL);
+        flush_xact_callback_registered = true;
+    }
+    flush_wake_pending = true;
+    return true;
+}
+
+/*
+ * Worker side
+ */
+
+static void pinecone_flush_worker_detach_shmem(int code, Datum arg) {
+    SpinLockAcquire(&flush_shmem->mutex);
+    flush_shmem->slots[flush_worker_slot].dboid = InvalidOid;
+    flush_shmem->slots[flush_worker_slot].pid = 0;
+    flush_shmem->slots[flush_worker_slot].latch = NULL;
+    SpinLockRelease(&flush_shmem->mutex);
+}
+
+// flush every pinecone index in the database that has unflushed checkpoints, and poll the ones with unready checkpoints
+static void pinecone_flush_database(void) {
+    List* indexes = NIL;
+    ListCell* lc;
+    Oid am_oid;
+
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    pgstat_report_activity(STATE_RUNNING, "flushing pinecone indexes");
+
+    am_oid = get_index_am_oid("pinecone", true);
+    if (OidIsValid(am_oid)) {
+        Relation pg_class = table_open(RelationRelationId, AccessShareLock);
+        TableScanDesc scan = table_beginscan_catalog(pg_class, 0, NULL);
+        HeapTuple tuple;
+        while ((tuple = heap_getnext(scan, ForwardScanDirection)) != NULL) {
+            Form_pg_class form = (Form_pg_class) GETSTRUCT(tuple);
+            if (form->relkind == RELKIND_INDEX && form->relam == am_oid) indexes = lappend_oid(indexes, form->oid);
+        }
+        table_endscan(scan);
+        table_close(pg_class, AccessShareLock);
+    }
+
+    foreach(lc, indexes) {
+        Oid index_oid = lfirst_oid(lc);
+        Relation index;
+        PineconeBufferMetaPageData buffer_meta;
+        // the same lock as an insert; skip indexes that are being dropped or rebuilt
+        if (!ConditionalLockRelationOid(index_oid, RowExclusiveLock)) continue;
+        index = try_relation_open(index_oid, NoLock);
+        if (index == NULL) continue;
+        // rows in the pages of stripes nobody inserts into anymore would otherwise never reach a checkpoint
+        (void) LinkIdleStripePages(index);
+        buffer_meta = PineconeSnapshotBufferMeta(index);
+        if (buffer_meta.flush_checkpoint.checkpoint_no < buffer_meta.latest_checkpoint.checkpoint_no) {
+            elog(DEBUG1, "Flushing %s (checkpoint %d of %d)", RelationGetRelationName(index),
+                 buffer_meta.flush_checkpoint.checkpoint_no, buffer_meta.latest_checkpoint.checkpoint_no);
+            FlushToPinecone(index);
+        }
+        pinecone_liveness_poll(index);
+        relation_close(index, NoLock);
+    }
+
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+    pgstat_report_stat(false);
+    pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+void pinecone_flush_worker_main(Datum main_arg) {
+    Oid dboid = DatumGetObjectId(main_arg);
+    long naptime;
+
+    pqsignal(SIGHUP, SignalHandlerForConfigReload);
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
+
+    // take over the slot the launching backend reserved
+    SpinLockAcquire(&flush_shmem->mutex);
+    for (int i = 0; i < PINECONE_MAX_FLUSH_WORKERS; i++) {
+        if (flush_shmem->slots[i].dboid == dboid && flush_shmem->slots[i].pid == 0) {
+            flush_shmem->slots[i].pid = MyProcPid;
+            flush_shmem->slots[i].latch = MyLatch;
+            flush_worker_slot = i;
+            break;
+        }
+    }
+    SpinLockRelease(&flush_shmem->mutex);
+    if (flush_worker_slot < 0) proc_exit(0); // another flusher got there first
+    on_shmem_exit(pinecone_flush_worker_detach_shmem, (Datum) 0);
+
+    BackgroundWorkerInitializeConnectionByOid(dboid, InvalidOid, 0);
+    elog(LOG, "pinecone flusher started");
+
+    while (true) {
+        ResetLatch(MyLatch);
+        CHECK_FOR_INTERRUPTS();
+        if (ConfigReloadPending) {
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
+        if (!pinecone_background_flush) break;
+
+        // an error (e.g. pinecone is down) is reported and retried after the naptime
+        PG_TRY();
+        {
+            pinecone_flush_database();
+        }
+        PG_CATCH();
+        {
+            HOLD_INTERRUPTS();
+            EmitErrorReport();
+            AbortOutOfAnyTransaction();
+            FlushErrorState();
+            RESUME_INTERRUPTS();
+        }
+        PG_END_TRY();
+
+        naptime = pinecone_flush_naptime;
+        if (pinecone_liveness_max_age > 0) naptime = Min(naptime, Max(pinecone_liveness_max_age / 2, 10));
+        (void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH, naptime, PG_WAIT_EXTENSION);
+    }
+    elog(LOG, "pinecone flusher exiting because pinecone.background_flush is off");
+    proc_exit(0);
+}
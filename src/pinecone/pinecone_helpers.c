@@ -7,8 +7,10 @@
 #include <nodes/execnodes.h>
 #include "funcapi.h"
 #include "src/cJSON.h"
+#include "catalog/pg_type_d.h"
 #include "utils/builtins.h"
 #include "executor/spi.h"
+#include "miscadmin.h"
 #include "fmgr.h"
 
 
@@ -110,6 +112,63 @@ pinecone_indexes(PG_FUNCTION_ARGS) {
 	return (Datum) 0;
 }
 
+/*
+ * Request statistics of this backend for each pinecone host it has talked to
+ */
+PGDLLEXPORT PG_FUNCTION_INFO_V1(pinecone_host_stats);
+Datum
+pinecone_host_stats(PG_FUNCTION_ARGS) {
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    Tuplestorestate *tupstore;
+    TupleDesc tupdesc;
+    MemoryContext oldcontext;
+    const char* host;
+    PineconeHostStats* stats;
+
+    if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) || !(rsinfo->allowedModes & SFRM_Materialize))
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("materialize mode required, but it is not allowed in this context")));
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("function result type must be a row type")));
+
+    oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+    tupdesc = CreateTupleDescCopy(tupdesc);
+    tupstore = tuplestore_begin_heap(true, false, work_mem);
+    MemoryContextSwitchTo(oldcontext);
+
+    for (int i = 0; pinecone_host_stats_at(i, &host, &stats); i++) {
+        Datum values[14];
+        bool nulls[14] = {false};
+        const char* breaker_states[] = {"closed", "open", "half open"};
+        double percentiles[3] = {50, 95, 99};
+        values[0] = PointerGetDatum(cstring_to_text(host));
+        values[1] = Int64GetDatum(stats->n_queries);
+        values[2] = Int64GetDatum(stats->n_failures);
+        values[3] = Int64GetDatum(stats->n_hedged);
+        values[4] = Int64GetDatum(stats->n_hedge_wins);
+        values[5] = Int64GetDatum(stats->n_deadline_exceeded);
+        for (int j = 0; j < 3; j++) {
+            double latency = pinecone_latency_percentile(stats, percentiles[j]);
+            nulls[6 + j] = latency < 0;
+            values[6 + j] = Float8GetDatum(latency);
+        }
+        values[9] = PointerGetDatum(cstring_to_text(breaker_states[stats->breaker_state]));
+        values[10] = Int64GetDatum(stats->upsert_bytes);
+        values[11] = Int64GetDatum(stats->upsert_bytes_sent);
+        values[12] = Int64GetDatum(stats->n_throttled);
+        values[13] = Int64GetDatum(stats->n_upsert_retries);
+        tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+    }
+
+    rsinfo->returnMode = SFRM_Materialize;
+    rsinfo->setResult = tupstore;
+    rsinfo->setDesc = tupdesc;
+    return (Datum) 0;
+}
+
 PGDLLEXPORT PG_FUNCTION_INFO_V1(pinecone_delete_unused_indexes);
 Datum
 pinecone_delete_unused_indexes(PG_FUNCTION_ARGS) {
@@ -271,9 +330,13 @@ pinecone_print_index_stats(PG_FUNCTION_ARGS) {
 PGDLLEXPORT PG_FUNCTION_INFO_V1(pinecone_create_mock_table);
 Datum
 pinecone_create_mock_table(PG_FUNCTION_ARGS) {
-    char query[256];
+    // chunk_size: deliver the response this many bytes at a time, as curl does with a response that arrives in pieces
+    // delay_ms: the response arrives this long after the request is sent (queries only)
+    // times: answer this many requests and then no more (any number if null)
+    // status: the HTTP status of the response (none, which counts as a success, if null)
+    const char* query = "CREATE TABLE pinecone_mock (id SERIAL PRIMARY KEY, url_prefix TEXT, method TEXT, body TEXT, response TEXT, "
+                        "curl_code INT NOT NULL DEFAULT 0, chunk_size INT, delay_ms INT, times INT, status INT);";
     int ret;
-    sprintf(query, "CREATE TABLE pinecone_mock (id SERIAL PRIMARY KEY, url_prefix TEXT, method TEXT, body TEXT, response TEXT, curl_code INT NOT NULL DEFAULT 0);");
     SPI_connect();
     ret = SPI_execute(query, false, 0);
     if (ret != SPI_OK_UTILITY) {
@@ -285,40 +348,69 @@ pinecone_create_mock_table(PG_FUNCTION_ARGS) {
 }
 #endif // PINECONE_MOCK
 
+/*
+ * Answer a request from the pinecone_mock table instead of sending it.
+ * Of the mocks whose url_prefix, method and body match (a null one matches anything) and that haven't been used up
+ * their number of times, the oldest is used.
+ * The response is delivered through write_callback, the same way curl would, in chunks of the mock's chunk_size if it has one.
+ * Its delay_ms is left in response_data for the caller to wait out.
+ */
 void lookup_mock_response(CURL* hnd, ResponseData* response_data, CURLcode* curl_code) {
-    char query[1024]; // todo: doesn't accomodate large bodies
-    int ret;
+    const char* query = "SELECT response, curl_code, chunk_size, delay_ms, CASE WHEN times IS NOT NULL THEN id END, status FROM pinecone_mock "
+                        "WHERE ($1 LIKE url_prefix || '%' OR url_prefix IS NULL) "
+                        "AND (method IS NULL OR method = $2) "
+                        "AND (body IS NULL OR body = $3) "
+                        "AND (times IS NULL OR times > 0) "
+                        "ORDER BY id LIMIT 1";
+    const char* use = "UPDATE pinecone_mock SET times = times - 1 WHERE id = $1";
+    Oid use_argtypes[1] = {INT4OID};
+    Oid argtypes[3] = {TEXTOID, TEXTOID, TEXTOID};
+    Datum args[3];
+    char nulls[3] = {' ', ' ', ' '};
+    MemoryContext context = CurrentMemoryContext;
     char* response = NULL;
-    // recover the url from the handle
+    int chunk_size = 0;
     char* url;
-    curl_easy_getinfo(hnd, CURLINFO_EFFECTIVE_URL, &url);
+    int ret;
 
+    // recover the url from the handle
+    curl_easy_getinfo(hnd, CURLINFO_EFFECTIVE_URL, &url);
+    args[0] = CStringGetTextDatum(url);
+    args[1] = CStringGetTextDatum(response_data->method);
+    if (response_data->request_body != NULL) args[2] = CStringGetTextDatum(response_data->request_body);
+    else nulls[2] = 'n';
 
     SPI_connect();
-    // we want startswith the url prefix and we can allow any of url_prefix, method, body if they are null
-    sprintf(query, "SELECT response, curl_code FROM pinecone_mock WHERE ('%s' LIKE url_prefix || '%%' OR url_prefix IS NULL) \
-                            AND (method IS NULL OR method = '%s') \
-                            AND (body IS NULL OR body = '%s');", url, response_data->method, response_data->request_body);
-    ret = SPI_execute(query, false, 0);
-    if (ret == SPI_OK_SELECT && SPI_processed > 0) {
+    ret = SPI_execute_with_args(query, 3, argtypes, args, nulls, false, 0);
+    if (ret != SPI_OK_SELECT || SPI_processed == 0) {
+        ereport(ERROR, (errmsg("No matching mock response found for %s %s", response_data->method, url),
+                        response_data->request_body != NULL ? errdetail("Request body: %s", response_data->request_body) : 0));
+    } else {
+        HeapTuple tuple = SPI_tuptable->vals[0];
         TupleDesc tupdesc = SPI_tuptable->tupdesc;
-        SPITupleTable *tuptable = SPI_tuptable;
-        HeapTuple tuple = tuptable->vals[0];
         bool isnull;
         Datum datum;
-        datum = heap_getattr(tuple, 1, tupdesc, &isnull);
-        if (!isnull) {
-            response = TextDatumGetCString(datum); 
-            response_data->data = palloc(strlen(response) + 1);
-            strcpy(response_data->data, response);
+        datum = SPI_getbinval(tuple, tupdesc, 1, &isnull);
+        if (!isnull) response = MemoryContextStrdup(context, TextDatumGetCString(datum)); // outlives SPI
+        datum = SPI_getbinval(tuple, tupdesc, 2, &isnull);
+        if (!isnull) *curl_code = DatumGetInt32(datum);
+        datum = SPI_getbinval(tuple, tupdesc, 3, &isnull);
+        if (!isnull) chunk_size = DatumGetInt32(datum);
+        datum = SPI_getbinval(tuple, tupdesc, 4, &isnull);
+        response_data->mock_delay_ms = isnull ? 0 : DatumGetInt32(datum);
+        datum = SPI_getbinval(tuple, tupdesc, 6, &isnull);
+        if (!isnull) response_data->status = DatumGetInt32(datum);
+        datum = SPI_getbinval(tuple, tupdesc, 5, &isnull); // the id of a mock with a number of times
+        if (!isnull) SPI_execute_with_args(use, 1, use_argtypes, &datum, NULL, false, 0);
+    }
+    SPI_finish();
 
+    if (response != NULL) {
+        size_t length = strlen(response);
+        size_t chunk = (chunk_size > 0) ? chunk_size : Max(length, 1);
+        for (size_t offset = 0; offset < length; offset += chunk) {
+            write_callback(response + offset, 1, Min(chunk, length - offset), response_data);
         }
-        datum = heap_getattr(tuple, 2, tupdesc, &isnull);
-        if (!isnull) {
-            *curl_code = DatumGetInt32(datum);
-        }
-    } else {
-        elog(ERROR, "No matching mock response found for query: %s", query);
+        pfree(response);
     }
-    SPI_finish();
-}
\ No newline at end of file
+}
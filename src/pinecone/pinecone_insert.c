@@ -1,6 +1,5 @@
 #include "pinecone.h"
 
-#include <access/generic_xlog.h>
 #include <storage/bufmgr.h>
 #include "utils/memutils.h"
 #include "storage/lmgr.h"
@@ -9,12 +8,20 @@
 
 #include <access/heapam.h>
 #include <access/tableam.h>
+#include "access/relation.h"
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "utils/snapmgr.h"
+#include "utils/timestamp.h"
 
 #define PINECONE_FLUSH_LOCK_IDENTIFIER 1969841813 // random number, uniquely identifies the pinecone insertion lock
 #define PINECONE_APPEND_LOCK_IDENTIFIER 1969841814 // random number, uniquely identifies the pinecone append lock
+#define PINECONE_STRIPE_LOCK_IDENTIFIER 1969841815 // random number, uniquely identifies the pinecone stripe locks
 
 #define SET_LOCKTAG_FLUSH(lock, index)  SET_LOCKTAG_ADVISORY(lock, MyDatabaseId, (uint32) index->rd_id, PINECONE_FLUSH_LOCK_IDENTIFIER, 0)
 #define SET_LOCKTAG_APPEND(lock, index) SET_LOCKTAG_ADVISORY(lock, MyDatabaseId, (uint32) index->rd_id, PINECONE_APPEND_LOCK_IDENTIFIER, 0)
+#define SET_LOCKTAG_STRIPE(lock, index, stripe) SET_LOCKTAG_ADVISORY(lock, MyDatabaseId, (uint32) index->rd_id, PINECONE_STRIPE_LOCK_IDENTIFIER, stripe)
 
 void PineconePageInit(Page page, Size pageSize)
 {
@@ -28,148 +35,407 @@ void PineconePageInit(Page page, Size pageSize)
     // ItemPointerSetInvalid
 }
 
-/* 
- * add a tuple to the end of the buffer
- * return true if a new page was created
+/*
+ * Insertions are queued per index and appended to the buffer a page at a time, so a COPY or an
+ * INSERT ... SELECT takes the stripe lock and writes a WAL record once per page rather than once per row.
+ * The queue is appended when it holds a page's worth of tuples, at the end of the statement (on PG17+),
+ * before a scan of the same index, and at the latest before the transaction commits.
+ * If the transaction aborts the queue is dropped; its rows are dead anyway.
+ * With inline vectors the queue holds the encoded vectors too.
+ */
+
+typedef struct PineconePendingAppends
+{
+    Oid indexoid;
+    int inline_vectors;
+    int dimensions;
+    int vector_size;
+    int capacity; // a page's worth
+    int n_tids;
+    ItemPointer tids;
+    char* vectors; // capacity * vector_size bytes, NULL without inline vectors
+    struct PineconePendingAppends* next;
+} PineconePendingAppends;
+
+static PineconePendingAppends* pending_appends = NULL; // allocated in TopTransactionContext
+static bool pending_xact_callback_registered = false;
+// the last flush of left behind checkpoints that stopped short, so that we don't read the same unsettled rows over and over
+static Oid held_back_indexoid = InvalidOid;
+static int held_back_checkpoint_no;
+static TimestampTz held_back_at;
+
+// extend the relation by a page; the caller formats it
+static Buffer pinecone_new_buffer_page(Relation index)
+{
+    Buffer buf;
+    LockRelationForExtension(index, ExclusiveLock);
+    buf = ReadBufferExtended(index, MAIN_FORKNUM, P_NEW, RBM_NORMAL, NULL);
+    LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+    UnlockRelationForExtension(index, ExclusiveLock);
+    return buf;
+}
+
+// give a stripe its first page; the caller holds the stripe lock
+static void pinecone_init_stripe_page(Relation index, int stripe)
+{
+    PineconeWalState wal;
+    Buffer buffer_meta_buf, newbuf;
+    Page buffer_meta_page, newpage;
+    xl_pinecone_init_stripe xlrec;
+
+    newbuf = pinecone_new_buffer_page(index);
+    buffer_meta_buf = ReadBuffer(index, PINECONE_BUFFER_METAPAGE_BLKNO); LockBuffer(buffer_meta_buf, BUFFER_LOCK_EXCLUSIVE);
+    pinecone_wal_start(&wal, index);
+    newpage = pinecone_wal_register(&wal, newbuf, true);
+    buffer_meta_page = pinecone_wal_register(&wal, buffer_meta_buf, false);
+    xlrec.stripe = stripe;
+
+    pinecone_wal_begin_changes(&wal);
+    PineconePageInit(newpage, BufferGetPageSize(newbuf));
+    pinecone_apply_init_stripe(buffer_meta_page, stripe, BufferGetBlockNumber(newbuf));
+    pinecone_wal_finish(&wal, XLOG_PINECONE_INIT_STRIPE, (char *) &xlrec, sizeof(xlrec));
+    UnlockReleaseBuffer(newbuf); UnlockReleaseBuffer(buffer_meta_buf);
+}
+
+/*
+ * Link a stripe's page after the insert page and give the stripe a new page.
+ * The caller holds the stripe lock and the append lock.
+ * Returns true if the linked page is a new checkpoint.
  */
-bool AppendBufferTuple(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid, Relation heapRel)
+static bool pinecone_link_stripe_page(Relation index, int stripe)
 {
-    // IndexTuple itup;
-    GenericXLogState *state;
-    Buffer buffer_meta_buf, insert_buf, newbuf = InvalidBuffer;
-    Page buffer_meta_page, insert_page, newpage;
-    PineconeBufferOpaque  new_opaque;
+    PineconeBufferMetaPageData meta_snapshot = PineconeSnapshotBufferMeta(index);
+    BlockNumber stripe_blkno = meta_snapshot.stripe_pages[stripe]; // only changed under the stripe lock
+    PineconeWalState wal;
+    Buffer stripe_buf, insert_buf, buffer_meta_buf, newbuf;
+    Page stripe_page, insert_page, buffer_meta_page, newpage;
     PineconeBufferMetaPage buffer_meta;
-    BlockNumber newblkno;
+    xl_pinecone_link xlrec;
+
+    if (!PineconeStripePageIsValid(stripe_blkno)) return false;
+    stripe_buf = ReadBuffer(index, stripe_blkno); LockBuffer(stripe_buf, BUFFER_LOCK_EXCLUSIVE);
+    if (PineconePageGetNTids(BufferGetPage(stripe_buf)) == 0) {
+        // nothing to link
+        UnlockReleaseBuffer(stripe_buf);
+        return false;
+    }
+    // the insert page only changes under the append lock
+    insert_buf = ReadBuffer(index, meta_snapshot.insert_page); LockBuffer(insert_buf, BUFFER_LOCK_EXCLUSIVE);
+    buffer_meta_buf = ReadBuffer(index, PINECONE_BUFFER_METAPAGE_BLKNO); LockBuffer(buffer_meta_buf, BUFFER_LOCK_EXCLUSIVE);
+    newbuf = pinecone_new_buffer_page(index);
+    pinecone_wal_start(&wal, index);
+    stripe_page = pinecone_wal_register(&wal, stripe_buf, false);
+    insert_page = pinecone_wal_register(&wal, insert_buf, false);
+    buffer_meta_page = pinecone_wal_register(&wal, buffer_meta_buf, false);
+    newpage = pinecone_wal_register(&wal, newbuf, true);
+    buffer_meta = PineconePageGetBufferMeta(buffer_meta_page);
+
+    // work out the link: the stripe's page goes after the insert page, and is a checkpoint if that completes a batch
+    memset(&xlrec, 0, sizeof(xlrec));
+    xlrec.stripe = stripe;
+    xlrec.create_checkpoint = buffer_meta->n_tuples_since_last_checkpoint + PineconePageGetNTids(insert_page) >= PINECONE_BATCH_SIZE;
+    xlrec.n_tuples_since_last_checkpoint = buffer_meta->n_tuples_since_last_checkpoint + PineconePageGetNTids(insert_page);
+    if (xlrec.create_checkpoint) {
+        int n_stripe_tids;
+        ItemPointer stripe_tids = PineconePageGetTids(stripe_page, &n_stripe_tids);
+        xlrec.prev_checkpoint_blkno = buffer_meta->latest_checkpoint.blkno;
+        xlrec.checkpoint = buffer_meta->latest_checkpoint;
+        xlrec.checkpoint.tid = stripe_tids[0]; // we will assume we have inserted up to this point if we see this in pinecone (until the flush picks a row it upserted)
+        xlrec.checkpoint.blkno = stripe_blkno;
+        xlrec.checkpoint.checkpoint_no += 1;
+        xlrec.checkpoint.n_preceding_tuples += xlrec.n_tuples_since_last_checkpoint;
+        xlrec.n_tuples_since_last_checkpoint = 0;
+    }
+
+    pinecone_wal_begin_changes(&wal);
+    PineconePageInit(newpage, BufferGetPageSize(newbuf)); // the stripe continues on a new page
+    pinecone_apply_link(stripe_page, stripe_blkno, insert_page, buffer_meta_page, BufferGetBlockNumber(newbuf), &xlrec);
+    pinecone_wal_finish(&wal, XLOG_PINECONE_LINK, (char *) &xlrec, sizeof(xlrec));
+
+    // release stripe page, insert page, meta, new page
+    UnlockReleaseBuffer(stripe_buf); UnlockReleaseBuffer(insert_buf); UnlockReleaseBuffer(buffer_meta_buf); UnlockReleaseBuffer(newbuf);
+    return xlrec.create_checkpoint;
+}
+
+/*
+ * Link the pages of the stripes we can lock without waiting, i.e. that nobody is appending to right now,
+ * so that their rows make it into a checkpoint even if their backends never insert again.
+ * The caller holds the append lock, and the stripe lock of skip_stripe (-1 for none).
+ * Returns true if a checkpoint was created.
+ */
+static bool pinecone_link_idle_stripe_pages(Relation index, int skip_stripe)
+{
+    bool checkpoint_created = false;
+    for (int stripe = 0; stripe < PINECONE_INSERT_STRIPES; stripe++) {
+        LOCKTAG stripe_lock;
+        if (stripe == skip_stripe) continue;
+        SET_LOCKTAG_STRIPE(stripe_lock, index, stripe);
+        if (LockAcquire(&stripe_lock, ExclusiveLock, false, true) == LOCKACQUIRE_NOT_AVAIL) continue;
+        checkpoint_created |= pinecone_link_stripe_page(index, stripe);
+        LockRelease(&stripe_lock, ExclusiveLock, false);
+    }
+    return checkpoint_created;
+}
+
+static int pinecone_page_n_tids(Relation index, BlockNumber blkno)
+{
+    Buffer buf = ReadBuffer(index, blkno);
+    int n_tids;
+    LockBuffer(buf, BUFFER_LOCK_SHARE);
+    n_tids = PineconePageGetNTids(BufferGetPage(buf));
+    UnlockReleaseBuffer(buf);
+    return n_tids;
+}
+
+/*
+ * Link the pages of the idle stripes, for the background flusher: nothing else links them once inserts stop.
+ * Only done once the rows waiting in the stripes complete a batch, since until then they would wait
+ * for a checkpoint after the insert page just the same, and every link starts the stripe on a new page.
+ * Returns true if a checkpoint was created.
+ */
+bool LinkIdleStripePages(Relation index)
+{
     LOCKTAG pinecone_append_lock;
-    Size itemsz;
     PineconeBufferMetaPageData meta_snapshot;
-    bool full;
-    bool create_checkpoint = false;
-    
-    // prepare the index tuple
-    // itup = index_form_tuple(RelationGetDescr(index), values, isnull);
-    // itup->t_tid = *heap_tid;
-    // itemsz = MAXALIGN(IndexTupleSize(itup));
-    
-    //
-    PineconeBufferTuple buffer_tid;
-    buffer_tid.tid = *heap_tid;
-    itemsz = MAXALIGN(sizeof(PineconeBufferTuple));
+    int n_waiting;
+    bool checkpoint_created;
+    SET_LOCKTAG_APPEND(pinecone_append_lock, index); LockAcquire(&pinecone_append_lock, ExclusiveLock, false, false);
+    meta_snapshot = PineconeSnapshotBufferMeta(index);
+    n_waiting = meta_snapshot.n_tuples_since_last_checkpoint + pinecone_page_n_tids(index, meta_snapshot.insert_page);
+    for (int stripe = 0; stripe < PINECONE_INSERT_STRIPES; stripe++) {
+        if (PineconeStripePageIsValid(meta_snapshot.stripe_pages[stripe])) n_waiting += pinecone_page_n_tids(index, meta_snapshot.stripe_pages[stripe]);
+    }
+    if (n_waiting < PINECONE_BATCH_SIZE) {
+        LockRelease(&pinecone_append_lock, ExclusiveLock, false);
+        return false;
+    }
+    checkpoint_created = pinecone_link_idle_stripe_pages(index, -1);
+    LockRelease(&pinecone_append_lock, ExclusiveLock, false);
+    return checkpoint_created;
+}
+
+/*
+ * add tuples to the end of the buffer
+ * return true if a checkpoint was created
+ */
+bool AppendBufferTuples(Relation index, ItemPointer heap_tids, char* vectors, int vector_size, int n_tids)
+{
+    int stripe = MyProcPid % PINECONE_INSERT_STRIPES;
+    PineconeWalState wal;
+    Buffer stripe_buf;
+    Page stripe_page;
+    LOCKTAG pinecone_stripe_lock, pinecone_append_lock;
+    PineconeBufferMetaPageData meta_snapshot;
+    bool checkpoint_created = false;
+    int i = 0;
 
     /* LOCKING STRATEGY FOR INSERTION
-     * acquire append lock
-     * read a snapshot of meta
-     * acquire meta.insert_page
-     * if insert_page is not full:
-     *   add item to insert_page:
-     * if insert_page is full:
-     *   acquire meta
-     *   acquire & create newpage
-     *   add item to newpage:
-     *     insert_page.nextblkno = newpage.blkno
-     *     meta.n_unflushed_tuples += (tuples on old page)
-     *     meta.insert_page = newpage.blkno
-     *   if this qualifies as a checkpoint:
-     *     newpage.prev_checkpoint = meta.latest_checkpoint
-     *     meta.latest_checkpoint = newpage.blkno
-     *     newpage.representative_vector_heap_tid = itup.t_tid
-     *   release newpage, meta
-     * release insert_page, newpage, meta
-     * release append lock
-     * (if it was full and threshold met, we will next try to advance pinecone head)
+     * Each backend appends to the page of its stripe, so concurrent inserters don't wait on each other.
+     * acquire stripe lock
+     * until all the tuples are added:
+     *   read a snapshot of meta
+     *   acquire meta.stripe_pages[stripe]
+     *   add items to it while it is not full (and it doesn't complete a batch)
+     *   release it
+     *   if it is full (or completes a batch):
+     *     acquire append lock
+     *     acquire stripe page, insert_page, meta & create newpage
+     *     insert_page.nextblkno = stripe page
+     *     meta.n_unflushed_tuples += (tuples on old insert_page)
+     *     meta.insert_page = stripe page
+     *     if this qualifies as a checkpoint:
+     *       stripe page.prev_checkpoint = meta.latest_checkpoint
+     *       meta.latest_checkpoint = stripe page
+     *       stripe page.representative_vector_heap_tid = first item on the stripe page (the flush replaces it in meta.recent_flushes
+     *       with the first row it actually upserts, since this one may be rolled back)
+     *     meta.stripe_pages[stripe] = newpage
+     *     release stripe page, insert_page, meta, newpage
+     *     if a checkpoint was created, link the pages of the stripes we can lock without waiting too,
+     *     so that the next batch takes in rows from stripes that nobody is inserting into anymore
+     *     release append lock
+     * release stripe lock
+     * (if a checkpoint was created, we will next try to advance pinecone head)
+     * (the background flusher links the pages of idle stripes too, see LinkIdleStripePages)
      */
 
-    // acquire append lock
-    SET_LOCKTAG_APPEND(pinecone_append_lock, index); LockAcquire(&pinecone_append_lock, ExclusiveLock, false, false);
-    // start WAL logging
-    state = GenericXLogStart(index);
-    // read a snapshot of the buffer meta
-    meta_snapshot = PineconeSnapshotBufferMeta(index);
-    // acquire the insert page
-    insert_buf = ReadBuffer(index, meta_snapshot.insert_page); LockBuffer(insert_buf, BUFFER_LOCK_EXCLUSIVE);
-    insert_page = GenericXLogRegisterBuffer(state, insert_buf, 0);
-    // check if the page is full and if we want to create a new checkpoint
-    full = PageGetFreeSpace(insert_page) < itemsz;
-    create_checkpoint = meta_snapshot.n_tuples_since_last_checkpoint + PageGetMaxOffsetNumber(insert_page) >= PINECONE_BATCH_SIZE;
-
-    // add item to insert page
-    if (!full && !create_checkpoint) {
-        // PageAddItem(insert_page, (Item) itup, itemsz, InvalidOffsetNumber, false, false);
-        PageAddItem(insert_page, (Item) &buffer_tid, itemsz, InvalidOffsetNumber, false, false);
-
-        // log the number of items on this page MaxOffsetNumber
-        elog(DEBUG1, "No new page! Page has %lu items", (unsigned long)PageGetMaxOffsetNumber(insert_page));
-
-        // release insert_page
-        GenericXLogFinish(state);
-        UnlockReleaseBuffer(insert_buf);
-    } else {
-        // acquire the meta
-        buffer_meta_buf = ReadBuffer(index, PINECONE_BUFFER_METAPAGE_BLKNO); LockBuffer(buffer_meta_buf, BUFFER_LOCK_EXCLUSIVE);
-        buffer_meta_page = GenericXLogRegisterBuffer(state, buffer_meta_buf, 0);
-        buffer_meta = PineconePageGetBufferMeta(buffer_meta_page);
-        // acquire and create a new page
-        LockRelationForExtension(index, ExclusiveLock); // acquire a lock to let us add pages to the relation (this isn't really necessary since we will always have the append lock anyway)
-        newbuf = ReadBufferExtended(index, MAIN_FORKNUM, P_NEW, RBM_NORMAL, NULL);
-        LockBuffer(newbuf, BUFFER_LOCK_EXCLUSIVE);
-        UnlockRelationForExtension(index, ExclusiveLock);
-        newpage = GenericXLogRegisterBuffer(state, newbuf, GENERIC_XLOG_FULL_IMAGE);
-        PineconePageInit(newpage, BufferGetPageSize(newbuf));
-        // check that there is room on the new page
-        if (PageGetFreeSpace(newpage) < itemsz) elog(ERROR, "A new page was created, but it doesn't have enough space for the new tuple");
-        // add item to new page
-        // PageAddItem(newpage, (Item) itup, itemsz, InvalidOffsetNumber, false, false);
-        PageAddItem(newpage, (Item) &buffer_tid, itemsz, InvalidOffsetNumber, false, false);
-        // update insert_page nextblkno
-        newblkno = BufferGetBlockNumber(newbuf);
-        PineconePageGetOpaque(insert_page)->nextblkno = newblkno;
-        // update meta
-        buffer_meta->insert_page = newblkno;
-        buffer_meta->n_tuples_since_last_checkpoint += PageGetMaxOffsetNumber(insert_page);
-        // if this qualifies as a checkpoint, set this page as the latest head checkpoint
-        if (create_checkpoint) {
-            // create a checkpoint on the opaque of the new page
-            new_opaque = PineconePageGetOpaque(newpage);
-            new_opaque->prev_checkpoint_blkno = buffer_meta->latest_checkpoint.blkno;
-            new_opaque->checkpoint = buffer_meta->latest_checkpoint;
-            new_opaque->checkpoint.tid = *heap_tid; // we will assume we have inserted up to this point if we see this in pinecone
-            new_opaque->checkpoint.blkno = newblkno;
-            new_opaque->checkpoint.checkpoint_no += 1;
-            new_opaque->checkpoint.n_preceding_tuples += buffer_meta->n_tuples_since_last_checkpoint;
-            // set this page as the latest head checkpoint
-            buffer_meta->latest_checkpoint = new_opaque->checkpoint;
-            buffer_meta->n_tuples_since_last_checkpoint = 0;
+    SET_LOCKTAG_STRIPE(pinecone_stripe_lock, index, stripe); LockAcquire(&pinecone_stripe_lock, ExclusiveLock, false, false);
+
+    while (i < n_tids) {
+        int n_room, n_add;
+        bool link;
 
+        // read a snapshot of the buffer meta
+        meta_snapshot = PineconeSnapshotBufferMeta(index);
+        if (!PineconeStripePageIsValid(meta_snapshot.stripe_pages[stripe])) {
+            pinecone_init_stripe_page(index, stripe);
+            continue;
+        }
+
+        // fill the stripe page until it is full or completes a batch
+        stripe_buf = ReadBuffer(index, meta_snapshot.stripe_pages[stripe]); LockBuffer(stripe_buf, BUFFER_LOCK_EXCLUSIVE);
+        stripe_page = BufferGetPage(stripe_buf);
+        n_room = Min(PineconePageGetTidRoom(stripe_page, vector_size),
+                     PINECONE_BATCH_SIZE - meta_snapshot.n_tuples_since_last_checkpoint - PineconePageGetNTids(stripe_page));
+        n_room = Max(0, n_room);
+        n_add = Min(n_tids - i, n_room);
+        if (n_add > 0) {
+            xl_pinecone_append* xlrec = palloc(SizeOfPineconeAppend(n_add, vector_size));
+            xlrec->n_tids = n_add;
+            xlrec->vector_size = vector_size;
+            memcpy(xlrec->tids, &heap_tids[i], sizeof(ItemPointerData) * n_add);
+            if (vector_size > 0) memcpy(XLogPineconeAppendGetVectors(xlrec), vectors + (Size) i * vector_size, (Size) n_add * vector_size);
+            pinecone_wal_start(&wal, index);
+            stripe_page = pinecone_wal_register(&wal, stripe_buf, false);
+            pinecone_wal_begin_changes(&wal);
+            pinecone_page_add_tids(stripe_page, xlrec->tids, XLogPineconeAppendGetVectors(xlrec), vector_size, n_add);
+            pinecone_wal_finish(&wal, XLOG_PINECONE_APPEND, (char *) xlrec, SizeOfPineconeAppend(n_add, vector_size));
+            pfree(xlrec);
+            i += n_add;
+        }
+        stripe_page = BufferGetPage(stripe_buf);
+        elog(DEBUG1, "Stripe %d page has %lu items", stripe, (unsigned long)PineconePageGetNTids(stripe_page));
+        link = n_add == n_room; // the page is full or completes a batch
+        UnlockReleaseBuffer(stripe_buf);
+
+        if (link) {
+            SET_LOCKTAG_APPEND(pinecone_append_lock, index); LockAcquire(&pinecone_append_lock, ExclusiveLock, false, false);
+            if (pinecone_link_stripe_page(index, stripe)) {
+                checkpoint_created = true;
+                pinecone_link_idle_stripe_pages(index, stripe);
+            }
+            LockRelease(&pinecone_append_lock, ExclusiveLock, false);
         }
-        // release insert_page, newpage, meta
-        GenericXLogFinish(state);
-        UnlockReleaseBuffer(insert_buf); UnlockReleaseBuffer(newbuf); UnlockReleaseBuffer(buffer_meta_buf);
     }
-    // release append lock
-    LockRelease(&pinecone_append_lock, ExclusiveLock, false);
-    return create_checkpoint;
+    // release stripe lock
+    LockRelease(&pinecone_stripe_lock, ExclusiveLock, false);
+    return checkpoint_created;
 }
 
-bool AppendBufferTupleInCtx(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid, Relation heapRel, IndexUniqueCheck checkUnique, IndexInfo *indexInfo)
+/*
+ * If there are enough tuples in the buffer, advance the pinecone tail (or have the background flusher do it).
+ * The flush stops at the first row whose fate isn't settled, and while committing we don't flush at all: the
+ * commit can still fail, and an error from pinecone must not roll it back. What is left behind is flushed by
+ * the next insert into or scan of the index, in any backend (see FlushLeftBehindCheckpoints).
+ */
+static void pinecone_checkpoint_created(Relation index, bool committing)
 {
-    MemoryContext oldCtx;
-    MemoryContext insertCtx;
-    bool checkpoint_created;
-    Vector* vector;
-    // use a memory context because index_form_tuple can allocate 
-    insertCtx = AllocSetContextCreate(CurrentMemoryContext,
-                                      "Pinecone insert tuple temporary context",
-                                      ALLOCSET_DEFAULT_SIZES);
-    oldCtx = MemoryContextSwitchTo(insertCtx);
+    if (pinecone_flush_in_background()) {
+        elog(DEBUG1, "Checkpoint created. Leaving it to the background flusher");
+        return;
+    }
+    if (committing) {
+        elog(DEBUG1, "Checkpoint created while committing. Leaving it to the next insert or scan");
+        return;
+    }
+    elog(DEBUG1, "Checkpoint created. Flushing to Pinecone");
+    FlushToPinecone(index);
+}
 
-    vector = DatumGetVector(values[0]);
-    validate_vector_nonzero(vector);
-    
-    checkpoint_created = AppendBufferTuple(index, values, isnull, heap_tid, heapRel);
-    MemoryContextSwitchTo(oldCtx);
-    MemoryContextDelete(insertCtx); // delete the temporary context
-    return checkpoint_created;
+/*
+ * Flush the checkpoints that were left behind because their rows weren't settled when they were created,
+ * e.g. by a transaction that created them while committing. Called before the first insert into the index
+ * in a transaction and before every scan, so that they don't wait for the backend that created them.
+ * Doesn't wait for a flush that is already running, and doesn't try again within pinecone.flush_naptime
+ * a flush that stopped short at the same checkpoint.
+ */
+void FlushLeftBehindCheckpoints(Relation index)
+{
+    PineconeBufferMetaPageData buffer_meta;
+    LOCKTAG pinecone_flush_lock;
+
+    if (RecoveryInProgress() || XactReadOnly) return; // the buffer meta can't be written
+    buffer_meta = PineconeSnapshotBufferMeta(index);
+    if (buffer_meta.flush_checkpoint.checkpoint_no >= buffer_meta.latest_checkpoint.checkpoint_no) return;
+    if (held_back_indexoid == RelationGetRelid(index) && held_back_checkpoint_no == buffer_meta.flush_checkpoint.checkpoint_no &&
+        !TimestampDifferenceExceeds(held_back_at, GetCurrentTimestamp(), pinecone_flush_naptime)) return;
+    if (pinecone_flush_in_background()) return;
+
+    SET_LOCKTAG_FLUSH(pinecone_flush_lock, index);
+    if (LockAcquire(&pinecone_flush_lock, ExclusiveLock, false, true) == LOCKACQUIRE_NOT_AVAIL) return; // another backend is flushing
+    elog(DEBUG1, "Flushing the checkpoints left behind (checkpoint %d of %d)",
+         buffer_meta.flush_checkpoint.checkpoint_no, buffer_meta.latest_checkpoint.checkpoint_no);
+    FlushToPinecone(index); // takes the lock again, which we already hold
+    LockRelease(&pinecone_flush_lock, ExclusiveLock, false);
+
+    buffer_meta = PineconeSnapshotBufferMeta(index);
+    if (buffer_meta.flush_checkpoint.checkpoint_no < buffer_meta.latest_checkpoint.checkpoint_no) {
+        held_back_indexoid = RelationGetRelid(index);
+        held_back_checkpoint_no = buffer_meta.flush_checkpoint.checkpoint_no;
+        held_back_at = GetCurrentTimestamp();
+    }
+}
+
+static void pinecone_append_pending(Relation index, PineconePendingAppends* pending, bool committing)
+{
+    int n_tids = pending->n_tids;
+    if (n_tids == 0) return;
+    pending->n_tids = 0; // an error past this point loses the queue along with the transaction
+    if (AppendBufferTuples(index, pending->tids, pending->vectors, pending->vector_size, n_tids)) pinecone_checkpoint_created(index, committing);
+}
+
+/*
+ * Append the tuples queued for this index to the buffer
+ */
+void AppendPendingBufferTuples(Relation index)
+{
+    for (PineconePendingAppends* pending = pending_appends; pending != NULL; pending = pending->next) {
+        if (pending->indexoid == RelationGetRelid(index)) pinecone_append_pending(index, pending, false);
+    }
+}
+
+// append whatever is still queued before the transaction commits
+static void pinecone_pending_xact_callback(XactEvent event, void *arg)
+{
+    switch (event) {
+        case XACT_EVENT_PRE_COMMIT:
+        case XACT_EVENT_PRE_PREPARE:
+            for (PineconePendingAppends* pending = pending_appends; pending != NULL; pending = pending->next) {
+                Relation index;
+                if (pending->n_tids == 0) continue;
+                index = try_relation_open(pending->indexoid, RowExclusiveLock);
+                if (index == NULL) continue; // dropped later in the transaction
+                pinecone_append_pending(index, pending, true);
+                relation_close(index, NoLock);
+            }
+            break;
+        case XACT_EVENT_COMMIT:
+        case XACT_EVENT_PREPARE:
+        case XACT_EVENT_ABORT:
+        case XACT_EVENT_PARALLEL_ABORT:
+            pending_appends = NULL; // freed with TopTransactionContext
+            break;
+        default:
+            break;
+    }
+}
+
+static PineconePendingAppends* pinecone_get_pending(Relation index)
+{
+    PineconePendingAppends* pending;
+    PineconeStaticMetaPageData static_meta;
+    for (pending = pending_appends; pending != NULL; pending = pending->next) {
+        if (pending->indexoid == RelationGetRelid(index)) return pending;
+    }
+    // our first insert into the index in this transaction
+    FlushLeftBehindCheckpoints(index);
+    if (!pending_xact_callback_registered) {
+        RegisterXactCallback(pinecone_pending_xact_callback, NULL);
+        pending_xact_callback_registered = true;
+    }
+    static_meta = PineconeSnapshotStaticMeta(index);
+    pending = MemoryContextAlloc(TopTransactionContext, sizeof(PineconePendingAppends));
+    pending->indexoid = RelationGetRelid(index);
+    pending->inline_vectors = static_meta.inline_vectors;
+    pending->dimensions = static_meta.dimensions;
+    pending->vector_size = pinecone_inline_vector_size(static_meta.inline_vectors, static_meta.dimensions);
+    pending->capacity = PINECONE_BUFFER_ENTRIES_PER_PAGE(pending->vector_size);
+    pending->n_tids = 0;
+    pending->tids = MemoryContextAlloc(TopTransactionContext, sizeof(ItemPointerData) * pending->capacity);
+    pending->vectors = NULL;
+    if (pending->vector_size > 0) pending->vectors = MemoryContextAllocZero(TopTransactionContext, (Size) pending->vector_size * pending->capacity);
+    pending->next = pending_appends;
+    pending_appends = pending;
+    return pending;
 }
 
 /*
@@ -182,41 +448,118 @@ bool pinecone_insert(Relation index, Datum *values, bool *isnull, ItemPointer he
 #endif
                      IndexInfo *indexInfo)
 {
-    bool checkpoint_created;
-
-    // add a tuple to the buffer
-    checkpoint_created = AppendBufferTupleInCtx(index, values, isnull, heap_tid, heap, checkUnique, indexInfo);
+    MemoryContext oldCtx;
+    MemoryContext insertCtx;
+    PineconePendingAppends* pending = pinecone_get_pending(index);
+    Vector* vector;
 
-    // if there are enough tuples in the buffer, advance the pinecone tail
-    if (checkpoint_created) {
-        elog(DEBUG1, "Checkpoint created. Flushing to Pinecone");
-        FlushToPinecone(index);
+    // use a memory context because detoasting the vector can allocate
+    insertCtx = AllocSetContextCreate(CurrentMemoryContext,
+                                      "Pinecone insert tuple temporary context",
+                                      ALLOCSET_DEFAULT_SIZES);
+    oldCtx = MemoryContextSwitchTo(insertCtx);
+    vector = DatumGetVector(values[0]);
+    validate_vector_nonzero(vector);
+    if (pending->vector_size > 0) {
+        // keep a copy of the vector to store inline
+        if (vector->dim != pending->dimensions) {
+            ereport(ERROR, (errcode(ERRCODE_DATA_EXCEPTION), errmsg("Vector has %d dimensions, which doesn't match the index", vector->dim)));
+        }
+        pinecone_encode_inline_vector(vector, pending->inline_vectors, pending->vectors + (Size) pending->n_tids * pending->vector_size);
     }
+    MemoryContextSwitchTo(oldCtx);
+    MemoryContextDelete(insertCtx); // delete the temporary context
 
-    // log the state of the relation for debugging
+    // queue the tuple, and add the queue to the buffer once it fills a page
+    pending->tids[pending->n_tids++] = *heap_tid;
+    indexInfo->ii_AmCache = pending; // so that aminsertcleanup is called
+    if (pending->n_tids == pending->capacity) pinecone_append_pending(index, pending, false);
 
     return false;
 }
 
+#if PG_VERSION_NUM >= 170000
+/*
+ * End of an insert statement
+ */
+void pinecone_insert_cleanup(Relation index, IndexInfo *indexInfo)
+{
+    AppendPendingBufferTuples(index);
+    indexInfo->ii_AmCache = NULL;
+}
+#endif
+
 // todo: it will make debugging a lot easier to have a way to pretty print the state of the relation e.g. how many tups per page
 
 
+// record that everything up to checkpoint is in pinecone, when, and which of its rows liveness fetches look for;
+// the cached ready checkpoint is persisted along with it
+static void pinecone_advance_flush_checkpoint(Relation index, PineconeCheckpoint checkpoint, ItemPointerData representative_tid)
+{
+    PineconeWalState wal;
+    Buffer buffer_meta_buf = ReadBuffer(index, PINECONE_BUFFER_METAPAGE_BLKNO);
+    Page buffer_meta_page;
+    PineconeBufferMetaPageData new_meta;
+    PineconeFlushTime* flush_time;
+    LockBuffer(buffer_meta_buf, BUFFER_LOCK_EXCLUSIVE);
+    // the flush checkpoint never moves back
+    if (checkpoint.checkpoint_no <= PineconePageGetBufferMeta(BufferGetPage(buffer_meta_buf))->flush_checkpoint.checkpoint_no) {
+        UnlockReleaseBuffer(buffer_meta_buf);
+        return;
+    }
+    pinecone_wal_start(&wal, index);
+    buffer_meta_page = pinecone_wal_register(&wal, buffer_meta_buf, false);
+    new_meta = *PineconePageGetBufferMeta(buffer_meta_page);
+    new_meta.flush_checkpoint = checkpoint;
+    (void) pinecone_liveness_lookup(index, &new_meta.ready_checkpoint); // only moves it forward, and never fetches
+    flush_time = &new_meta.recent_flushes[checkpoint.checkpoint_no % PINECONE_RECENT_FLUSHES];
+    flush_time->checkpoint = checkpoint;
+    flush_time->flushed_at = GetCurrentTimestamp();
+    flush_time->representative_tid = representative_tid;
+    pinecone_wal_begin_changes(&wal);
+    pinecone_apply_set_meta(buffer_meta_page, &new_meta);
+    pinecone_wal_finish(&wal, XLOG_PINECONE_SET_META, (char *) &new_meta, sizeof(new_meta));
+    UnlockReleaseBuffer(buffer_meta_buf);
+}
+
+/*
+ * Tell whether our own transaction has a stake in this tuple, i.e. inserted or deleted it.
+ * Its fate isn't settled until we commit.
+ */
+static bool pinecone_tuple_is_ours(TupleTableSlot *slot, bool deleted)
+{
+    HeapTupleHeader tuple = ExecFetchSlotHeapTuple(slot, false, NULL)->t_data;
+    if (!deleted) return TransactionIdIsCurrentTransactionId(HeapTupleHeaderGetXmin(tuple));
+    return !HEAP_XMAX_IS_LOCKED_ONLY(tuple->t_infomask) && TransactionIdIsCurrentTransactionId(HeapTupleHeaderGetUpdateXid(tuple));
+}
+
 /*
  * Upload batches of vectors to pinecone.
+ *
+ * Only committed, live rows are uploaded: tuples are read with a fresh snapshot, rows that aborted or have
+ * since been deleted are dropped, and rows whose fate isn't settled yet (their transaction, or ours, is
+ * still running) hold back their checkpoint for a later flush.
+ *
+ * The upload of a checkpoint overlaps with fetching the tuples of the next one from the base table:
+ * the batch of the previous checkpoint is in flight while we fill the other one, and we only wait
+ * for it (and advance the flush checkpoint past it) when the next checkpoint is ready to go.
  */
 void FlushToPinecone(Relation index)
 {
-    Buffer buf, buffer_meta_buf;
-    Page page, buffer_meta_page;
+    Buffer buf;
+    Page page;
     BlockNumber currentblkno = PINECONE_BUFFER_HEAD_BLKNO;
-    cJSON* json_vectors = cJSON_CreateArray();
+    PineconeUpsertBatch batches[2];
+    PineconeUpsertBatch* batch = &batches[0];
+    PineconeUpsertJob* job = NULL; // the upload in flight, if any
+    char** job_bodies = NULL;
+    PineconeCheckpoint job_checkpoint = {0}; // where the flush checkpoint goes once the upload in flight has landed
+    ItemPointerData job_representative_tid; // the first row of the upload in flight
+    bool job_pending = false;
     bool success;
 
-    // take a snapshot of the buffer meta
-    // we don't need to worry about another transaction advancing the pinecone tail because we have the pinecone insertion lock
     PineconeStaticMetaPageData static_meta = PineconeSnapshotStaticMeta(index);
-    PineconeBufferMetaPageData buffer_meta = PineconeSnapshotBufferMeta(index);
-
+    PineconeBufferMetaPageData buffer_meta;
 
     // index info
     IndexInfo *indexInfo = BuildIndexInfo(index);
@@ -225,14 +568,23 @@ void FlushToPinecone(Relation index)
     // get the base table
     Oid baseTableOid = index->rd_index->indrelid;
     Relation baseTableRel = RelationIdGetRelation(baseTableOid);
-    Snapshot snapshot = GetActiveSnapshot();
+    // not the active snapshot, which may be old and sees our own uncommitted rows as committed
+    Snapshot snapshot = RegisterSnapshot(GetLatestSnapshot());
     // begin the index fetch (this the preferred way for an index to request tuples from its base table)
     IndexFetchTableData *fetchData = baseTableRel->rd_tableam->index_fetch_begin(baseTableRel);
     TupleTableSlot *slot = MakeSingleTupleTableSlot(baseTableRel->rd_att, &TTSOpsBufferHeapTuple);
     bool call_again = false;
     bool all_dead = false;
     bool found = false;
-    char* vector_id = NULL; // todo: free
+    SnapshotData dirty_snapshot;
+    bool unsettled = false;
+    // the tids since the last checkpoint, fetched from the base table in block order when we reach the next one
+    int segment_tids_capacity = PINECONE_PACKED_TIDS_PER_PAGE;
+    ItemPointer segment_tids;
+    int n_segment_tids = 0;
+    int n_segment_skipped = 0; // the segment's aborted and dead rows, which are left out of the batch
+    ItemPointerData segment_representative_tid; // the first row of the segment that goes into the batch
+    PineconeHeapPrefetch prefetch;
 
     // acquire the pinecone insertion lock
     LOCKTAG pinecone_flush_lock;
@@ -242,9 +594,22 @@ void FlushToPinecone(Relation index)
         ereport(NOTICE, (errcode(ERRCODE_LOCK_NOT_AVAILABLE),
                         errmsg("Pinecone insertion lock not available"),
                         errhint("The pinecone insertion lock is currently held by another transaction. This is likely because the buffer is being advanced by another transaction. This is not an error, but it may cause a delay in the insertion of new vectors.")));
+        ExecDropSingleTupleTableSlot(slot);
+        baseTableRel->rd_tableam->index_fetch_end(fetchData);
+        UnregisterSnapshot(snapshot);
+        RelationClose(baseTableRel);
         return;
     }
 
+    // take a snapshot of the buffer meta
+    // only now that we have the pinecone insertion lock, so that no other flush can advance the pinecone tail past it
+    buffer_meta = PineconeSnapshotBufferMeta(index);
+
+    pinecone_upsert_batch_init(&batches[0], pinecone_vectors_per_request);
+    pinecone_upsert_batch_init(&batches[1], pinecone_vectors_per_request);
+    segment_tids = palloc(sizeof(ItemPointerData) * segment_tids_capacity);
+    ItemPointerSetInvalid(&segment_representative_tid);
+    ItemPointerSetInvalid(&job_representative_tid);
 
     // get the first page
     buf = ReadBuffer(index, buffer_meta.flush_checkpoint.blkno);
@@ -258,37 +623,18 @@ void FlushToPinecone(Relation index)
     // iterate through the pages
     while (true)
     {
-        // Add all tuples on the page.
-        for (int i = 1; i <= PageGetMaxOffsetNumber(page); i++)
-        {
-            cJSON* json_vector;
-            ItemId itemid = PageGetItemId(page, i);
-            Item item = PageGetItem(page, itemid);
-            PineconeBufferTuple buffer_tup = *((PineconeBufferTuple*) item);
-            if (!ItemIdIsUsed(itemid)) ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR),
-                                                      errmsg("Item is not used")));
-            if (item == NULL) ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR),
-                                              errmsg("Item is null")));
-
-            // log the tid of the index tuple
-            elog(DEBUG1, "Flushing tuple with tid %d:%d", ItemPointerGetBlockNumber(&buffer_tup.tid), ItemPointerGetOffsetNumber(&buffer_tup.tid));
-
-            // fetch the tuple from the base table
-            found = baseTableRel->rd_tableam->index_fetch_tuple(fetchData, &buffer_tup.tid, snapshot, slot, &call_again, &all_dead);
-
-            // print the tuple
-            if (!found) {
-                ereport(WARNING, (errcode(ERRCODE_INTERNAL_ERROR),
-                                errmsg("Tuple not found in heap")));
-            } else {
-                // extract the indexed columns
-                FormIndexDatum(indexInfo, slot, NULL, index_values, index_isnull);
-
-                vector_id = pinecone_id_from_heap_tid(buffer_tup.tid);
-                json_vector = tuple_get_pinecone_vector(index->rd_att, index_values, index_isnull, vector_id);
-                cJSON_AddItemToArray(json_vectors, json_vector);
-            }
+        // Collect the tids on the page; they are fetched once we have the whole segment up to the next checkpoint.
+        int n_tids;
+        ItemPointer tids = PineconePageGetTids(page, &n_tids);
+        if (n_segment_tids + n_tids > segment_tids_capacity) {
+            segment_tids_capacity = Max(segment_tids_capacity * 2, n_segment_tids + n_tids);
+            segment_tids = repalloc(segment_tids, sizeof(ItemPointerData) * segment_tids_capacity);
         }
+        memcpy(&segment_tids[n_segment_tids], tids, sizeof(ItemPointerData) * n_tids);
+        n_segment_tids += n_tids;
+
+        // keep the upload in flight moving
+        if (job != NULL) pinecone_bulk_upsert_poll(job);
 
         // Move to the next page. Stop if there are no more pages.
         // todo: isn't this linked list unnecessary? Couldn't I just use nextblkno++ and check if it's valid?
@@ -303,40 +649,133 @@ void FlushToPinecone(Relation index)
 
         // If we have reached a checkpoint, push them to the remote index and update the pinecone checkpoint with a representative vector heap tid
         if (PineconePageGetOpaque(page)->checkpoint.is_checkpoint) {
-            GenericXLogState *state = GenericXLogStart(index); // start a new WAL record
- 
-            // flush the vectors to pinecone if there are any
-            if (cJSON_GetArraySize(json_vectors) == 0) {
+            PineconeCheckpoint checkpoint = PineconePageGetOpaque(page)->checkpoint;
+
+            // don't hold the page lock while we read the heap and wait on pinecone
+            LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+
+            // fetch the segment's tuples from the base table in block order
+            pinecone_sort_tids(segment_tids, n_segment_tids);
+            pinecone_heap_prefetch_init(&prefetch, baseTableRel, segment_tids, n_segment_tids);
+            for (int i = 0; i < n_segment_tids; i++)
+            {
+                ItemPointerData heap_tid = segment_tids[i];
+                // log the tid of the index tuple
+                elog(DEBUG1, "Flushing tuple with tid %d:%d", ItemPointerGetBlockNumber(&heap_tid), ItemPointerGetOffsetNumber(&heap_tid));
+
+                // fetch the tuple from the base table
+                pinecone_heap_prefetch(&prefetch, i);
+                call_again = false;
+                found = baseTableRel->rd_tableam->index_fetch_tuple(fetchData, &heap_tid, snapshot, slot, &call_again, &all_dead);
+
+                if (found && pinecone_tuple_is_ours(slot, false)) {
+                    // we inserted it and may yet abort
+                    elog(DEBUG1, "Tuple %d:%d is ours and not committed yet, stopping the flush", ItemPointerGetBlockNumber(&heap_tid), ItemPointerGetOffsetNumber(&heap_tid));
+                    unsettled = true;
+                    break;
+                } else if (!found) {
+                    // the row may have been inserted by a transaction that is still running; leave its checkpoint
+                    // for the next flush rather than dropping the row
+                    InitDirtySnapshot(dirty_snapshot);
+                    call_again = false;
+                    if (baseTableRel->rd_tableam->index_fetch_tuple(fetchData, &heap_tid, &dirty_snapshot, slot, &call_again, &all_dead)) {
+                        elog(DEBUG1, "Tuple %d:%d is not visible yet, stopping the flush", ItemPointerGetBlockNumber(&heap_tid), ItemPointerGetOffsetNumber(&heap_tid));
+                        unsettled = true;
+                        break;
+                    }
+                    // or deleted by us, and we may yet abort
+                    call_again = false;
+                    if (baseTableRel->rd_tableam->index_fetch_tuple(fetchData, &heap_tid, SnapshotAny, slot, &call_again, &all_dead) &&
+                        pinecone_tuple_is_ours(slot, true)) {
+                        elog(DEBUG1, "Tuple %d:%d is being deleted by us, stopping the flush", ItemPointerGetBlockNumber(&heap_tid), ItemPointerGetOffsetNumber(&heap_tid));
+                        unsettled = true;
+                        break;
+                    }
+                    // otherwise its transaction aborted or it is dead; it doesn't belong in pinecone
+                    elog(DEBUG1, "Skipping tuple %d:%d, which is aborted or dead", ItemPointerGetBlockNumber(&heap_tid), ItemPointerGetOffsetNumber(&heap_tid));
+                    n_segment_skipped++;
+                } else {
+                    // extract the indexed columns
+                    FormIndexDatum(indexInfo, slot, NULL, index_values, index_isnull);
+
+                    pinecone_upsert_batch_add(batch, index->rd_att, index_values, index_isnull, heap_tid);
+                    // the checkpoint's own tid may be a row that was rolled back, which pinecone would never have
+                    if (!ItemPointerIsValid(&segment_representative_tid)) segment_representative_tid = heap_tid;
+                }
+
+                // keep the upload in flight moving
+                if (job != NULL && i % PINECONE_PACKED_TIDS_PER_PAGE == 0) pinecone_bulk_upsert_poll(job);
+            }
+            n_segment_tids = 0;
+            if (unsettled) {
+                LockBuffer(buf, BUFFER_LOCK_SHARE); // released below
+                break;
+            }
+
+            // the previous checkpoint has to land before the flush checkpoint can move past it
+            if (job_pending) {
+                bool landed = true;
+                if (job != NULL) {
+                    landed = pinecone_bulk_upsert_finish(job);
+                    pfree(job_bodies);
+                    job = NULL;
+                }
+                job_pending = false;
+                if (!landed) {
+                    // leave the flush checkpoint where it is; the next flush sends the segment again
+                    LockBuffer(buf, BUFFER_LOCK_SHARE); // released below
+                    break;
+                }
+                pinecone_advance_flush_checkpoint(index, job_checkpoint, job_representative_tid);
+                pinecone_upsert_batch_reset(batch == &batches[0] ? &batches[1] : &batches[0]);
+            }
+
+            // start uploading this checkpoint's vectors and fill the other batch in the meantime
+            // (a segment whose rows were all rolled back or deleted has nothing to upload)
+            if (batch->n_vectors == 0 && n_segment_skipped > 0) {
+                elog(DEBUG1, "All %d tuples of the batch are aborted or dead, nothing to flush", n_segment_skipped);
+            } else if (batch->n_vectors == 0) {
                 ereport(WARNING, (errcode(ERRCODE_INTERNAL_ERROR),
                                 errmsg("No vectors to flush to pinecone")));
             } else {
-                pinecone_bulk_upsert(pinecone_api_key, static_meta.host, json_vectors, pinecone_vectors_per_request);
+                job_bodies = pinecone_upsert_batch_bodies(batch);
+                job = pinecone_bulk_upsert_start(pinecone_api_key, static_meta.host, job_bodies, batch->n_requests, true);
             }
-
-            // lock the buffer meta page
-            buffer_meta_buf = ReadBuffer(index, PINECONE_BUFFER_METAPAGE_BLKNO);
-            LockBuffer(buffer_meta_buf, BUFFER_LOCK_EXCLUSIVE);
-            buffer_meta_page = GenericXLogRegisterBuffer(state, buffer_meta_buf, 0);
-
-            // update the buffer meta page
-            PineconePageGetBufferMeta(buffer_meta_page)->flush_checkpoint = PineconePageGetOpaque(page)->checkpoint;
-
-            // save and release
-            GenericXLogFinish(state);
-            UnlockReleaseBuffer(buffer_meta_buf);
-
-            // free
-            cJSON_Delete(json_vectors); json_vectors = cJSON_CreateArray();
+            job_checkpoint = checkpoint;
+            job_representative_tid = segment_representative_tid;
+            job_pending = true;
+            n_segment_skipped = 0;
+            ItemPointerSetInvalid(&segment_representative_tid);
+            batch = (batch == &batches[0]) ? &batches[1] : &batches[0];
 
             // stop if we don't expect to have another batch because we have reached the last checkpoint
-            if (buffer_meta.latest_checkpoint.blkno == currentblkno) break;
+            if (buffer_meta.latest_checkpoint.blkno == currentblkno) {
+                LockBuffer(buf, BUFFER_LOCK_SHARE); // released below
+                break;
+            }
+            LockBuffer(buf, BUFFER_LOCK_SHARE);
+            page = BufferGetPage(buf);
         }
     }
     UnlockReleaseBuffer(buf); // release the last buffer
 
+    // wait for the last upload
+    if (job_pending) {
+        bool landed = true;
+        if (job != NULL) {
+            landed = pinecone_bulk_upsert_finish(job);
+            pfree(job_bodies);
+        }
+        if (landed) pinecone_advance_flush_checkpoint(index, job_checkpoint, job_representative_tid);
+    }
+    pinecone_upsert_batch_reset(&batches[0]);
+    pinecone_upsert_batch_reset(&batches[1]);
+    pfree(segment_tids);
+
     // end the index fetch
     ExecDropSingleTupleTableSlot(slot);
     baseTableRel->rd_tableam->index_fetch_end(fetchData);
+    UnregisterSnapshot(snapshot);
     // close the base table
     RelationClose(baseTableRel);
 
@@ -0,0 +1,376 @@
+#include "pinecone.h"
+
+#include "catalog/pg_type_d.h"
+#include "common/shortest_dec.h"
+#include "lib/stringinfo.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/json.h"
+#include "utils/lsyscache.h"
+
+#include <ctype.h>
+#include <math.h>
+
+/*
+ * Direct JSON encoding of request bodies (and decoding of query responses, below).
+ *
+ * Upsert and query bodies are written straight into one growable buffer per
+ * request instead of building a cJSON node per float and pretty-printing the
+ * tree. Floats use the shortest representation that round-trips.
+ */
+
+static void append_json_float_array(StringInfo buf, const float *x, int dim) {
+    // reserve room for the longest possible number and a comma per element so we can write in place
+    enlargeStringInfo(buf, dim * (FLOAT_SHORTEST_DECIMAL_LEN + 1) + 2);
+    buf->data[buf->len++] = '[';
+    for (int i = 0; i < dim; i++) {
+        if (i > 0) buf->data[buf->len++] = ',';
+        buf->len += float_to_shortest_decimal_bufn(x[i], buf->data + buf->len);
+    }
+    buf->data[buf->len++] = ']';
+    buf->data[buf->len] = '\0';
+}
+
+static void append_json_double(StringInfo buf, double value) {
+    char num[DOUBLE_SHORTEST_DECIMAL_LEN];
+    if (isnan(value) || isinf(value)) {
+        // not representable in json
+        appendStringInfoString(buf, "null");
+        return;
+    }
+    appendBinaryStringInfo(buf, num, double_to_shortest_decimal_bufn(value, num));
+}
+
+static void append_json_text_array(StringInfo buf, Datum value) {
+    ArrayType *array = DatumGetArrayTypeP(value);
+    Datum* elems;
+    bool* nulls;
+    int nelems;
+    int16 elmlen;
+    bool elmbyval;
+    char elmalign;
+    bool first = true;
+    Oid elmtype = ARR_ELEMTYPE(array);
+
+    get_typlenbyvalalign(elmtype, &elmlen, &elmbyval, &elmalign);
+    deconstruct_array(array, elmtype, elmlen, elmbyval, elmalign, &elems, &nulls, &nelems);
+
+    appendStringInfoChar(buf, '[');
+    for (int j = 0; j < nelems; j++) {
+        if (nulls[j]) continue;
+        if (!first) appendStringInfoChar(buf, ',');
+        escape_json(buf, TextDatumGetCString(elems[j]));
+        first = false;
+    }
+    appendStringInfoChar(buf, ']');
+}
+
+/*
+ * Append {"id": ..., "values": [...], "metadata": {...}} for one tuple of the index.
+ * The first column is the vector, the remaining columns are sent as metadata.
+ */
+void pinecone_append_vector_json(StringInfo buf, TupleDesc tup_desc, Datum *values, bool *isnull, ItemPointerData heap_tid) {
+    Vector *vector = DatumGetVector(values[0]);
+    bool first = true;
+    validate_vector_nonzero(vector);
+
+    appendStringInfo(buf, "{\"id\":\"%04hx%04hx%04hx\",\"values\":", heap_tid.ip_blkid.bi_hi, heap_tid.ip_blkid.bi_lo, heap_tid.ip_posid);
+    append_json_float_array(buf, vector->x, vector->dim);
+    appendStringInfoString(buf, ",\"metadata\":{");
+    for (int i = 1; i < tup_desc->natts; i++) // skip the first column which is the vector
+    {
+        FormData_pg_attribute* td = TupleDescAttr(tup_desc, i);
+        if (isnull[i]) continue; // pinecone has no null metadata values, leave the key out
+        if (!first) appendStringInfoChar(buf, ',');
+        first = false;
+        escape_json(buf, NameStr(td->attname));
+        appendStringInfoChar(buf, ':');
+        switch (td->atttypid) {
+            case BOOLOID:
+                appendStringInfoString(buf, DatumGetBool(values[i]) ? "true" : "false");
+                break;
+            case FLOAT8OID:
+                append_json_double(buf, DatumGetFloat8(values[i]));
+                break;
+            case INT4OID:
+                appendStringInfo(buf, "%d", DatumGetInt32(values[i]));
+                break;
+            case TEXTOID:
+                escape_json(buf, TextDatumGetCString(values[i]));
+                break;
+            case TEXTARRAYOID:
+                append_json_text_array(buf, values[i]);
+                break;
+            default:
+                ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                                errmsg("Invalid column type when decoding tuple."),
+                                errhint("Pinecone index only supports boolean, float8, text, and textarray columns")));
+        }
+    }
+    appendStringInfoString(buf, "}}");
+}
+
+/*
+ * Upsert batches: vectors are split into request bodies of at most vectors_per_request vectors as they are added
+ */
+void pinecone_upsert_batch_init(PineconeUpsertBatch *batch, int vectors_per_request) {
+    batch->vectors_per_request = vectors_per_request;
+    batch->n_vectors = 0;
+    batch->n_requests = 0;
+    batch->n_in_request = 0;
+    batch->requests_capacity = 0;
+    batch->requests = NULL;
+}
+
+void pinecone_upsert_batch_add(PineconeUpsertBatch *batch, TupleDesc tup_desc, Datum *values, bool *isnull, ItemPointerData heap_tid) {
+    StringInfo body;
+    if (batch->n_requests == 0 || batch->n_in_request == batch->vectors_per_request) {
+        // start a new request
+        if (batch->n_requests == batch->requests_capacity) {
+            batch->requests_capacity = Max(8, batch->requests_capacity * 2);
+            batch->requests = (batch->requests == NULL) ? palloc(sizeof(StringInfoData) * batch->requests_capacity)
+                                                        : repalloc(batch->requests, sizeof(StringInfoData) * batch->requests_capacity);
+        }
+        body = &batch->requests[batch->n_requests++];
+        batch->n_in_request = 0;
+        initStringInfo(body);
+        appendStringInfoString(body, "{\"vectors\":[");
+    } else {
+        body = &batch->requests[batch->n_requests - 1];
+        appendStringInfoChar(body, ',');
+    }
+    pinecone_append_vector_json(body, tup_desc, values, isnull, heap_tid);
+    batch->n_vectors++;
+    if (++batch->n_in_request == batch->vectors_per_request) {
+        appendStringInfoString(body, "]}");
+    }
+}
+
+/*
+ * Close the last request and return the request bodies
+ */
+char** pinecone_upsert_batch_bodies(PineconeUpsertBatch *batch) {
+    char** bodies = palloc(sizeof(char*) * Max(batch->n_requests, 1));
+    if (batch->n_requests > 0 && batch->n_in_request < batch->vectors_per_request) {
+        appendStringInfoString(&batch->requests[batch->n_requests - 1], "]}");
+        batch->n_in_request = batch->vectors_per_request; // the next vector starts a new request
+    }
+    for (int i = 0; i < batch->n_requests; i++) bodies[i] = batch->requests[i].data;
+    return bodies;
+}
+
+void pinecone_upsert_batch_reset(PineconeUpsertBatch *batch) {
+    for (int i = 0; i < batch->n_requests; i++) pfree(batch->requests[i].data);
+    if (batch->requests != NULL) pfree(batch->requests);
+    pinecone_upsert_batch_init(batch, batch->vectors_per_request);
+}
+
+/*
+ * Body of a /query request
+ */
+char* pinecone_query_body(Vector *vector, int top_k, cJSON *filter) {
+    StringInfoData body;
+    char* filter_str = cJSON_PrintUnformatted(filter);
+    initStringInfo(&body);
+    appendStringInfo(&body, "{\"topK\":%d,\"vector\":", top_k);
+    append_json_float_array(&body, vector->x, vector->dim);
+    appendStringInfo(&body, ",\"filter\":%s,\"includeValues\":false,\"includeMetadata\":false}", filter_str);
+    free(filter_str);
+    return body.data;
+}
+
+/*
+ * Streaming parser for /query responses.
+ *
+ * The response is decoded chunk by chunk as it arrives in write_callback, and only the id and
+ * score of each match are kept. Everything else (values, metadata, namespace, usage) is skipped
+ * without being materialized. A top-level "message" is kept so that error responses can be reported.
+ */
+#define PINECONE_FIELD_OTHER 0
+#define PINECONE_FIELD_MATCHES 1
+#define PINECONE_FIELD_MESSAGE 2
+#define PINECONE_FIELD_ID 3
+#define PINECONE_FIELD_SCORE 4
+
+#define PINECONE_TOKEN_NONE 0
+#define PINECONE_TOKEN_STRING 1
+#define PINECONE_TOKEN_STRING_ESCAPE 2
+#define PINECONE_TOKEN_NUMBER 3
+#define PINECONE_TOKEN_LITERAL 4
+
+void pinecone_match_parser_init(PineconeMatchParser *parser) {
+    memset(parser, 0, sizeof(PineconeMatchParser));
+    parser->capacity = Max(pinecone_top_k, 1);
+    parser->matches = palloc(sizeof(PineconeMatch) * parser->capacity);
+}
+
+static inline int hex_digit_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Decode the 12 character hex id written by pinecone_id_from_heap_tid
+ */
+static bool decode_pinecone_id(const char *id, int len, ItemPointerData *tid) {
+    uint16 parts[3] = {0, 0, 0};
+    if (len != 12) return false;
+    for (int i = 0; i < 12; i++) {
+        int v = hex_digit_value(id[i]);
+        if (v < 0) return false;
+        parts[i / 4] = (parts[i / 4] << 4) | v;
+    }
+    tid->ip_blkid.bi_hi = parts[0];
+    tid->ip_blkid.bi_lo = parts[1];
+    tid->ip_posid = parts[2];
+    return true;
+}
+
+static void match_parser_append_token(PineconeMatchParser *parser, char c) {
+    // we only care about short strings and numbers, so longer tokens are truncated
+    if (parser->token_len < PINECONE_PARSER_TOKEN_LENGTH - 1) parser->token[parser->token_len++] = c;
+}
+
+static void match_parser_emit_match(PineconeMatchParser *parser) {
+    if (!parser->have_id || !parser->have_score) return;
+    if (parser->n_matches == parser->capacity) {
+        parser->capacity *= 2;
+        parser->matches = repalloc(parser->matches, sizeof(PineconeMatch) * parser->capacity);
+    }
+    parser->matches[parser->n_matches].tid = parser->current.tid;
+    parser->matches[parser->n_matches].score = parser->current.score;
+    parser->n_matches++;
+}
+
+// a string, number or literal has been read completely
+static void match_parser_end_scalar(PineconeMatchParser *parser, bool is_string) {
+    parser->token[parser->token_len] = '\0';
+    if (is_string && parser->expect_key) {
+        // this is a key, decide which field the value is for
+        parser->field = PINECONE_FIELD_OTHER;
+        if (parser->depth == 1) {
+            if (strcmp(parser->token, "matches") == 0) parser->field = PINECONE_FIELD_MATCHES;
+            else if (strcmp(parser->token, "message") == 0) parser->field = PINECONE_FIELD_MESSAGE;
+        } else if (parser->depth == 3 && parser->in_matches) {
+            if (strcmp(parser->token, "id") == 0) parser->field = PINECONE_FIELD_ID;
+            else if (strcmp(parser->token, "score") == 0) parser->field = PINECONE_FIELD_SCORE;
+        }
+        parser->expect_key = false;
+    } else {
+        switch (parser->field) {
+            case PINECONE_FIELD_ID:
+                parser->have_id = is_string && decode_pinecone_id(parser->token, parser->token_len, &parser->current.tid);
+                if (!parser->have_id) elog(WARNING, "Ignoring pinecone match with invalid id %s", parser->token);
+                break;
+            case PINECONE_FIELD_SCORE:
+                if (!is_string) {
+                    parser->current.score = strtof(parser->token, NULL);
+                    parser->have_score = true;
+                }
+                break;
+            case PINECONE_FIELD_MESSAGE:
+                if (is_string) strlcpy(parser->message, parser->token, sizeof(parser->message));
+                break;
+        }
+        parser->field = PINECONE_FIELD_OTHER;
+    }
+    parser->token_state = PINECONE_TOKEN_NONE;
+    parser->token_len = 0;
+}
+
+void pinecone_match_parser_feed(PineconeMatchParser *parser, const char *data, size_t len) {
+    for (size_t i = 0; i < len && !parser->failed; i++) {
+        char c = data[i];
+        switch (parser->token_state) {
+            case PINECONE_TOKEN_STRING:
+                if (c == '"') match_parser_end_scalar(parser, true);
+                else if (c == '\\') parser->token_state = PINECONE_TOKEN_STRING_ESCAPE;
+                else match_parser_append_token(parser, c);
+                continue;
+            case PINECONE_TOKEN_STRING_ESCAPE:
+                // none of the strings we keep contain escapes; keep the escaped character as is
+                match_parser_append_token(parser, c);
+                parser->token_state = PINECONE_TOKEN_STRING;
+                continue;
+            case PINECONE_TOKEN_NUMBER:
+            case PINECONE_TOKEN_LITERAL:
+                if (isalnum((unsigned char) c) || c == '-' || c == '+' || c == '.') {
+                    match_parser_append_token(parser, c);
+                    continue;
+                }
+                match_parser_end_scalar(parser, false);
+                break; // c still has to be handled
+        }
+
+        switch (c) {
+            case ' ': case '\t': case '\n': case '\r': case ':':
+                break;
+            case '"':
+                parser->token_state = PINECONE_TOKEN_STRING;
+                break;
+            case '{':
+            case '[':
+                if (parser->depth == PINECONE_PARSER_MAX_DEPTH) {
+                    parser->failed = true;
+                    break;
+                }
+                if (c == '[' && parser->depth == 1 && parser->field == PINECONE_FIELD_MATCHES) {
+                    parser->in_matches = true;
+                    parser->found_matches = true;
+                }
+                if (c == '{' && parser->depth == 2 && parser->in_matches) {
+                    // start of a match
+                    parser->have_id = false;
+                    parser->have_score = false;
+                }
+                parser->containers[parser->depth++] = c;
+                parser->expect_key = (c == '{');
+                parser->field = PINECONE_FIELD_OTHER;
+                break;
+            case '}':
+            case ']':
+                if (parser->depth == 0 || parser->containers[parser->depth - 1] != (c == '}' ? '{' : '[')) {
+                    parser->failed = true;
+                    break;
+                }
+                parser->depth--;
+                if (c == '}' && parser->depth == 2 && parser->in_matches) match_parser_emit_match(parser);
+                if (c == ']' && parser->depth == 1) parser->in_matches = false;
+                parser->expect_key = false;
+                parser->field = PINECONE_FIELD_OTHER;
+                break;
+            case ',':
+                parser->expect_key = (parser->depth > 0 && parser->containers[parser->depth - 1] == '{');
+                parser->field = PINECONE_FIELD_OTHER;
+                break;
+            default:
+                if (isdigit((unsigned char) c) || c == '-') parser->token_state = PINECONE_TOKEN_NUMBER;
+                else if (isalpha((unsigned char) c)) parser->token_state = PINECONE_TOKEN_LITERAL;
+                else {
+                    parser->failed = true;
+                    break;
+                }
+                match_parser_append_token(parser, c);
+        }
+    }
+}
+
+/*
+ * Raise an error unless the response was complete, valid json with a matches array
+ */
+void pinecone_match_parser_finish(PineconeMatchParser *parser) {
+    // a response that was cut off ends inside a container or a string
+    if (parser->depth != 0 || parser->token_state != PINECONE_TOKEN_NONE) parser->failed = true;
+    if (parser->failed) {
+        ereport(ERROR, (errcode(ERRCODE_CONNECTION_FAILURE),
+                        errmsg("Pinecone query failed"),
+                        errdetail("The response was cut off or is not valid json.")));
+    }
+    if (!parser->found_matches) {
+        ereport(ERROR, (errcode(ERRCODE_CONNECTION_FAILURE),
+                        errmsg("Pinecone query failed"),
+                        errdetail("%s", parser->message[0] != '\0' ? parser->message : "The response did not contain any matches.")));
+    }
+}
@@ -0,0 +1,316 @@
+#include "pinecone_api.h"
+#include "pinecone.h"
+
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/rel.h"
+#include "utils/timestamp.h"
+
+/*
+ * Liveness cache
+ *
+ * A query scans the part of the buffer that pinecone hasn't finished indexing yet, which starts at the ready
+ * checkpoint. Learning that a newer checkpoint is ready takes a /vectors/fetch of the checkpoints' vectors.
+ * Rather than have every query send one alongside its top-k query, the newest checkpoint known to be ready
+ * and when that was observed are kept in shared memory for each index. A query that finds an observation
+ * younger than pinecone.liveness_max_age uses it and doesn't fetch; otherwise it fetches and publishes what
+ * it found for the next queries. Queries never write what they learn to the buffer meta, so they don't contend
+ * with inserts for it and run on hot standbys, which keep their own cache.
+ *
+ * The background flusher (pinecone.background_flush) polls every index before its entry goes stale: it refreshes
+ * the entry and brings the buffer meta's ready checkpoint up to it. Foreground flushes never fetch, since an insert
+ * or a commit shouldn't wait for that; they only carry the cached ready checkpoint into the buffer meta along with
+ * the flush checkpoint. That durable copy is where the cache starts after a restart, and what replicas start from.
+ *
+ * A fetch also tells how long pinecone takes to index what we upsert: a checkpoint found ready was indexed within
+ * the time since it was flushed (the buffer meta keeps the flush times of the latest checkpoints), and one that
+ * isn't took longer than that. Each entry keeps a moving estimate of that lag, and once it has a few samples a
+ * checkpoint flushed longer than pinecone.presume_ready_factor times the lag ago is presumed ready without a
+ * fetch. This keeps the part of the buffer each query scans small when fetches are rare or pinecone's indexing
+ * falls behind. Presumed checkpoints are only used for the query at hand, never published or persisted.
+ *
+ * Entries are keyed by the index's relfilenode, since a rebuild starts the buffer over with new checkpoints.
+ * When the table is full the entry observed longest ago is replaced. Queries look entries up under a shared
+ * LWLock, so they don't serialize on each other. Without vector in shared_preload_libraries each backend keeps
+ * a table of its own, which needs no lock.
+ */
+
+#define PINECONE_LIVENESS_ENTRIES 256
+
+#if PG_VERSION_NUM >= 160000
+#define PineconeRelFileNumber(rel) ((rel)->rd_locator.relNumber)
+#else
+#define PineconeRelFileNumber(rel) ((rel)->rd_node.relNode)
+#endif
+
+typedef struct PineconeLivenessEntry
+{
+    Oid dboid; // InvalidOid if the entry is free
+    Oid relfilenumber;
+    PineconeCheckpoint ready_checkpoint;
+    TimestampTz observed_at;
+    double indexing_lag_ms; // moving estimate
+    int n_lag_samples;
+} PineconeLivenessEntry;
+
+typedef struct PineconeLivenessShmemData
+{
+    PineconeLivenessEntry entries[PINECONE_LIVENESS_ENTRIES];
+} PineconeLivenessShmemData;
+
+int pinecone_liveness_max_age = 1000;
+double pinecone_presume_ready_factor = 2;
+static PineconeLivenessShmemData* liveness_shmem = NULL;
+static LWLock* liveness_lock = NULL; // protects liveness_shmem
+static PineconeLivenessShmemData local_liveness; // when vector isn't preloaded
+static bool local_liveness_initialized = false;
+
+Size pinecone_liveness_shmem_size(void) {
+    return MAXALIGN(sizeof(PineconeLivenessShmemData));
+}
+
+// called from the shmem request hook (or _PG_init before PG15)
+void pinecone_liveness_shmem_request(void) {
+    RequestAddinShmemSpace(pinecone_liveness_shmem_size());
+    RequestNamedLWLockTranche("pinecone liveness cache", 1);
+}
+
+// called from the shmem startup hook with AddinShmemInitLock held
+void pinecone_liveness_shmem_init(void) {
+    bool found;
+    liveness_shmem = ShmemInitStruct("pinecone liveness cache", pinecone_liveness_shmem_size(), &found);
+    liveness_lock = &(GetNamedLWLockTranche("pinecone liveness cache"))->lock;
+    if (!found) {
+        for (int i = 0; i < PINECONE_LIVENESS_ENTRIES; i++) liveness_shmem->entries[i].dboid = InvalidOid;
+    }
+}
+
+static PineconeLivenessShmemData* pinecone_liveness_table(void) {
+    if (liveness_shmem != NULL) return liveness_shmem;
+    if (!local_liveness_initialized) {
+        for (int i = 0; i < PINECONE_LIVENESS_ENTRIES; i++) local_liveness.entries[i].dboid = InvalidOid;
+        local_liveness_initialized = true;
+    }
+    return &local_liveness;
+}
+
+static void pinecone_liveness_lock(LWLockMode mode) {
+    if (liveness_lock != NULL) LWLockAcquire(liveness_lock, mode);
+}
+
+static void pinecone_liveness_unlock(void) {
+    if (liveness_lock != NULL) LWLockRelease(liveness_lock);
+}
+
+// the caller holds the table's lock
+static PineconeLivenessEntry* pinecone_liveness_find(PineconeLivenessShmemData* table, Relation index) {
+    for (int i = 0; i < PINECONE_LIVENESS_ENTRIES; i++) {
+        PineconeLivenessEntry* entry = &table->entries[i];
+        if (entry->dboid == MyDatabaseId && entry->relfilenumber == PineconeRelFileNumber(index)) return entry;
+    }
+    return NULL;
+}
+
+static bool pinecone_liveness_lookup_within(Relation index, PineconeCheckpoint* ready_checkpoint, int max_age) {
+    PineconeLivenessShmemData* table = pinecone_liveness_table();
+    PineconeLivenessEntry* entry;
+    PineconeCheckpoint cached;
+    TimestampTz observed_at = 0;
+    bool found = false;
+
+    pinecone_liveness_lock(LW_SHARED);
+    entry = pinecone_liveness_find(table, index);
+    if (entry != NULL) {
+        cached = entry->ready_checkpoint;
+        observed_at = entry->observed_at;
+        found = true;
+    }
+    pinecone_liveness_unlock();
+
+    if (!found) return false;
+    if (cached.checkpoint_no > ready_checkpoint->checkpoint_no) *ready_checkpoint = cached;
+    return max_age > 0 && !TimestampDifferenceExceeds(observed_at, GetCurrentTimestamp(), max_age);
+}
+
+/*
+ * Advance ready_checkpoint (the buffer meta's) to the cached one if that is newer.
+ * Returns true if the cached observation is younger than pinecone.liveness_max_age, in which case there is no need to fetch.
+ */
+bool pinecone_liveness_lookup(Relation index, PineconeCheckpoint* ready_checkpoint) {
+    return pinecone_liveness_lookup_within(index, ready_checkpoint, pinecone_liveness_max_age);
+}
+
+/*
+ * Record that ready_checkpoint was ready at observed_at (when the fetch that found it was sent), and fold the
+ * bounds on the indexing lag that the fetch gave (-1 if none) into the estimate.
+ * Readiness only moves forward, so an older observation or checkpoint never replaces a newer one.
+ */
+static void pinecone_liveness_publish(Relation index, PineconeCheckpoint ready_checkpoint, TimestampTz observed_at,
+                                      double lag_upper_bound_ms, double lag_lower_bound_ms) {
+    PineconeLivenessShmemData* table = pinecone_liveness_table();
+    PineconeLivenessEntry* entry;
+
+    pinecone_liveness_lock(LW_EXCLUSIVE);
+    entry = pinecone_liveness_find(table, index);
+    if (entry == NULL) {
+        // take a free entry, or else the one observed longest ago
+        entry = &table->entries[0];
+        for (int i = 0; i < PINECONE_LIVENESS_ENTRIES && entry->dboid != InvalidOid; i++) {
+            PineconeLivenessEntry* candidate = &table->entries[i];
+            if (candidate->dboid == InvalidOid || candidate->observed_at < entry->observed_at) entry = candidate;
+        }
+        entry->dboid = MyDatabaseId;
+        entry->relfilenumber = PineconeRelFileNumber(index);
+        entry->ready_checkpoint = ready_checkpoint;
+        entry->observed_at = observed_at;
+        entry->indexing_lag_ms = 0;
+        entry->n_lag_samples = 0;
+    } else {
+        if (ready_checkpoint.checkpoint_no > entry->ready_checkpoint.checkpoint_no) entry->ready_checkpoint = ready_checkpoint;
+        if (observed_at > entry->observed_at) entry->observed_at = observed_at;
+    }
+    if (lag_upper_bound_ms >= 0) {
+        entry->indexing_lag_ms = (entry->n_lag_samples == 0) ? lag_upper_bound_ms : 0.8 * entry->indexing_lag_ms + 0.2 * lag_upper_bound_ms;
+        entry->n_lag_samples++;
+    }
+    // a checkpoint that still isn't ready is evidence that the lag is longer than we thought
+    if (lag_lower_bound_ms > entry->indexing_lag_ms) entry->indexing_lag_ms = lag_lower_bound_ms;
+    pinecone_liveness_unlock();
+}
+
+/*
+ * Take the result of a liveness fetch of fetched_checkpoints (sent at observed_at) into the cache.
+ * known_ready_checkpoint is the newest checkpoint known to be ready before the fetch.
+ * Returns the newest checkpoint known to be ready after it.
+ * A fetch that failed (fetch_response is NULL or has no vectors) tells nothing: the entry isn't refreshed and
+ * the lag isn't touched, so the next query or poll fetches again.
+ */
+PineconeCheckpoint pinecone_liveness_observe(Relation index, PineconeCheckpoint known_ready_checkpoint, PineconeCheckpoint* fetched_checkpoints,
+                                             cJSON* fetch_response, TimestampTz observed_at) {
+    PineconeCheckpoint best_checkpoint;
+    PineconeBufferMetaPageData buffer_meta;
+    TimestampTz now = GetCurrentTimestamp();
+    double upper_bound_ms = -1;
+    double lower_bound_ms = -1;
+
+    if (!cJSON_IsObject(cJSON_GetObjectItemCaseSensitive(fetch_response, "vectors"))) {
+        elog(DEBUG1, "liveness fetch failed, keeping checkpoint %d as the newest ready one", known_ready_checkpoint.checkpoint_no);
+        return known_ready_checkpoint;
+    }
+    best_checkpoint = get_best_fetched_checkpoint(index, fetched_checkpoints, fetch_response);
+    buffer_meta = PineconeSnapshotBufferMeta(index);
+
+    for (int i = 0; fetched_checkpoints[i].is_checkpoint; i++) {
+        // a checkpoint is looked for by a row of its segment, so it was upserted by the flush that reached the next checkpoint
+        int next_checkpoint_no = fetched_checkpoints[i].checkpoint_no + 1;
+        PineconeFlushTime* flush_time = &buffer_meta.recent_flushes[next_checkpoint_no % PINECONE_RECENT_FLUSHES];
+        if (flush_time->flushed_at == 0 || flush_time->checkpoint.checkpoint_no != next_checkpoint_no) continue;
+        // a flush that upserted nothing tells nothing about how long pinecone takes
+        if (!ItemPointerIsValid(&flush_time->representative_tid)) continue;
+        if (best_checkpoint.is_checkpoint && fetched_checkpoints[i].checkpoint_no <= best_checkpoint.checkpoint_no) {
+            // indexed by the time the response arrived
+            double bound_ms = (double) (now - flush_time->flushed_at) / 1000.0;
+            if (upper_bound_ms < 0 || bound_ms < upper_bound_ms) upper_bound_ms = bound_ms;
+        } else {
+            // not indexed yet when the fetch was sent
+            lower_bound_ms = Max(lower_bound_ms, (double) (observed_at - flush_time->flushed_at) / 1000.0);
+        }
+    }
+    if (best_checkpoint.is_checkpoint) known_ready_checkpoint = best_checkpoint;
+    pinecone_liveness_publish(index, known_ready_checkpoint, observed_at, upper_bound_ms, lower_bound_ms);
+    return known_ready_checkpoint;
+}
+
+/*
+ * Advance ready_checkpoint to the newest flushed checkpoint that is presumed ready, i.e. was flushed longer ago
+ * than pinecone.presume_ready_factor times the index's indexing lag.
+ */
+void pinecone_liveness_presume(Relation index, PineconeCheckpoint* ready_checkpoint) {
+    PineconeLivenessShmemData* table = pinecone_liveness_table();
+    PineconeLivenessEntry* entry;
+    PineconeBufferMetaPageData buffer_meta;
+    TimestampTz now;
+    double lag_ms = 0;
+    bool have_lag = false;
+
+    if (pinecone_presume_ready_factor <= 0) return;
+    pinecone_liveness_lock(LW_SHARED);
+    entry = pinecone_liveness_find(table, index);
+    if (entry != NULL && entry->n_lag_samples >= PINECONE_MIN_LAG_SAMPLES) {
+        lag_ms = entry->indexing_lag_ms;
+        have_lag = true;
+    }
+    pinecone_liveness_unlock();
+    if (!have_lag) return;
+
+    buffer_meta = PineconeSnapshotBufferMeta(index);
+    now = GetCurrentTimestamp();
+    for (int checkpoint_no = buffer_meta.flush_checkpoint.checkpoint_no;
+         checkpoint_no > ready_checkpoint->checkpoint_no && checkpoint_no > buffer_meta.flush_checkpoint.checkpoint_no - PINECONE_RECENT_FLUSHES;
+         checkpoint_no--) {
+        PineconeFlushTime* flush_time = &buffer_meta.recent_flushes[checkpoint_no % PINECONE_RECENT_FLUSHES];
+        if (flush_time->flushed_at == 0 || flush_time->checkpoint.checkpoint_no != checkpoint_no) continue;
+        if (TimestampDifferenceExceeds(flush_time->flushed_at, now, (int) (lag_ms * pinecone_presume_ready_factor))) {
+            elog(DEBUG1, "presuming checkpoint %d ready (flushed at %s, indexing lag %.0f ms)", checkpoint_no,
+                 timestamptz_to_str(flush_time->flushed_at), lag_ms);
+            *ready_checkpoint = flush_time->checkpoint;
+            return;
+        }
+    }
+}
+
+// bring the buffer meta's ready checkpoint up to the cached one
+static void pinecone_liveness_persist(Relation index) {
+    PineconeWalState wal;
+    Buffer buffer_meta_buf = ReadBuffer(index, PINECONE_BUFFER_METAPAGE_BLKNO);
+    Page buffer_meta_page;
+    PineconeBufferMetaPageData new_meta;
+    LockBuffer(buffer_meta_buf, BUFFER_LOCK_EXCLUSIVE);
+    pinecone_wal_start(&wal, index);
+    buffer_meta_page = pinecone_wal_register(&wal, buffer_meta_buf, false);
+    new_meta = *PineconePageGetBufferMeta(buffer_meta_page);
+    // only moves forward, in case a concurrent flush persisted a newer one
+    (void) pinecone_liveness_lookup_within(index, &new_meta.ready_checkpoint, 0);
+    pinecone_wal_begin_changes(&wal);
+    pinecone_apply_set_meta(buffer_meta_page, &new_meta);
+    pinecone_wal_finish(&wal, XLOG_PINECONE_SET_META, (char *) &new_meta, sizeof(new_meta));
+    UnlockReleaseBuffer(buffer_meta_buf);
+}
+
+/*
+ * Refresh the index's entry if it will go stale soon, and persist the ready checkpoint if that moved.
+ * Only called by the background flusher.
+ */
+void pinecone_liveness_poll(Relation index) {
+    PineconeBufferMetaPageData buffer_meta;
+    PineconeStaticMetaPageData static_meta;
+    PineconeCheckpoint ready_checkpoint;
+    PineconeCheckpoint* checkpoints;
+    cJSON* fetch_ids;
+    cJSON* fetch_response;
+    TimestampTz now = GetCurrentTimestamp();
+
+    buffer_meta = PineconeSnapshotBufferMeta(index);
+    ready_checkpoint = buffer_meta.ready_checkpoint;
+    // queries find the entry fresh for as long as we poll at least every half of the max age
+    if (pinecone_liveness_lookup_within(index, &ready_checkpoint, pinecone_liveness_max_age / 2)) {
+        if (ready_checkpoint.checkpoint_no > buffer_meta.ready_checkpoint.checkpoint_no) pinecone_liveness_persist(index);
+        return;
+    }
+
+    checkpoints = get_checkpoints_to_fetch(index, ready_checkpoint);
+    if (checkpoints[0].is_checkpoint) {
+        static_meta = PineconeSnapshotStaticMeta(index);
+        fetch_ids = fetch_ids_from_checkpoints(checkpoints);
+        fetch_response = pinecone_fetch_vectors(pinecone_api_key, static_meta.host, fetch_ids);
+        ready_checkpoint = pinecone_liveness_observe(index, ready_checkpoint, checkpoints, fetch_response, now);
+        cJSON_Delete(fetch_ids);
+        cJSON_Delete(fetch_response);
+    } else {
+        pinecone_liveness_publish(index, ready_checkpoint, now, -1, -1);
+    }
+    if (ready_checkpoint.checkpoint_no > buffer_meta.ready_checkpoint.checkpoint_no) pinecone_liveness_persist(index);
+    pfree(checkpoints);
+}
@@ -0,0 +1,242 @@
+#include "pinecone_api.h"
+#include "pinecone.h"
+
+#include "access/xact.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "portability/instr_time.h"
+#include "storage/latch.h"
+#include "utils/memutils.h"
+
+#include <curl/curl.h>
+#include <math.h>
+
+/*
+ * curl multi handles driven by a WaitEventSet
+ *
+ * curl tells us which sockets it wants to wait on and when its next timeout is (through the socket and
+ * timer callbacks), and we sleep on those sockets together with our latch and postmaster death. So a
+ * backend waiting on pinecone wakes up for a query cancel, statement_timeout or a dying postmaster
+ * instead of only when curl is done. The wait event set lives as long as the multi handle and follows
+ * the socket callback, rather than being built again for every wait.
+ *
+ * If an ERROR is raised while requests are in flight (e.g. the query was cancelled) the transaction
+ * callbacks below detach and free the handles that were still attached, so they don't keep running
+ * on the next call. The PineconeMulti itself belongs to the memory context it was created in.
+ */
+
+static PineconeMulti* pinecone_multis = NULL; // multis with a live curl handle
+static bool pinecone_multi_callbacks_registered = false;
+
+// wall clock time in milliseconds
+static double pinecone_multi_now_ms(void) {
+    instr_time now;
+    INSTR_TIME_SET_CURRENT(now);
+    return INSTR_TIME_GET_MILLISEC(now);
+}
+
+static uint32 pinecone_socket_events(int what) {
+    uint32 events = 0;
+    if (what & CURL_POLL_IN) events |= WL_SOCKET_READABLE;
+    if (what & CURL_POLL_OUT) events |= WL_SOCKET_WRITEABLE;
+    return events;
+}
+
+// (re)build the wait event set from our latch, postmaster death and the sockets curl waits on
+static void pinecone_multi_build_wait_set(PineconeMulti* pm) {
+    if (pm->set != NULL) FreeWaitEventSet(pm->set);
+#if PG_VERSION_NUM >= 170000
+    pm->set = CreateWaitEventSet(NULL, PINECONE_MAX_SOCKETS + 2);
+#else
+    pm->set = CreateWaitEventSet(GetMemoryChunkContext(pm), PINECONE_MAX_SOCKETS + 2);
+#endif
+    AddWaitEventToSet(pm->set, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
+    AddWaitEventToSet(pm->set, WL_EXIT_ON_PM_DEATH, PGINVALID_SOCKET, NULL, NULL);
+    for (int i = 0; i < pm->n_sockets; i++) {
+        uint32 events = pinecone_socket_events(pm->sockets[i].what);
+        pm->sockets[i].pos = (events == 0) ? -1 : AddWaitEventToSet(pm->set, events, pm->sockets[i].sock, NULL, NULL);
+    }
+}
+
+static int pinecone_socket_callback(CURL* easy, curl_socket_t sock, int what, void* userp, void* socketp) {
+    PineconeMulti* pm = (PineconeMulti*) userp;
+    PineconeSocket* ps;
+    uint32 events;
+    int i;
+    for (i = 0; i < pm->n_sockets; i++) {
+        if (pm->sockets[i].sock == sock) break;
+    }
+    if (what == CURL_POLL_REMOVE) {
+        if (i == pm->n_sockets) return 0;
+        pm->sockets[i] = pm->sockets[--pm->n_sockets];
+        // a wait event set can't drop a socket, so it is built again without it (unless the multi is going away)
+        if (pm->set != NULL) pinecone_multi_build_wait_set(pm);
+        return 0;
+    }
+    if (i == pm->n_sockets) {
+        if (pm->n_sockets == PINECONE_MAX_SOCKETS) {
+            elog(WARNING, "Too many open sockets to pinecone");
+            return -1;
+        }
+        pm->sockets[pm->n_sockets].sock = sock;
+        pm->sockets[pm->n_sockets].what = 0;
+        pm->sockets[pm->n_sockets].pos = -1;
+        pm->n_sockets++;
+    }
+    ps = &pm->sockets[i];
+    if (ps->what == what) return 0;
+    ps->what = what;
+    if (pm->set == NULL) return 0;
+    events = pinecone_socket_events(what);
+    if (ps->pos >= 0 && events != 0) {
+        ModifyWaitEvent(pm->set, ps->pos, events, NULL);
+    } else if (ps->pos >= 0) {
+        pinecone_multi_build_wait_set(pm); // curl doesn't wait on it for now
+    } else if (events != 0) {
+        ps->pos = AddWaitEventToSet(pm->set, events, sock, NULL, NULL);
+    }
+    return 0;
+}
+
+// curl gives its next timeout relative to now; keep it as a deadline
+static int pinecone_timer_callback(CURLM* multi, long timeout_ms, void* userp) {
+    PineconeMulti* pm = (PineconeMulti*) userp;
+    pm->timeout_at_ms = (timeout_ms < 0) ? -1 : pinecone_multi_now_ms() + timeout_ms;
+    return 0;
+}
+
+// free the curl multi handle; the easy handles still attached to it are freed too if discard is set
+static void pinecone_multi_cleanup(PineconeMulti* pm, bool discard) {
+    PineconeMulti** pm_ptr = &pinecone_multis;
+    if (pm->multi == NULL) return;
+    while (*pm_ptr != NULL && *pm_ptr != pm) pm_ptr = &(*pm_ptr)->next;
+    if (*pm_ptr != NULL) *pm_ptr = pm->next;
+    // first, so that the socket callback doesn't build it again while curl closes its sockets
+    if (pm->set != NULL) FreeWaitEventSet(pm->set);
+    pm->set = NULL;
+    for (int i = 0; i < pm->n_easy; i++) {
+        curl_multi_remove_handle(pm->multi, pm->easy[i]);
+        if (discard) curl_easy_cleanup(pm->easy[i]); // mid-transfer, so don't put it back in the connection cache
+    }
+    pm->n_easy = 0;
+    pm->n_sockets = 0;
+    curl_multi_cleanup(pm->multi);
+    pm->multi = NULL;
+}
+
+static void pinecone_multi_reset_callback(void* arg) {
+    pinecone_multi_cleanup((PineconeMulti*) arg, true);
+}
+
+// stop the transfers that were left behind by an error
+static void pinecone_multi_abort(SubTransactionId subid) {
+    PineconeMulti* pm = pinecone_multis;
+    while (pm != NULL) {
+        PineconeMulti* next = pm->next;
+        if (subid == InvalidSubTransactionId || pm->subid == subid) pinecone_multi_cleanup(pm, true);
+        pm = next;
+    }
+}
+
+static void pinecone_multi_xact_callback(XactEvent event, void *arg) {
+    if (event == XACT_EVENT_ABORT || event == XACT_EVENT_PARALLEL_ABORT) pinecone_multi_abort(InvalidSubTransactionId);
+}
+
+static void pinecone_multi_subxact_callback(SubXactEvent event, SubTransactionId mySubid, SubTransactionId parentSubid, void *arg) {
+    if (event == SUBXACT_EVENT_ABORT_SUB) pinecone_multi_abort(mySubid);
+}
+
+/*
+ * Create a multi handle in the current memory context
+ */
+PineconeMulti* pinecone_multi_create(void) {
+    PineconeMulti* pm = palloc0(sizeof(PineconeMulti));
+    MemoryContextCallback* reset_callback = palloc0(sizeof(MemoryContextCallback));
+    pm->multi = curl_multi_init();
+    if (pm->multi == NULL) {
+        elog(ERROR, "Failed to initialize CURL multi handle");
+    }
+    pm->timeout_at_ms = -1;
+    pm->subid = GetCurrentSubTransactionId();
+    curl_multi_setopt(pm->multi, CURLMOPT_SOCKETFUNCTION, pinecone_socket_callback);
+    curl_multi_setopt(pm->multi, CURLMOPT_SOCKETDATA, pm);
+    curl_multi_setopt(pm->multi, CURLMOPT_TIMERFUNCTION, pinecone_timer_callback);
+    curl_multi_setopt(pm->multi, CURLMOPT_TIMERDATA, pm);
+    pinecone_multi_build_wait_set(pm);
+
+    if (!pinecone_multi_callbacks_registered) {
+        RegisterXactCallback(pinecone_multi_xact_callback, NULL);
+        RegisterSubXactCallback(pinecone_multi_subxact_callback, NULL);
+        pinecone_multi_callbacks_registered = true;
+    }
+    pm->next = pinecone_multis;
+    pinecone_multis = pm;
+
+    // don't leak the curl handles if the context goes away first
+    reset_callback->func = pinecone_multi_reset_callback;
+    reset_callback->arg = pm;
+    MemoryContextRegisterResetCallback(CurrentMemoryContext, reset_callback);
+    return pm;
+}
+
+/*
+ * Free the multi handle. The caller has removed (and released) its easy handles; any that are left are detached.
+ */
+void pinecone_multi_destroy(PineconeMulti* pm) {
+    pinecone_multi_cleanup(pm, false);
+}
+
+void pinecone_multi_add(PineconeMulti* pm, CURL* hnd) {
+    if (pm->multi == NULL) elog(ERROR, "Pinecone request was aborted");
+    if (pm->n_easy == pm->easy_capacity) {
+        pm->easy_capacity = Max(4, pm->easy_capacity * 2);
+        pm->easy = (pm->easy == NULL) ? MemoryContextAlloc(GetMemoryChunkContext(pm), sizeof(CURL*) * pm->easy_capacity)
+                                      : repalloc(pm->easy, sizeof(CURL*) * pm->easy_capacity);
+    }
+    pm->easy[pm->n_easy++] = hnd;
+    curl_multi_add_handle(pm->multi, hnd);
+}
+
+void pinecone_multi_remove(PineconeMulti* pm, CURL* hnd) {
+    if (pm->multi == NULL) return;
+    for (int i = 0; i < pm->n_easy; i++) {
+        if (pm->easy[i] != hnd) continue;
+        pm->easy[i] = pm->easy[--pm->n_easy];
+        curl_multi_remove_handle(pm->multi, hnd);
+        return;
+    }
+}
+
+/*
+ * Sleep until one of curl's sockets is ready, curl's timer expires, timeout_ms passes (-1 for no limit)
+ * or our latch is set, then let curl make progress. A timeout of 0 makes progress without sleeping.
+ * Interrupts are processed, so this may not return.
+ */
+void pinecone_multi_wait(PineconeMulti* pm, long timeout_ms) {
+    WaitEvent* occurred;
+    int n_events = pm->n_sockets + 2;
+    int n_occurred;
+    int running;
+
+    if (pm->multi == NULL) elog(ERROR, "Pinecone request was aborted");
+    // sleep no longer than what is left until curl's deadline
+    if (pm->timeout_at_ms >= 0) {
+        long curl_timeout_ms = (long) ceil(Max(pm->timeout_at_ms - pinecone_multi_now_ms(), 0));
+        if (timeout_ms < 0 || curl_timeout_ms < timeout_ms) timeout_ms = curl_timeout_ms;
+    }
+
+    occurred = palloc(sizeof(WaitEvent) * n_events);
+    n_occurred = WaitEventSetWait(pm->set, timeout_ms, occurred, n_events, PG_WAIT_EXTENSION);
+    for (int i = 0; i < n_occurred; i++) {
+        int action = 0;
+        if (occurred[i].events & WL_LATCH_SET) ResetLatch(MyLatch);
+        if (occurred[i].events & WL_SOCKET_READABLE) action |= CURL_CSELECT_IN;
+        if (occurred[i].events & WL_SOCKET_WRITEABLE) action |= CURL_CSELECT_OUT;
+        if (action != 0) curl_multi_socket_action(pm->multi, occurred[i].fd, action, &running);
+    }
+    // curl's deadline passed, even if its sockets kept us busy; this is also how newly added handles get started
+    if (pm->timeout_at_ms >= 0 && pinecone_multi_now_ms() >= pm->timeout_at_ms) curl_multi_socket_action(pm->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+    pfree(occurred);
+
+    CHECK_FOR_INTERRUPTS();
+}
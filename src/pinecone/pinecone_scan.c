@@ -14,11 +14,29 @@
 
 #include <math.h>
 
-PineconeCheckpoint* get_checkpoints_to_fetch(Relation index) {
+typedef struct PineconeTidSetEntry
+{
+    ItemPointerData tid;
+    char status;
+} PineconeTidSetEntry;
+
+#define SH_PREFIX pinecone_tidset
+#define SH_ELEMENT_TYPE PineconeTidSetEntry
+#define SH_KEY_TYPE ItemPointerData
+#define SH_KEY tid
+#define SH_HASH_KEY(tb, key) hash_tid(key, 0)
+#define SH_EQUAL(tb, a, b) ItemPointerEquals(&a, &b)
+#define SH_SCOPE static inline
+#define SH_DECLARE
+#define SH_DEFINE
+#include "lib/simplehash.h"
+
+PineconeCheckpoint* get_checkpoints_to_fetch(Relation index, PineconeCheckpoint ready_checkpoint) {
     // starting at the current pinecone page, create a list of each checkpoint page's checkpoint (blkno, tid, checkpt_no)
     PineconeBufferMetaPageData buffer_meta = PineconeSnapshotBufferMeta(index);
-    int n_checkpoints = buffer_meta.flush_checkpoint.checkpoint_no - buffer_meta.ready_checkpoint.checkpoint_no;
+    int n_checkpoints = buffer_meta.flush_checkpoint.checkpoint_no - ready_checkpoint.checkpoint_no;
     PineconeCheckpoint* checkpoints;
+    int n_fetched = 0;
     BlockNumber currentblkno = buffer_meta.flush_checkpoint.blkno;
     PineconeBufferOpaqueData opaque = PineconeSnapshotBufferOpaque(index, currentblkno);
 
@@ -31,17 +49,23 @@ PineconeCheckpoint* get_checkpoints_to_fetch(Relation index) {
 
     // traverse from the flushed checkpoint back to the live checkpoint and append each checkpoint to the list
     for (int i = 0; i < n_checkpoints; i++) {
+        PineconeFlushTime* flush_time;
         // move to the previous checkpoint
         currentblkno = opaque.prev_checkpoint_blkno;
         opaque = PineconeSnapshotBufferOpaque(index, currentblkno);
-        checkpoints[i] = opaque.checkpoint;
         // we don't want to fetch the checkpoint we are already at (this will be the last checkpoint in the list if we don't exceed the max_fetched_vectors_for_liveness_check limit)
-        if (currentblkno == buffer_meta.ready_checkpoint.blkno) {
-            checkpoints[i].is_checkpoint = false;
+        if (currentblkno == ready_checkpoint.blkno) break;
+        // look for the first row that the flush of its segment upserted rather than its own tid, which may have been rolled back;
+        // a segment that upserted nothing has nothing to look for, and is ready once the checkpoint before it is
+        flush_time = &buffer_meta.recent_flushes[(opaque.checkpoint.checkpoint_no + 1) % PINECONE_RECENT_FLUSHES];
+        if (flush_time->flushed_at != 0 && flush_time->checkpoint.checkpoint_no == opaque.checkpoint.checkpoint_no + 1) {
+            if (!ItemPointerIsValid(&flush_time->representative_tid)) continue;
+            opaque.checkpoint.tid = flush_time->representative_tid;
         }
+        checkpoints[n_fetched++] = opaque.checkpoint;
     }
     // append a sentinel value
-    checkpoints[n_checkpoints].is_checkpoint = false;
+    checkpoints[n_fetched].is_checkpoint = false;
     return checkpoints;
 }
 
@@ -55,7 +79,7 @@ cJSON* fetch_ids_from_checkpoints(PineconeCheckpoint* checkpoints) {
 
 PineconeCheckpoint get_best_fetched_checkpoint(Relation index, PineconeCheckpoint* checkpoints, cJSON* fetch_results) {
     // find the latest checkpoint that has was fetched (i.e. is in fetch_results)
-    // todo: add timestamping so that we can assume that if the pinecone page is sufficiently old, we can assume it is live. (simple)
+    // (checkpoints that were flushed long enough ago are presumed ready without a fetch, see pinecone_liveness.c)
 
     // preprocess the results from a json object to a list of ItemPointerData
     PineconeCheckpoint invalid_checkpoint = {INVALID_CHECKPOINT_NUMBER, InvalidBlockNumber, {{0, 0},0}, 0, false};
@@ -93,31 +117,38 @@ IndexScanDesc pinecone_beginscan(Relation index, int nkeys, int norderbys)
 {
 	IndexScanDesc scan;
     PineconeScanOpaque so;
-    AttrNumber attNums[] = {1}; // sort only on the first column
-	Oid			sortOperators[] = {Float8LessOperator};
-	Oid			sortCollations[] = {InvalidOid};
-	bool		nullsFirstFlags[] = {false};
+    // rows this transaction inserted may still be queued for the buffer; the scan must see them
+    AppendPendingBufferTuples(index);
+    // and checkpoints that earlier transactions couldn't flush shouldn't wait for another insert
+    FlushLeftBehindCheckpoints(index);
+
 	scan = RelationGetIndexScan(index, nkeys, norderbys);
     so = (PineconeScanOpaque) palloc(sizeof(PineconeScanOpaqueData));
+    so->query = NULL;
+    so->query_body = NULL;
+    so->pinecone_matches = NULL;
+    so->n_pinecone_matches = 0;
+    so->pinecone_match_index = 0;
+    so->buffer_tids = NULL;
+    so->buffer_candidates = NULL;
+    so->n_buffer_candidates = 0;
+    so->buffer_candidate_index = 0;
 
-    // set support functions
-    so->procinfo = index_getprocinfo(index, 1, 1); // lookup the first support function in the opclass for the first attribute
-
-    // create tuple description for sorting
-    so->tupdesc = CreateTemplateTupleDesc(3);
-    TupleDescInitEntry(so->tupdesc, (AttrNumber) 1, "distance", FLOAT8OID, -1, 0);
-    TupleDescInitEntry(so->tupdesc, (AttrNumber) 2, "heaptid_blkno", INT4OID, -1, 0);
-    TupleDescInitEntry(so->tupdesc, (AttrNumber) 3, "heaptid_offset", INT2OID, -1, 0);
-
-    // prep sort
-    // allocate 6MB for the heapsort
-    so->sortstate = tuplesort_begin_heap(so->tupdesc, 1, attNums, sortOperators, sortCollations, nullsFirstFlags, 6000, NULL, false);
-    so->slot = MakeSingleTupleTableSlot(so->tupdesc, &TTSOpsMinimalTuple);
-    
     scan->opaque = so;
     return scan;
 }
 
+/*
+ * Drop a remote query that was started by rescan but never collected by gettuple
+ */
+static void pinecone_abort_remote_query(PineconeScanOpaque so) {
+    if (so->query == NULL) return;
+    pinecone_query_abort(so->query);
+    so->query = NULL;
+    pfree(so->query_body);
+    so->query_body = NULL;
+}
+
 
 cJSON* pinecone_build_filter(Relation index, ScanKey keys, int nkeys) {
     cJSON *filter = cJSON_CreateObject();
@@ -187,24 +218,17 @@ cJSON* pinecone_build_filter(Relation index, ScanKey keys, int nkeys) {
 
 /*
  * Start or restart an index scan
- * todo: can we reuse a tcp connection created in pinecone_beginscan?
  */
 void pinecone_rescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, int norderbys)
 {
 	Vector * vec;
-	cJSON *query_vector_values;
-	// cJSON *pinecone_response;
     cJSON* fetch_ids;
-    PineconeCheckpoint* fetch_checkpoints;
-    cJSON** responses;
-    cJSON *query_response, *fetch_response;
-	cJSON *matches;
+    bool fresh;
     Datum query_datum; // query vector
     PineconeStaticMetaPageData pinecone_metadata = PineconeSnapshotStaticMeta(scan->indexRelation);
     PineconeScanOpaque so = (PineconeScanOpaque) scan->opaque;
     TupleDesc tupdesc = RelationGetDescr(scan->indexRelation); // used for accessing
     cJSON* filter;
-    PineconeCheckpoint best_checkpoint;
 
     // check that the ORDER BY is on the first column (which is assumed to be a column on vectors)
     if (scan->numberOfOrderBys == 0 || orderbys[0].sk_attno != 1) {
@@ -213,48 +237,52 @@ void pinecone_rescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderb
                  errmsg("Index must be ordered by the first column")));
     }
     
+    // drop the query of a previous scan that was never read
+    pinecone_abort_remote_query(so);
+
     // build the filter
     filter = pinecone_build_filter(scan->indexRelation, keys, nkeys);
 
 	// get the query vector
     query_datum = orderbys[0].sk_argument;
     vec = DatumGetVector(query_datum);
-    query_vector_values = cJSON_CreateFloatArray(vec->x, vec->dim);
-
-    // query pinecone top-k
-    fetch_checkpoints = get_checkpoints_to_fetch(scan->indexRelation);
-    fetch_ids = fetch_ids_from_checkpoints(fetch_checkpoints);
-    responses = pinecone_query_with_fetch(pinecone_api_key, pinecone_metadata.host, pinecone_top_k, query_vector_values, filter, true, fetch_ids);
-    query_response = responses[0];
-    fetch_response = responses[1];
-    elog(DEBUG1, "query_response: %s", cJSON_Print(query_response));
-    elog(DEBUG1, "fetch_response: %s", cJSON_Print(fetch_response));
-    best_checkpoint = get_best_fetched_checkpoint(scan->indexRelation, fetch_checkpoints, fetch_response);
-
-    // set the pinecone_ready_page to the best checkpoint
-    if (best_checkpoint.is_checkpoint) {
-        set_buffer_meta_page(scan->indexRelation, &best_checkpoint, NULL, NULL, NULL, NULL);
+    so->query_body = pinecone_query_body(vec, pinecone_top_k, filter);
+    cJSON_Delete(filter);
+
+    // find out which checkpoints are ready; unless the liveness cache has seen that recently, the query is
+    // accompanied by a fetch of the newer checkpoints that aren't presumed ready
+    so->known_ready_checkpoint = PineconeSnapshotBufferMeta(scan->indexRelation).ready_checkpoint;
+    so->liveness_checked_at = GetCurrentTimestamp();
+    fresh = pinecone_liveness_lookup(scan->indexRelation, &so->known_ready_checkpoint);
+    so->ready_checkpoint = so->known_ready_checkpoint;
+    pinecone_liveness_presume(scan->indexRelation, &so->ready_checkpoint);
+    if (fresh) {
+        so->fetch_checkpoints = palloc0(sizeof(PineconeCheckpoint)); // just the sentinel
+    } else {
+        so->fetch_checkpoints = get_checkpoints_to_fetch(scan->indexRelation, so->ready_checkpoint);
     }
+    fetch_ids = fetch_ids_from_checkpoints(so->fetch_checkpoints);
+
+    // start the top-k query and the liveness fetch; they are collected by the first call to gettuple
+    pinecone_match_parser_init(&so->parser);
+    so->query = pinecone_query_start(pinecone_api_key, pinecone_metadata.host, so->query_body, &so->parser,
+                                     so->fetch_checkpoints[0].is_checkpoint, fetch_ids);
+    so->pinecone_matches = NULL;
+    so->n_pinecone_matches = 0;
+    so->pinecone_match_index = 0;
 
     // copy metric
     so->metric = pinecone_metadata.metric;
-
-    // copy pinecone_response to scan opaque
-    // response has a matches array, set opaque to the child of matches aka first match
-    matches = cJSON_GetObjectItemCaseSensitive(query_response, "matches");
-    so->pinecone_results = matches->child;
-    if (matches->child == NULL) {
-        // todo: hint the user that the buffer might not be flushed
-        ereport(DEBUG1, (errcode(ERRCODE_NO_DATA),
-                         errmsg("No matches found")));
-    }
+    so->dimensions = pinecone_metadata.dimensions;
+    so->inline_vectors = pinecone_metadata.inline_vectors;
 
     /* Requires MVCC-compliant snapshot as not able to pin during sorting */
     /* https://www.postgresql.org/docs/current/index-locking.html */
     if (!IsMVCCSnapshot(scan->xs_snapshot))
         elog(ERROR, "non-MVCC snapshots are not supported with pinecone");
 
-    // locally scan the buffer and add them to the sort state
+    // locally scan the buffer and add them to the sort state while the remote query is in flight.
+    // The ready checkpoint hasn't been advanced by this query's fetch (if any) yet, so this may scan a few more tuples than necessary.
     load_buffer_into_sort(scan->indexRelation, so, query_datum, tupdesc);
     
     // allocate for xs_orderbyvals (*Datum)
@@ -263,19 +291,153 @@ void pinecone_rescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderb
 
 }
 
+/*
+ * Wait for the remote query started by rescan and take over its matches.
+ * If it was accompanied by a liveness fetch, also publish the newest checkpoint the fetch found to the liveness cache.
+ * The buffer meta is left alone: it is only written by flushes, so queries don't take its exclusive lock or write WAL.
+ */
+static void pinecone_finish_remote_query(IndexScanDesc scan) {
+    PineconeScanOpaque so = (PineconeScanOpaque) scan->opaque;
+    cJSON* fetch_response;
+    bool timed_out;
+
+    fetch_response = pinecone_query_finish(so->query, &timed_out);
+    so->query = NULL;
+    pfree(so->query_body);
+    so->query_body = NULL;
+
+    // pinecone.query_deadline passed and we answer from the buffer alone
+    if (timed_out) {
+        so->n_pinecone_matches = 0;
+        so->pinecone_match_index = 0;
+        return;
+    }
+
+    pinecone_match_parser_finish(&so->parser);
+    elog(DEBUG1, "query returned %d matches", so->parser.n_matches);
+    if (so->fetch_checkpoints[0].is_checkpoint) {
+        elog(DEBUG1, "fetch_response: %s", cJSON_Print(fetch_response));
+        (void) pinecone_liveness_observe(scan->indexRelation, so->known_ready_checkpoint, so->fetch_checkpoints, fetch_response,
+                                         so->liveness_checked_at);
+    }
+
+    // keep the decoded matches in the scan opaque
+    so->pinecone_matches = so->parser.matches;
+    so->n_pinecone_matches = so->parser.n_matches;
+    so->pinecone_match_index = 0;
+    if (so->n_pinecone_matches == 0) {
+        // todo: hint the user that the buffer might not be flushed
+        ereport(DEBUG1, (errcode(ERRCODE_NO_DATA),
+                         errmsg("No matches found")));
+    }
+}
+
 // todo: save stats from inserting from base table into the meta
 
+/*
+ * Distances between a buffered vector and the query, the same as the opclasses' support functions
+ * (vector_l2_squared_distance, vector_negative_inner_product and cosine_distance) compute.
+ * query_norm is the squared norm of the query, which only cosine uses.
+ */
+static inline double pinecone_buffer_distance(VectorMetric metric, const float *ax, const float *bx, int dim, float query_norm)
+{
+    float distance = 0.0;
+    float norma = 0.0;
+    double similarity;
+
+    switch (metric) {
+        case EUCLIDEAN_METRIC:
+            // auto-vectorized
+            for (int i = 0; i < dim; i++) {
+                float diff = ax[i] - bx[i];
+                distance += diff * diff;
+            }
+            return (double) distance;
+        case INNER_PRODUCT_METRIC:
+            for (int i = 0; i < dim; i++) distance += ax[i] * bx[i];
+            return (double) distance * -1;
+        case COSINE_METRIC:
+            for (int i = 0; i < dim; i++) {
+                distance += ax[i] * bx[i];
+                norma += ax[i] * ax[i];
+            }
+            similarity = (double) distance / sqrt((double) norma * (double) query_norm);
+            if (similarity > 1) similarity = 1.0;
+            else if (similarity < -1) similarity = -1.0;
+            return 1.0 - similarity;
+        default:
+            elog(ERROR, "unsupported metric");
+    }
+    return 0; // unreachable
+}
+
+static inline bool pinecone_candidate_worse(PineconeBufferCandidate *a, PineconeBufferCandidate *b)
+{
+    if (a->distance != b->distance) return a->distance > b->distance;
+    return ItemPointerCompare(&a->tid, &b->tid) > 0;
+}
+
+static int pinecone_candidate_cmp(const void *a, const void *b)
+{
+    if (pinecone_candidate_worse((PineconeBufferCandidate *) a, (PineconeBufferCandidate *) b)) return 1;
+    if (pinecone_candidate_worse((PineconeBufferCandidate *) b, (PineconeBufferCandidate *) a)) return -1;
+    return 0;
+}
+
+// would a buffer tuple at this distance make it into the heap of candidates?
+static bool pinecone_candidate_wanted(PineconeScanOpaque so, double distance, ItemPointerData heap_tid)
+{
+    PineconeBufferCandidate candidate;
+    if (so->n_buffer_candidates < pinecone_top_k) return true;
+    candidate.distance = distance;
+    candidate.tid = heap_tid;
+    return pinecone_candidate_worse(&so->buffer_candidates[0], &candidate);
+}
+
+// offer a buffer tuple to the max-heap of the best pinecone.top_k
+static void pinecone_add_candidate(PineconeScanOpaque so, double distance, ItemPointerData heap_tid)
+{
+    PineconeBufferCandidate *heap = so->buffer_candidates;
+    PineconeBufferCandidate candidate;
+    int i;
+
+    candidate.distance = distance;
+    candidate.tid = heap_tid;
+    if (heap == NULL) heap = so->buffer_candidates = palloc(sizeof(PineconeBufferCandidate) * pinecone_top_k);
+
+    if (so->n_buffer_candidates < pinecone_top_k) {
+        // sift up
+        i = so->n_buffer_candidates++;
+        while (i > 0 && pinecone_candidate_worse(&candidate, &heap[(i - 1) / 2])) {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        heap[i] = candidate;
+        return;
+    }
+    if (!pinecone_candidate_worse(&heap[0], &candidate)) return;
+    // replace the worst and sift down
+    i = 0;
+    while (true) {
+        int child = 2 * i + 1;
+        if (child >= so->n_buffer_candidates) break;
+        if (child + 1 < so->n_buffer_candidates && pinecone_candidate_worse(&heap[child + 1], &heap[child])) child++;
+        if (!pinecone_candidate_worse(&heap[child], &candidate)) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = candidate;
+}
+
 void load_buffer_into_sort(Relation index, PineconeScanOpaque so, Datum query_datum, TupleDesc index_tupdesc)
 {
-    // todo: make sure that this is just as fast as pgvector's flatscan e.g. using vectorized operations
-    TupleTableSlot *slot = MakeSingleTupleTableSlot(so->tupdesc, &TTSOpsVirtual);
     PineconeBufferMetaPageData buffer_meta = PineconeSnapshotBufferMeta(index);
-    BlockNumber currentblkno = buffer_meta.ready_checkpoint.blkno;
-    int n_sortedtuple = 0;
+    BlockNumber currentblkno = so->ready_checkpoint.blkno;
+    int stripe = -1; // which stripe page we are at, once we are past the insert page
+    int n_scanned = 0;
     int n_tuples = buffer_meta.latest_checkpoint.n_preceding_tuples + buffer_meta.n_tuples_since_last_checkpoint;
     int unflushed_tuples = n_tuples - buffer_meta.flush_checkpoint.n_preceding_tuples;
-    int unready_tuples = n_tuples - buffer_meta.ready_checkpoint.n_preceding_tuples;
-    size_t bloom_filter_size = (((int) (1.44 * BUFFER_BLOOM_K * unready_tuples))>>3) + 1; // bloom filter size in bytes, 1.44 is the optimal bloom filter expansion factor
+    int unready_tuples = n_tuples - so->ready_checkpoint.n_preceding_tuples;
 
     // index info
     IndexInfo *indexInfo = BuildIndexInfo(index);
@@ -289,7 +451,32 @@ void load_buffer_into_sort(Relation index, PineconeScanOpaque so, Datum query_da
     IndexFetchTableData *fetchData = baseTableRel->rd_tableam->index_fetch_begin(baseTableRel);
     TupleTableSlot *base_table_slot = MakeSingleTupleTableSlot(baseTableRel->rd_att, &TTSOpsBufferHeapTuple);
     bool call_again, all_dead, found;
+    // with inline vectors the distances come from the buffer pages, and only the tuples of a page that would
+    // make it into the candidates are fetched, to check that they are visible before they push out others
+    int vector_size = pinecone_inline_vector_size(so->inline_vectors, so->dimensions);
+    Vector* inline_vector = (vector_size > 0) ? InitVector(so->dimensions) : NULL;
+    PineconeBufferCandidate* page_candidates = (vector_size > 0) ? palloc(sizeof(PineconeBufferCandidate) * PINECONE_PACKED_TIDS_PER_PAGE) : NULL;
+    int n_page_candidates = 0;
+    // the tids whose vectors have to be fetched from the heap
+    int fetch_tids_capacity = PINECONE_PACKED_TIDS_PER_PAGE;
+    ItemPointer fetch_tids = palloc(sizeof(ItemPointerData) * fetch_tids_capacity);
+    int n_fetch_tids = 0;
+    PineconeHeapPrefetch prefetch;
+    // the query, and its squared norm for cosine
+    Vector* query = DatumGetVector(query_datum);
+    float query_norm = 0.0;
     
+    for (int i = 0; i < query->dim; i++) query_norm += query->x[i] * query->x[i];
+    if (query->dim != so->dimensions && so->dimensions > 0) {
+        ereport(ERROR, (errcode(ERRCODE_DATA_EXCEPTION),
+                        errmsg("different vector dimensions %d and %d", query->dim, so->dimensions)));
+    }
+    // allocated on the first candidate, in case pinecone.top_k changed since the last scan
+    if (so->buffer_candidates != NULL) pfree(so->buffer_candidates);
+    so->buffer_candidates = NULL;
+    so->n_buffer_candidates = 0;
+    so->buffer_candidate_index = 0;
+
     // check H - T > max_local_scan
     if (unready_tuples > pinecone_max_buffer_scan) {
         ereport(NOTICE, (errcode(ERRCODE_INSUFFICIENT_RESOURCES),
@@ -297,86 +484,121 @@ void load_buffer_into_sort(Relation index, PineconeScanOpaque so, Datum query_da
                          errhint("There are %d tuples in the buffer that have not yet been flushed to pinecone and %d tuples in pinecone that are not yet live. You may want to consider flushing the buffer.", unflushed_tuples, unready_tuples - unflushed_tuples)));
     }
 
-    // initialize the bloom filter
-    // so->bloom_filter = bloom_create(BUFFER_BLOOM_K, buffer_meta.n_tuples_since_last_checkpoint);
-    so->bloom_filter = palloc0(bloom_filter_size);
-    so->bloom_filter_size = bloom_filter_size;
+    // the set of buffered tids, sized for the tuples we expect to scan
+    if (so->buffer_tids != NULL) pinecone_tidset_destroy(so->buffer_tids);
+    so->buffer_tids = pinecone_tidset_create(CurrentMemoryContext, Max(Min(unready_tuples, pinecone_max_buffer_scan), 16), NULL);
 
 
-    // add tuples to the sortstate
+    // offer the tuples to the heap of candidates; those whose vector is in the heap are collected and fetched in block order below
     while (BlockNumberIsValid(currentblkno)) {
         Buffer buf;
         Page page;
-
+        ItemPointer tids;
+        int n_tids;
 
         // access the page
         buf = ReadBuffer(index, currentblkno); // todo bulkread access method
         LockBuffer(buf, BUFFER_LOCK_SHARE);
         page = BufferGetPage(buf);
 
-        // add all tuples on the page to the sortstate
-        for (OffsetNumber offno = FirstOffsetNumber; offno <= PageGetMaxOffsetNumber(page); offno = OffsetNumberNext(offno)) {
-            // get the tid and the vector from the heap tuple
-            ItemId itemid;
-            Item item;
-            PineconeBufferTuple buffer_tup;
-            itemid = PageGetItemId(page, offno);
-            item = PageGetItem(page, itemid);
-            buffer_tup = *((PineconeBufferTuple*) item);
+        tids = PineconePageGetTids(page, &n_tids);
+        for (int t = 0; t < n_tids; t++) {
+            ItemPointerData heap_tid = tids[t];
  
-            // add the tuple to the bloom filter
-            for (int i = 0; i < BUFFER_BLOOM_K; i++) {
-                uint32 hash = hash_tid(buffer_tup.tid, i); // i is the seed
-                so->bloom_filter[(hash >> 3) % so->bloom_filter_size] |= (1 << (hash & 7));
+            // remember it, so that pinecone's copy of it is skipped
+            pinecone_tidset_insert(so->buffer_tids, heap_tid, &found);
+
+            if (inline_vector != NULL) {
+                double distance;
+                pinecone_decode_inline_vector(PineconePageGetInlineVector(page, t, vector_size), so->inline_vectors, inline_vector);
+                distance = pinecone_buffer_distance(so->metric, inline_vector->x, query->x, query->dim, query_norm);
+                if (pinecone_candidate_wanted(so, distance, heap_tid)) {
+                    page_candidates[n_page_candidates].distance = distance;
+                    page_candidates[n_page_candidates].tid = heap_tid;
+                    n_page_candidates++;
+                }
+            } else {
+                if (n_fetch_tids == fetch_tids_capacity) {
+                    fetch_tids_capacity *= 2;
+                    fetch_tids = repalloc(fetch_tids, sizeof(ItemPointerData) * fetch_tids_capacity);
+                }
+                fetch_tids[n_fetch_tids++] = heap_tid;
             }
+            n_scanned++;
+        }
 
-            // fetch the vector from the base table
-            found = baseTableRel->rd_tableam->index_fetch_tuple(fetchData, &buffer_tup.tid, snapshot, base_table_slot, &call_again, &all_dead);
-            if (!found) {
-                elog(DEBUG2, "could not find tuple in base table");
-                elog(DEBUG2, "call_again: %d, all_dead: %d", call_again, all_dead);
-                continue; // do not add the tuple to the sortstate
-            }
+        // move to the next page: along the list up to the insert page, then through the pages the stripes are filling
+        // (pages linked after we took the snapshot are reached as the stripe pages they were then)
+        if (stripe < 0 && currentblkno != buffer_meta.insert_page) {
+            currentblkno = PineconePageGetOpaque(page)->nextblkno;
+        } else {
+            currentblkno = InvalidBlockNumber;
+        }
+        if (!BlockNumberIsValid(currentblkno)) {
+            while (++stripe < PINECONE_INSERT_STRIPES && !PineconeStripePageIsValid(buffer_meta.stripe_pages[stripe]));
+            if (stripe < PINECONE_INSERT_STRIPES) currentblkno = buffer_meta.stripe_pages[stripe];
+        }
+        UnlockReleaseBuffer(buf);
 
-            // extract the indexed columns
-            FormIndexDatum(indexInfo, base_table_slot, NULL, index_values, index_isnull);
-
-            if (index_isnull[0]) elog(ERROR, "vector is null");
-           
-            // add the tuples
-            ExecClearTuple(slot);
-            slot->tts_values[0] = FunctionCall2(so->procinfo, index_values[0], query_datum); // compute distance between entry and query
-            slot->tts_isnull[0] = false;
-            slot->tts_values[1] = Int32GetDatum(ItemPointerGetBlockNumber(&buffer_tup.tid));
-            slot->tts_isnull[1] = false;
-            slot->tts_values[2] = Int16GetDatum(ItemPointerGetOffsetNumber(&buffer_tup.tid));
-            slot->tts_isnull[2] = false;
-            ExecStoreVirtualTuple(slot);
-
-            tuplesort_puttupleslot(so->sortstate, slot);
-            n_sortedtuple++;
+        // let the visible ones among the page's inline candidates in (dead and aborted rows are left out)
+        for (int c = 0; c < n_page_candidates; c++) {
+            ItemPointerData fetch_tid = page_candidates[c].tid; // the fetch moves it along the HOT chain
+            if (!pinecone_candidate_wanted(so, page_candidates[c].distance, page_candidates[c].tid)) continue;
+            call_again = false;
+            if (!baseTableRel->rd_tableam->index_fetch_tuple(fetchData, &fetch_tid, snapshot, base_table_slot, &call_again, &all_dead)) continue;
+            pinecone_add_candidate(so, page_candidates[c].distance, page_candidates[c].tid);
         }
+        n_page_candidates = 0;
 
-        // move to the next page
-        currentblkno = PineconePageGetOpaque(page)->nextblkno;
-        UnlockReleaseBuffer(buf);
+        // keep the remote query moving
+        if (so->query != NULL) pinecone_query_poll(so->query);
 
-        // stop if we have added enough tuples to the sortstate
-        if (n_sortedtuple >= pinecone_max_buffer_scan) {
+        // stop if we have scanned enough tuples
+        if (n_scanned >= pinecone_max_buffer_scan) {
             elog(NOTICE, "Reached max local scan");
             break;
         }
     }
+
+    // fetch the vectors from the base table, a heap page at a time
+    pinecone_sort_tids(fetch_tids, n_fetch_tids);
+    pinecone_heap_prefetch_init(&prefetch, baseTableRel, fetch_tids, n_fetch_tids);
+    for (int t = 0; t < n_fetch_tids; t++) {
+        ItemPointerData heap_tid = fetch_tids[t];
+        Vector* vector;
+        pinecone_heap_prefetch(&prefetch, t);
+        call_again = false;
+        found = baseTableRel->rd_tableam->index_fetch_tuple(fetchData, &heap_tid, snapshot, base_table_slot, &call_again, &all_dead);
+        if (!found) {
+            elog(DEBUG2, "could not find tuple in base table");
+            elog(DEBUG2, "call_again: %d, all_dead: %d", call_again, all_dead);
+            continue; // not a candidate
+        }
+
+        // extract the indexed columns
+        FormIndexDatum(indexInfo, base_table_slot, NULL, index_values, index_isnull);
+        if (index_isnull[0]) elog(ERROR, "vector is null");
+        vector = DatumGetVector(index_values[0]);
+        if (vector->dim != query->dim) {
+            ereport(ERROR, (errcode(ERRCODE_DATA_EXCEPTION),
+                            errmsg("different vector dimensions %d and %d", vector->dim, query->dim)));
+        }
+        pinecone_add_candidate(so, pinecone_buffer_distance(so->metric, vector->x, query->x, query->dim, query_norm), heap_tid);
+
+        // keep the remote query moving
+        if (so->query != NULL && t % PINECONE_PACKED_TIDS_PER_PAGE == 0) pinecone_query_poll(so->query);
+    }
+    pfree(fetch_tids);
+    if (page_candidates != NULL) pfree(page_candidates);
+
     // end the index fetch
     ExecDropSingleTupleTableSlot(base_table_slot);
     baseTableRel->rd_tableam->index_fetch_end(fetchData);
     // close the base table
     RelationClose(baseTableRel);
 
-    tuplesort_performsort(so->sortstate);
-    
-    // get the first tuple from the sortstate
-    so->more_buffer_tuples = tuplesort_gettupleslot(so->sortstate, true, false, so->slot, NULL);
+    // best first
+    if (so->n_buffer_candidates > 1) qsort(so->buffer_candidates, so->n_buffer_candidates, sizeof(PineconeBufferCandidate), pinecone_candidate_cmp);
 }
 
 /*
@@ -384,31 +606,25 @@ void load_buffer_into_sort(Relation index, PineconeScanOpaque so, Datum query_da
  */
 bool pinecone_gettuple(IndexScanDesc scan, ScanDirection dir)
 {
-	// interpret scan->opaque as a cJSON object
-	char *id_str;
 	ItemPointerData match_heaptid;
     PineconeScanOpaque so = (PineconeScanOpaque) scan->opaque;
-    cJSON *match = so->pinecone_results;
+    PineconeMatch *match;
+    PineconeBufferCandidate *buffer_candidate;
     double pinecone_best_dist, buffer_best_dist, dist, dist_lower_bound;
-    bool isnull;
     float rel_tol = 0.15; // relative tolerance for distance recheck; TODO: this should depend on the metric; the inaccuracy arises from pinecone using half precision floats
 
-    // while the match is in the bloom filter, get the next match
+    // the remote results are only needed now
+    if (so->query != NULL) pinecone_finish_remote_query(scan);
+    match = (so->pinecone_match_index < so->n_pinecone_matches) ? &so->pinecone_matches[so->pinecone_match_index] : NULL;
+
+    // while the match is in the local buffer, get the next match
     while (match != NULL) {
-        bool duplicate = true;
-        id_str = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(match, "id"));
-        match_heaptid = pinecone_id_get_heap_tid(id_str);
-        for (int i = 0; i < BUFFER_BLOOM_K; i++) {
-            uint32 hash = hash_tid(match_heaptid, i); // i is the seed
-            if (!(so->bloom_filter[(hash >> 3) % so->bloom_filter_size] & (1 << (hash & 7)))) {
-                duplicate = false;
-                break;
-            }
-        }
-        if (duplicate) {
-            elog(DEBUG1, "skipping duplicate match %s. this was returned by pinecone, but was also found in the local buffer", id_str);
-            match = match->next;
-            so->pinecone_results = match;
+        match_heaptid = match->tid;
+        if (pinecone_tidset_lookup(so->buffer_tids, match_heaptid) != NULL) {
+            elog(DEBUG1, "skipping duplicate match (%u,%u). this was returned by pinecone, but was also found in the local buffer",
+                 ItemPointerGetBlockNumber(&match_heaptid), ItemPointerGetOffsetNumber(&match_heaptid));
+            so->pinecone_match_index++;
+            match = (so->pinecone_match_index < so->n_pinecone_matches) ? &so->pinecone_matches[so->pinecone_match_index] : NULL;
         } else {
             break;
         }
@@ -422,50 +638,40 @@ bool pinecone_gettuple(IndexScanDesc scan, ScanDirection dir)
         {
         case EUCLIDEAN_METRIC:
             // pinecone returns the square of the euclidean distance, which is what we want
-            pinecone_best_dist = cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(match, "score"));
+            pinecone_best_dist = match->score;
             break;
         case COSINE_METRIC:
             // pinecone returns the cosine similarity, but we want "cosine distance" which is 1 - cosine similarity
-            pinecone_best_dist = 1 - cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(match, "score"));
+            pinecone_best_dist = 1 - match->score;
             break;
         case INNER_PRODUCT_METRIC:
             // pinecone returns the dot product, but we want "dot product distance" which is - dot product
-            pinecone_best_dist = - cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(match, "score"));
+            pinecone_best_dist = - match->score;
             break;
         default:
             elog(ERROR, "unsupported metric");
         }
     }
                           
-    buffer_best_dist = (so->more_buffer_tuples) ? DatumGetFloat8(slot_getattr(so->slot, 1, &isnull)) : __DBL_MAX__;
-    // log (match == NULL) so->more_buffer_tuples and the scores
+    buffer_candidate = (so->buffer_candidate_index < so->n_buffer_candidates) ? &so->buffer_candidates[so->buffer_candidate_index] : NULL;
+    buffer_best_dist = (buffer_candidate != NULL) ? buffer_candidate->distance : __DBL_MAX__;
 
     elog(DEBUG1, "✓ pinecone_best_dist: %f, buffer_best_dist: %f", pinecone_best_dist, buffer_best_dist);
     // merge the results from the buffer and the remote index
-    if (match == NULL && !so->more_buffer_tuples) {
+    if (match == NULL && buffer_candidate == NULL) {
         return false;
     }
     else if (buffer_best_dist < pinecone_best_dist) {
         // use the buffer tuple
-        Datum blkno_datum = slot_getattr(so->slot, 2, &isnull);
-        Datum offset_datum = slot_getattr(so->slot, 3, &isnull);
         dist = buffer_best_dist;
-        ItemPointerSetBlockNumber(&match_heaptid, blkno_datum);
-        ItemPointerSetOffsetNumber(&match_heaptid, offset_datum);
-        scan->xs_heaptid = match_heaptid;
+        scan->xs_heaptid = buffer_candidate->tid;
         scan->xs_recheck = true;
-        // get the next tuple from the sortstate
-        so->more_buffer_tuples = tuplesort_gettupleslot(so->sortstate, true, false, so->slot, NULL);
+        so->buffer_candidate_index++;
     }
     else {
         dist = pinecone_best_dist;
-        // get the id of the match // interpret the id as a string
-        id_str = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(match, "id"));
-        match_heaptid = pinecone_id_get_heap_tid(id_str);
-        scan->xs_heaptid = match_heaptid;
-        // TODO: create a datum out of the distance and retrun it to xs_orderbyvals
-        // NEXT
-        so->pinecone_results = so->pinecone_results->next;
+        scan->xs_heaptid = match->tid;
+        so->pinecone_match_index++;
     }
     // The recheck is going to compute vector<->query i.e. l2_distance, whereas for sorting we have been using l2_squared_distance
     // we need to provide xs_recheck a lower bound on the l2_distance
@@ -478,4 +684,10 @@ bool pinecone_gettuple(IndexScanDesc scan, ScanDirection dir)
     return true;
 }
 
-void no_endscan(IndexScanDesc scan) {};
+/*
+ * End a scan, dropping the remote query if it was never read
+ */
+void pinecone_endscan(IndexScanDesc scan) {
+    PineconeScanOpaque so = (PineconeScanOpaque) scan->opaque;
+    pinecone_abort_remote_query(so);
+}
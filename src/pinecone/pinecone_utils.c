@@ -1,78 +1,12 @@
 #include "pinecone.h"
 
 #include "storage/bufmgr.h"
-#include "access/generic_xlog.h"
 #include "access/relscan.h"
 #include "utils/builtins.h"
 #include "utils/lsyscache.h"
+#include "utils/spccache.h"
 
-cJSON* tuple_get_pinecone_vector(TupleDesc tup_desc, Datum *values, bool *isnull, char *vector_id)
-{
-    cJSON *json_vector = cJSON_CreateObject();
-    cJSON *metadata = cJSON_CreateObject();
-    Vector *vector;
-    cJSON *json_values;
-    vector = DatumGetVector(values[0]);
-    validate_vector_nonzero(vector);
-    json_values = cJSON_CreateFloatArray(vector->x, vector->dim);
-    // prepare metadata
-    for (int i = 1; i < tup_desc->natts; i++) // skip the first column which is the vector
-    {
-        // todo: we should validate that all the columns have the desired types when the index is built
-        FormData_pg_attribute* td = TupleDescAttr(tup_desc, i);
-        switch (td->atttypid) {
-            case BOOLOID:
-                cJSON_AddItemToObject(metadata, NameStr(td->attname), cJSON_CreateBool(DatumGetBool(values[i])));
-                break;
-            case FLOAT8OID:
-                cJSON_AddItemToObject(metadata, NameStr(td->attname), cJSON_CreateNumber(DatumGetFloat8(values[i])));
-                break;
-            case INT4OID:
-                cJSON_AddItemToObject(metadata, NameStr(td->attname), cJSON_CreateNumber(DatumGetInt32(values[i])));
-                break;
-            case TEXTOID:
-                cJSON_AddItemToObject(metadata, NameStr(td->attname), cJSON_CreateString(text_to_cstring(DatumGetTextP(values[i]))));
-                break;
-            case TEXTARRAYOID:
-                {
-                    cJSON* json_array = text_array_get_json(values[i]);
-                    cJSON_AddItemToObject(metadata, NameStr(td->attname), json_array);
-                }
-                break;
-            default:
-                ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                                errmsg("Invalid column type when decoding tuple."),
-                                errhint("Pinecone index only supports boolean, float8, text, and textarray columns")));
-        }
-    }
-    // add to vector object
-    cJSON_AddItemToObject(json_vector, "id", cJSON_CreateString(vector_id));
-    cJSON_AddItemToObject(json_vector, "values", json_values);
-    cJSON_AddItemToObject(json_vector, "metadata", metadata);
-    return json_vector;
-}
-
-cJSON* index_tuple_get_pinecone_vector(Relation index, IndexTuple itup) {
-    int natts = index->rd_att->natts;
-    Datum *itup_values = (Datum *) palloc(sizeof(Datum) * natts);
-    bool *itup_isnull = (bool *) palloc(sizeof(bool) * natts);
-    TupleDesc itup_desc = index->rd_att;
-    char* vector_id;
-    index_deform_tuple(itup, itup_desc, itup_values, itup_isnull);
-    vector_id = pinecone_id_from_heap_tid(itup->t_tid);
-    return tuple_get_pinecone_vector(itup_desc, itup_values, itup_isnull, vector_id);
-}
-
-cJSON* heap_tuple_get_pinecone_vector(Relation heap, HeapTuple htup) {
-    int natts = heap->rd_att->natts;
-    Datum *htup_values = (Datum *) palloc(sizeof(Datum) * natts);
-    bool *htup_isnull = (bool *) palloc(sizeof(bool) * natts);
-    TupleDesc htup_desc = heap->rd_att;
-    char* vector_id;
-    heap_deform_tuple(htup, htup_desc, htup_values, htup_isnull);
-    vector_id = pinecone_id_from_heap_tid(htup->t_self);
-    return tuple_get_pinecone_vector(htup_desc, htup_values, htup_isnull, vector_id);
-}
+#include <math.h>
 
 ItemPointerData pinecone_id_get_heap_tid(char *id)
 {
@@ -141,43 +75,197 @@ PineconeBufferOpaqueData PineconeSnapshotBufferOpaque(Relation index, BlockNumbe
 void set_buffer_meta_page(Relation index, PineconeCheckpoint* ready_checkpoint, PineconeCheckpoint* flush_checkpoint, PineconeCheckpoint* latest_checkpoint, BlockNumber* insert_page, int* n_tuples_since_last_checkpoint) {
     Buffer buffer_meta_buf;
     Page buffer_meta_page;
-    PineconeBufferMetaPage buffer_meta;
-
-    // start WAL logging
-    GenericXLogState* state = GenericXLogStart(index);
+    PineconeBufferMetaPageData buffer_meta;
+    PineconeWalState wal;
 
     // get the meta page
     buffer_meta_buf = ReadBuffer(index, PINECONE_BUFFER_METAPAGE_BLKNO);
     LockBuffer(buffer_meta_buf, BUFFER_LOCK_EXCLUSIVE);
-    buffer_meta_page = GenericXLogRegisterBuffer(state, buffer_meta_buf, 0); 
-    buffer_meta = PineconePageGetBufferMeta(buffer_meta_page);
+
+    // start WAL logging
+    pinecone_wal_start(&wal, index);
+    buffer_meta_page = pinecone_wal_register(&wal, buffer_meta_buf, false);
+    buffer_meta = *PineconePageGetBufferMeta(buffer_meta_page);
 
     // update the buffer meta page
     // checkpoints
     if (ready_checkpoint != NULL) {
-        buffer_meta->ready_checkpoint = *ready_checkpoint;
+        buffer_meta.ready_checkpoint = *ready_checkpoint;
     }
     if (flush_checkpoint != NULL) {
-        buffer_meta->flush_checkpoint = *flush_checkpoint;
+        buffer_meta.flush_checkpoint = *flush_checkpoint;
     }
     if (latest_checkpoint != NULL) {
-        buffer_meta->latest_checkpoint = *latest_checkpoint;
+        buffer_meta.latest_checkpoint = *latest_checkpoint;
     }
     // insert page
     if (insert_page != NULL) {
-        buffer_meta->insert_page = *insert_page;
+        buffer_meta.insert_page = *insert_page;
     }
     // n_tuples_since_last_checkpoint
     if (n_tuples_since_last_checkpoint != NULL) {
-        buffer_meta->n_tuples_since_last_checkpoint = *n_tuples_since_last_checkpoint;
+        buffer_meta.n_tuples_since_last_checkpoint = *n_tuples_since_last_checkpoint;
     }
 
-
     // save and release
-    GenericXLogFinish(state);
+    pinecone_wal_begin_changes(&wal);
+    *PineconePageGetBufferMeta(buffer_meta_page) = buffer_meta;
+    pinecone_wal_finish(&wal, XLOG_PINECONE_SET_META, (char *) &buffer_meta, sizeof(buffer_meta));
     UnlockReleaseBuffer(buffer_meta_buf);
 }
 
+int PineconePageGetNTids(Page page) {
+    if (!PineconePageIsPacked(page)) return PageGetMaxOffsetNumber(page);
+    return (((PageHeader) page)->pd_lower - MAXALIGN(SizeOfPageHeaderData)) / sizeof(ItemPointerData);
+}
+
+/*
+ * The heap tids on a buffer page. Points into the page unless it was written in the old format.
+ */
+ItemPointer PineconePageGetTids(Page page, int *n_tids) {
+    ItemPointer tids;
+    *n_tids = PineconePageGetNTids(page);
+    if (PineconePageIsPacked(page)) return (ItemPointer) PageGetContents(page);
+    tids = palloc(sizeof(ItemPointerData) * Max(*n_tids, 1));
+    for (int i = 0; i < *n_tids; i++) {
+        tids[i] = ((PineconeBufferTuple*) PageGetItem(page, PageGetItemId(page, i + FirstOffsetNumber)))->tid;
+    }
+    return tids;
+}
+
+// number of tids (each with an inline vector of vector_size bytes) that can still be added to a buffer page
+// (none to a page in the old format)
+int PineconePageGetTidRoom(Page page, int vector_size) {
+    if (!PineconePageIsPacked(page)) return 0;
+    return PageGetExactFreeSpace(page) / (sizeof(ItemPointerData) + vector_size);
+}
+
+/*
+ * Reading the heap in block order
+ *
+ * The buffer holds tids in the order they were inserted, which for a table larger than shared_buffers means a
+ * random read per tuple. Sorting a segment's tids by block reads each heap page once and in order, and the
+ * blocks are prefetched (up to effective_io_concurrency of them) ahead of index_fetch_tuple.
+ */
+
+static int pinecone_tid_cmp(const void* a, const void* b) {
+    return ItemPointerCompare((ItemPointer) a, (ItemPointer) b);
+}
+
+void pinecone_sort_tids(ItemPointer tids, int n_tids) {
+    if (n_tids > 1) qsort(tids, n_tids, sizeof(ItemPointerData), pinecone_tid_cmp);
+}
+
+void pinecone_heap_prefetch_init(PineconeHeapPrefetch* prefetch, Relation heap, ItemPointer tids, int n_tids) {
+    prefetch->heap = heap;
+    prefetch->tids = tids;
+    prefetch->n_tids = n_tids;
+#ifdef USE_PREFETCH
+    prefetch->distance = get_tablespace_io_concurrency(heap->rd_rel->reltablespace);
+#else
+    prefetch->distance = 0;
+#endif
+    prefetch->next = 0;
+    prefetch->last_prefetched = InvalidBlockNumber;
+    prefetch->current = InvalidBlockNumber;
+    prefetch->n_prefetched = 0;
+    prefetch->n_consumed = 0;
+}
+
+// call before fetching tids[current]
+void pinecone_heap_prefetch(PineconeHeapPrefetch* prefetch, int current) {
+    BlockNumber blkno = ItemPointerGetBlockNumber(&prefetch->tids[current]);
+    if (prefetch->distance <= 0) return;
+    if (blkno != prefetch->current) {
+        prefetch->current = blkno;
+        prefetch->n_consumed++;
+    }
+    while (prefetch->next < prefetch->n_tids && prefetch->n_prefetched - prefetch->n_consumed < prefetch->distance) {
+        blkno = ItemPointerGetBlockNumber(&prefetch->tids[prefetch->next++]);
+        if (blkno == prefetch->last_prefetched) continue;
+        PrefetchBuffer(prefetch->heap, MAIN_FORKNUM, blkno);
+        prefetch->last_prefetched = blkno;
+        prefetch->n_prefetched++;
+    }
+}
+
+/*
+ * Inline vectors
+ *
+ * float16 is IEEE half precision, rounded to nearest even. Buffer pages are only ever read by the server that
+ * wrote them, so the byte order is the native one.
+ */
+
+// bytes taken by each inline vector on a buffer page; a multiple of 8 (see PineconePageIsPacked)
+int pinecone_inline_vector_size(int inline_vectors, int dimensions) {
+    switch (inline_vectors) {
+        case PINECONE_INLINE_VECTORS_FLOAT4: return MAXALIGN(sizeof(float) * dimensions);
+        case PINECONE_INLINE_VECTORS_FLOAT16: return MAXALIGN(sizeof(uint16) * dimensions);
+        default: return 0;
+    }
+}
+
+static uint16 float_to_half(float f) {
+    uint32 x, sign, mant, rem;
+    int32 exp;
+    uint16 half;
+    memcpy(&x, &f, sizeof(x));
+    sign = (x >> 16) & 0x8000;
+    exp = (int32) ((x >> 23) & 0xff) - 127 + 15;
+    mant = x & 0x7fffff;
+    if (((x >> 23) & 0xff) == 0xff) return sign | 0x7c00 | (mant != 0 ? 0x200 : 0); // inf or nan
+    if (exp >= 0x1f) return sign | 0x7c00; // too large, inf
+    if (exp <= 0) {
+        // subnormal (or zero)
+        int shift = 14 - exp;
+        if (shift > 24) return sign;
+        mant |= 0x800000;
+        half = mant >> shift;
+        rem = mant & ((1u << shift) - 1);
+        if (rem > (1u << (shift - 1)) || (rem == (1u << (shift - 1)) && (half & 1))) half++;
+        return sign | half;
+    }
+    half = sign | (exp << 10) | (mant >> 13);
+    rem = mant & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (half & 1))) half++; // a carry into the exponent is still right
+    return half;
+}
+
+static float half_to_float(uint16 h) {
+    uint32 sign = (uint32) (h & 0x8000) << 16;
+    uint32 exp = (h >> 10) & 0x1f;
+    uint32 mant = h & 0x3ff;
+    uint32 x;
+    float f;
+    if (exp == 0) {
+        f = ldexpf((float) mant, -24); // subnormal (or zero)
+        return sign ? -f : f;
+    }
+    if (exp == 0x1f) x = sign | 0x7f800000 | (mant << 13);
+    else x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+void pinecone_encode_inline_vector(Vector* vector, int inline_vectors, char* out) {
+    if (inline_vectors == PINECONE_INLINE_VECTORS_FLOAT4) {
+        memcpy(out, vector->x, sizeof(float) * vector->dim);
+    } else {
+        uint16* halves = (uint16*) out;
+        for (int i = 0; i < vector->dim; i++) halves[i] = float_to_half(vector->x[i]);
+    }
+}
+
+// out must have been allocated with the index's dimensions
+void pinecone_decode_inline_vector(char* in, int inline_vectors, Vector* out) {
+    if (inline_vectors == PINECONE_INLINE_VECTORS_FLOAT4) {
+        memcpy(out->x, in, sizeof(float) * out->dim);
+    } else {
+        uint16* halves = (uint16*) in;
+        for (int i = 0; i < out->dim; i++) out->x[i] = half_to_float(halves[i]);
+    }
+}
+
 char* checkpoint_to_string(PineconeCheckpoint checkpoint) {
     char* str = palloc(200);
     if (checkpoint.is_checkpoint) {
@@ -38,6 +38,24 @@ void pinecone_host_validator(const char *host)
     return;
 }
 
+int pinecone_inline_vectors_from_string(const char *value)
+{
+    if (value == NULL || strcmp(value, "off") == 0) return PINECONE_INLINE_VECTORS_OFF;
+    if (strcmp(value, "float4") == 0) return PINECONE_INLINE_VECTORS_FLOAT4;
+    if (strcmp(value, "float16") == 0) return PINECONE_INLINE_VECTORS_FLOAT16;
+    return -1;
+}
+
+void pinecone_inline_vectors_validator(const char *value)
+{
+    if (pinecone_inline_vectors_from_string(value) < 0) {
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("Invalid inline_vectors: %s", value),
+                 errhint("inline_vectors must be off, float4 or float16.")));
+    }
+}
+
 
 bool no_validate(Oid opclassoid) { return true; }
 
@@ -0,0 +1,644 @@
+#include "pinecone_api.h"
+#include "pinecone.h"
+
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "postmaster/bgworker.h"
+#include "storage/dsm.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "storage/shm_mq.h"
+#include "storage/shm_toc.h"
+#include "storage/shmem.h"
+#include "storage/lwlock.h"
+#include "storage/spin.h"
+#include "tcop/tcopprot.h"
+#include "utils/memutils.h"
+#include "utils/resowner.h"
+
+#include <curl/curl.h>
+
+/*
+ * Shared network worker
+ *
+ * When pinecone.network_worker is on (which requires vector to be in
+ * shared_preload_libraries), a single background worker owns one curl multi
+ * handle and performs the requests of every backend over a few HTTP/2
+ * connections per host instead of each backend keeping its own.
+ *
+ * A backend puts its requests in a DSM segment (see the PINECONE_NETWORK_KEY_*
+ * entries of the segment's toc), pushes the segment's handle onto a queue in
+ * shared memory and wakes the worker. The worker attaches to the segment, runs
+ * the requests, and sends each response back through the shm_mq in the segment
+ * as soon as it completes. The requests get the backend's pinecone.request_timeout
+ * and pinecone.stall_timeout, and their easy handles come from the worker's
+ * per-host pool (see pinecone_acquire_handle). When the backend detaches from the
+ * segment, because it gave up on the job or errored out, the worker drops the
+ * job's transfers on its next round rather than when they complete.
+ */
+
+#define PINECONE_NETWORK_MAGIC 0x50434e57
+#define PINECONE_NETWORK_KEY_REQUESTS 1
+#define PINECONE_NETWORK_KEY_STRINGS 2
+#define PINECONE_NETWORK_KEY_MQ 3
+
+#define PINECONE_NETWORK_QUEUE_SIZE 128 // pending request segments in shared memory
+#define PINECONE_NETWORK_MQ_SIZE 65536 // responses larger than this are streamed through the queue
+
+typedef struct PineconeNetworkShmemData
+{
+    slock_t mutex;
+    pid_t worker_pid;
+    Latch* worker_latch;
+    uint32 head; // next slot to read
+    uint32 tail; // next slot to write
+    dsm_handle queue[PINECONE_NETWORK_QUEUE_SIZE];
+} PineconeNetworkShmemData;
+
+typedef struct PineconeNetworkRequest
+{
+    char method[10];
+    Size url_offset; // offsets into the strings chunk
+    Size body_offset;
+    Size body_length; // 0 if the request has no body
+} PineconeNetworkRequest;
+
+typedef struct PineconeNetworkRequests
+{
+    int n_requests;
+    Size api_key_offset;
+    int request_timeout; // the backend's pinecone.request_timeout (ms) and pinecone.stall_timeout (s)
+    int stall_timeout;
+    pg_atomic_uint32 backend_detached; // set once the backend has detached, i.e. nobody waits for the responses
+    PineconeNetworkRequest requests[FLEXIBLE_ARRAY_MEMBER];
+} PineconeNetworkRequests;
+
+// header of each message sent back to the backend, followed by the response body
+typedef struct PineconeNetworkResponse
+{
+    int request_no;
+    CURLcode curl_code;
+    long status;
+    double retry_after_ms;
+} PineconeNetworkResponse;
+
+bool pinecone_network_worker = false;
+static PineconeNetworkShmemData* network_shmem = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+
+static Size pinecone_network_shmem_size(void) {
+    return MAXALIGN(sizeof(PineconeNetworkShmemData));
+}
+
+#if PG_VERSION_NUM >= 150000
+static void pinecone_shmem_request(void) {
+    if (prev_shmem_request_hook) prev_shmem_request_hook();
+    RequestAddinShmemSpace(pinecone_network_shmem_size());
+    RequestAddinShmemSpace(pinecone_flush_shmem_size());
+    pinecone_liveness_shmem_request();
+}
+#endif
+
+static void pinecone_shmem_startup(void) {
+    bool found;
+    if (prev_shmem_startup_hook) prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+    network_shmem = ShmemInitStruct("pinecone network worker", pinecone_network_shmem_size(), &found);
+    if (!found) {
+        SpinLockInit(&network_shmem->mutex);
+        network_shmem->worker_pid = 0;
+        network_shmem->worker_latch = NULL;
+        network_shmem->head = 0;
+        network_shmem->tail = 0;
+    }
+    pinecone_flush_shmem_init();
+    pinecone_liveness_shmem_init();
+    LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Reserve shared memory and register the network worker.
+ * Only possible while shared_preload_libraries are being loaded.
+ */
+void PineconeWorkerInit(void) {
+    BackgroundWorker worker;
+
+    if (!process_shared_preload_libraries_in_progress) return;
+
+#if PG_VERSION_NUM >= 150000
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = pinecone_shmem_request;
+#else
+    RequestAddinShmemSpace(pinecone_network_shmem_size());
+    RequestAddinShmemSpace(pinecone_flush_shmem_size());
+    pinecone_liveness_shmem_request();
+#endif
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = pinecone_shmem_startup;
+
+    if (!pinecone_network_worker) return;
+
+    memset(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+    worker.bgw_start_time = BgWorkerStart_ConsistentState;
+    worker.bgw_restart_time = 5;
+    strcpy(worker.bgw_library_name, "vector");
+    strcpy(worker.bgw_function_name, "pinecone_network_worker_main");
+    strcpy(worker.bgw_name, "pinecone network worker");
+    strcpy(worker.bgw_type, "pinecone network worker");
+    RegisterBackgroundWorker(&worker);
+}
+
+static bool network_worker_running(void) {
+    bool running;
+    if (network_shmem == NULL) return false;
+    SpinLockAcquire(&network_shmem->mutex);
+    running = network_shmem->worker_pid != 0;
+    SpinLockRelease(&network_shmem->mutex);
+    return running;
+}
+
+/*
+ * Push a request segment onto the shared queue and wake the worker.
+ * Returns false if the worker isn't running or the queue is full.
+ */
+static bool network_worker_submit(dsm_handle handle) {
+    Latch* latch = NULL;
+    bool submitted = false;
+    SpinLockAcquire(&network_shmem->mutex);
+    if (network_shmem->worker_pid != 0 && network_shmem->tail - network_shmem->head < PINECONE_NETWORK_QUEUE_SIZE) {
+        network_shmem->queue[network_shmem->tail % PINECONE_NETWORK_QUEUE_SIZE] = handle;
+        network_shmem->tail++;
+        latch = network_shmem->worker_latch;
+        submitted = true;
+    }
+    SpinLockRelease(&network_shmem->mutex);
+    if (latch != NULL) SetLatch(latch);
+    return submitted;
+}
+
+// however the backend detaches from a request segment, let the worker know that it can drop the job
+static void network_job_detach_callback(dsm_segment* seg, Datum arg) {
+    PineconeNetworkRequests* requests = (PineconeNetworkRequests*) DatumGetPointer(arg);
+    pg_atomic_write_u32(&requests->backend_detached, 1);
+}
+
+/*
+ * A batch of requests handed to the network worker by this backend
+ */
+struct PineconeNetworkJob
+{
+    dsm_segment* seg;
+    shm_mq_handle* mqh;
+    ResponseData** responses;
+    CURLcode* codes;
+    int n_requests;
+    int n_received;
+};
+
+/*
+ * Hand the requests prepared on handles to the network worker.
+ * The url is read back from the handle; the method and body are taken from the response data, like the mock does.
+ * Returns NULL without doing anything if the worker isn't available, in which case the caller performs the requests itself.
+ * The responses are delivered to responses (and their codes to codes) by pinecone_network_worker_poll.
+ */
+PineconeNetworkJob* pinecone_network_worker_submit(const char *api_key, CURL** handles, ResponseData** responses, CURLcode* codes, int n) {
+    shm_toc_estimator estimator;
+    Size segsize, strings_size, offset;
+    dsm_segment* seg;
+    shm_toc* toc;
+    PineconeNetworkRequests* requests;
+    PineconeNetworkJob* job;
+    char* strings;
+    shm_mq* mq;
+    char** urls;
+
+    if (!pinecone_network_worker || !network_worker_running()) return NULL;
+
+    // size the strings: api key, then url and body of each request
+    urls = palloc(sizeof(char*) * n);
+    strings_size = strlen(api_key) + 1;
+    for (int i = 0; i < n; i++) {
+        curl_easy_getinfo(handles[i], CURLINFO_EFFECTIVE_URL, &urls[i]);
+        strings_size += strlen(urls[i]) + 1;
+        if (responses[i]->request_body != NULL) strings_size += strlen(responses[i]->request_body) + 1;
+    }
+
+    shm_toc_initialize_estimator(&estimator);
+    shm_toc_estimate_chunk(&estimator, offsetof(PineconeNetworkRequests, requests) + sizeof(PineconeNetworkRequest) * n);
+    shm_toc_estimate_chunk(&estimator, strings_size);
+    shm_toc_estimate_chunk(&estimator, PINECONE_NETWORK_MQ_SIZE);
+    shm_toc_estimate_keys(&estimator, 3);
+    segsize = shm_toc_estimate(&estimator);
+
+    seg = dsm_create(segsize, 0);
+    toc = shm_toc_create(PINECONE_NETWORK_MAGIC, dsm_segment_address(seg), segsize);
+
+    // copy the requests into the segment
+    requests = shm_toc_allocate(toc, offsetof(PineconeNetworkRequests, requests) + sizeof(PineconeNetworkRequest) * n);
+    strings = shm_toc_allocate(toc, strings_size);
+    requests->n_requests = n;
+    requests->api_key_offset = 0;
+    requests->request_timeout = pinecone_request_timeout;
+    requests->stall_timeout = pinecone_stall_timeout;
+    pg_atomic_init_u32(&requests->backend_detached, 0);
+    strcpy(strings, api_key);
+    offset = strlen(api_key) + 1;
+    for (int i = 0; i < n; i++) {
+        PineconeNetworkRequest* request = &requests->requests[i];
+        strlcpy(request->method, responses[i]->method, sizeof(request->method));
+        request->url_offset = offset;
+        strcpy(strings + offset, urls[i]);
+        offset += strlen(urls[i]) + 1;
+        request->body_offset = offset;
+        request->body_length = 0;
+        if (responses[i]->request_body != NULL) {
+            request->body_length = strlen(responses[i]->request_body);
+            memcpy(strings + offset, responses[i]->request_body, request->body_length + 1);
+            offset += request->body_length + 1;
+        }
+    }
+    shm_toc_insert(toc, PINECONE_NETWORK_KEY_REQUESTS, requests);
+    shm_toc_insert(toc, PINECONE_NETWORK_KEY_STRINGS, strings);
+    pfree(urls);
+
+    mq = shm_mq_create(shm_toc_allocate(toc, PINECONE_NETWORK_MQ_SIZE), PINECONE_NETWORK_MQ_SIZE);
+    shm_toc_insert(toc, PINECONE_NETWORK_KEY_MQ, mq);
+    shm_mq_set_receiver(mq, MyProc);
+
+    job = palloc(sizeof(PineconeNetworkJob));
+    job->seg = seg;
+    job->mqh = shm_mq_attach(mq, seg, NULL);
+    // registered after the queue's own detach callback, so it runs first and the flag is set by the time the queue wakes the worker
+    on_dsm_detach(seg, network_job_detach_callback, PointerGetDatum(requests));
+    job->responses = responses;
+    job->codes = codes;
+    job->n_requests = n;
+    job->n_received = 0;
+
+    if (!network_worker_submit(dsm_segment_handle(seg))) {
+        elog(DEBUG1, "Pinecone network worker is busy, performing the requests in this backend");
+        dsm_detach(seg);
+        pfree(job);
+        return NULL;
+    }
+    return job;
+}
+
+/*
+ * Deliver the responses that have arrived so far. With wait, block until all of them have arrived.
+ * Returns true once every response has been delivered, at which point the job is freed.
+ */
+bool pinecone_network_worker_poll(PineconeNetworkJob* job, bool wait) {
+    // collect the responses in the order they complete
+    while (job->n_received < job->n_requests) {
+        Size nbytes;
+        void* data;
+        shm_mq_result res = shm_mq_receive(job->mqh, &nbytes, &data, true);
+        if (res == SHM_MQ_SUCCESS) {
+            PineconeNetworkResponse* header = (PineconeNetworkResponse*) data;
+            ResponseData* response_data;
+            Size body_length = nbytes - sizeof(PineconeNetworkResponse);
+            if (nbytes < sizeof(PineconeNetworkResponse) || header->request_no < 0 || header->request_no >= job->n_requests) {
+                elog(ERROR, "Invalid message from pinecone network worker");
+            }
+            response_data = job->responses[header->request_no];
+            // deliver the body the same way curl would in this backend
+            write_callback((char*) data + sizeof(PineconeNetworkResponse), 1, body_length, response_data);
+            job->codes[header->request_no] = header->curl_code;
+            response_data->status = header->status;
+            response_data->retry_after_ms = header->retry_after_ms;
+            job->n_received++;
+        } else if (res == SHM_MQ_DETACHED) {
+            ereport(ERROR, (errcode(ERRCODE_CONNECTION_FAILURE),
+                            errmsg("Pinecone network worker exited before answering")));
+        } else if (!network_worker_running()) {
+            ereport(ERROR, (errcode(ERRCODE_CONNECTION_FAILURE),
+                            errmsg("Pinecone network worker is not running")));
+        } else if (!wait) {
+            return false;
+        } else {
+            // the worker sets our latch when it writes to the queue
+            (void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH, 1000, PG_WAIT_EXTENSION);
+            ResetLatch(MyLatch);
+            CHECK_FOR_INTERRUPTS();
+        }
+    }
+    dsm_detach(job->seg);
+    pfree(job);
+    return true;
+}
+
+/*
+ * Stop waiting for the responses of job. The worker notices the detached queue and drops the remaining responses.
+ */
+void pinecone_network_worker_cancel(PineconeNetworkJob* job) {
+    dsm_detach(job->seg);
+    pfree(job);
+}
+
+/*
+ * Perform the requests prepared on handles through the network worker and wait for all of them.
+ * Returns false without doing anything if the worker isn't available.
+ */
+bool pinecone_network_worker_perform(const char *api_key, CURL** handles, ResponseData** responses, CURLcode* codes, int n) {
+    PineconeNetworkJob* job = pinecone_network_worker_submit(api_key, handles, responses, codes, n);
+    if (job == NULL) return false;
+    pinecone_network_worker_poll(job, true);
+    return true;
+}
+
+
+/*
+ * Worker side
+ */
+
+typedef struct NetworkJob NetworkJob;
+
+typedef struct NetworkJobRequest
+{
+    NetworkJob* job;
+    int request_no;
+    CURL* hnd; // from the host's pool, whose private pointer it carries
+    struct curl_slist* headers;
+    ResponseData response_data;
+    CURLcode curl_code;
+    bool done;
+    bool sent;
+} NetworkJobRequest;
+
+struct NetworkJob
+{
+    dsm_segment* seg;
+    PineconeNetworkRequests* shared; // in the segment
+    shm_mq_handle* mqh;
+    int n_requests;
+    int n_sent;
+    bool detached; // the backend went away, drop the remaining responses
+    int sending; // request whose response is partially sent, or -1
+    char* message; // the message being sent
+    Size message_length;
+    NetworkJobRequest* requests;
+    NetworkJob* next;
+};
+
+static PineconeMulti* network_multi = NULL;
+static NetworkJob* network_jobs = NULL;
+
+/*
+ * Attach to a request segment and start its requests
+ */
+static void network_start_job(dsm_handle handle) {
+    dsm_segment* seg = dsm_attach(handle);
+    shm_toc* toc;
+    PineconeNetworkRequests* requests;
+    char* strings;
+    shm_mq* mq;
+    NetworkJob* job;
+
+    if (seg == NULL) return; // the backend already gave up
+    toc = shm_toc_attach(PINECONE_NETWORK_MAGIC, dsm_segment_address(seg));
+    if (toc == NULL) {
+        elog(WARNING, "Pinecone network worker received an invalid request segment");
+        dsm_detach(seg);
+        return;
+    }
+    requests = shm_toc_lookup(toc, PINECONE_NETWORK_KEY_REQUESTS, false);
+    strings = shm_toc_lookup(toc, PINECONE_NETWORK_KEY_STRINGS, false);
+    mq = shm_toc_lookup(toc, PINECONE_NETWORK_KEY_MQ, false);
+    if (pg_atomic_read_u32(&requests->backend_detached) != 0) {
+        dsm_detach(seg);
+        return;
+    }
+    dsm_pin_mapping(seg); // until the job ends, across rounds of the loop
+    shm_mq_set_sender(mq, MyProc);
+
+    job = palloc0(sizeof(NetworkJob));
+    job->seg = seg;
+    job->shared = requests;
+    job->mqh = shm_mq_attach(mq, seg, NULL);
+    job->n_requests = requests->n_requests;
+    job->sending = -1;
+    job->requests = palloc0(sizeof(NetworkJobRequest) * job->n_requests);
+    job->next = network_jobs;
+    network_jobs = job;
+
+    for (int i = 0; i < job->n_requests; i++) {
+        PineconeNetworkRequest* request = &requests->requests[i];
+        NetworkJobRequest* job_request = &job->requests[i];
+        CURL* hnd = pinecone_acquire_handle(strings + request->url_offset);
+        job_request->job = job;
+        job_request->request_no = i;
+        job_request->hnd = hnd;
+        strlcpy(job_request->response_data.method, request->method, sizeof(job_request->response_data.method));
+        job_request->response_data.context = TopMemoryContext; // outlives the loop context
+        job_request->headers = create_common_headers(strings + requests->api_key_offset);
+        curl_easy_setopt(hnd, CURLOPT_HTTPHEADER, job_request->headers);
+        curl_easy_setopt(hnd, CURLOPT_CUSTOMREQUEST, request->method);
+        curl_easy_setopt(hnd, CURLOPT_URL, strings + request->url_offset);
+        curl_easy_setopt(hnd, CURLOPT_WRITEDATA, &job_request->response_data);
+        curl_easy_setopt(hnd, CURLOPT_WRITEFUNCTION, write_callback);
+        curl_easy_setopt(hnd, CURLOPT_HEADERDATA, &job_request->response_data);
+        curl_easy_setopt(hnd, CURLOPT_HEADERFUNCTION, header_callback);
+        set_curl_timeouts(hnd, requests->request_timeout, requests->stall_timeout);
+        // multiplex over an existing connection rather than opening a new one
+        curl_easy_setopt(hnd, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(hnd, CURLOPT_PIPEWAIT, 1L);
+        if (request->body_length > 0) {
+            // the body stays mapped until the job is finished
+            curl_easy_setopt(hnd, CURLOPT_POSTFIELDS, strings + request->body_offset);
+            curl_easy_setopt(hnd, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) request->body_length);
+        }
+        pinecone_multi_add(network_multi, hnd);
+    }
+}
+
+// take the request's handle off the multi: a completed transfer's goes back to the host's pool, one cut short is freed
+static void network_finish_request(NetworkJobRequest* job_request, bool completed) {
+    if (job_request->hnd != NULL) {
+        pinecone_multi_remove(network_multi, job_request->hnd);
+        if (completed) {
+            pinecone_release_handle(job_request->hnd);
+        } else {
+            curl_easy_cleanup(job_request->hnd); // mid-transfer, so don't put it back in the pool
+        }
+        job_request->hnd = NULL;
+    }
+    if (job_request->headers != NULL) {
+        curl_slist_free_all(job_request->headers);
+        job_request->headers = NULL;
+    }
+}
+
+// the request running on hnd (whose private pointer belongs to the handle pool)
+static NetworkJobRequest* network_find_request(CURL* hnd) {
+    for (NetworkJob* job = network_jobs; job != NULL; job = job->next) {
+        for (int i = 0; i < job->n_requests; i++) {
+            if (job->requests[i].hnd == hnd) return &job->requests[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Collect the completed transfers from curl
+ */
+static void network_collect_completed(void) {
+    CURLMsg* msg;
+    int msgs_left;
+    while ((msg = curl_multi_info_read(network_multi->multi, &msgs_left)) != NULL) {
+        NetworkJobRequest* job_request;
+        if (msg->msg != CURLMSG_DONE) continue;
+        job_request = network_find_request(msg->easy_handle);
+        if (job_request == NULL) continue;
+        job_request->curl_code = msg->data.result;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &job_request->response_data.status);
+        job_request->done = true;
+        network_finish_request(job_request, true);
+    }
+}
+
+/*
+ * Send as many completed responses as the job's queue accepts without blocking.
+ * Returns true once the job is finished.
+ */
+static bool network_send_responses(NetworkJob* job) {
+    while (!job->detached && job->n_sent < job->n_requests) {
+        shm_mq_result res;
+        if (job->sending < 0) {
+            NetworkJobRequest* job_request = NULL;
+            PineconeNetworkResponse header;
+            for (int i = 0; i < job->n_requests; i++) {
+                if (job->requests[i].done && !job->requests[i].sent) {
+                    job_request = &job->requests[i];
+                    break;
+                }
+            }
+            if (job_request == NULL) return false; // nothing ready yet
+            header.request_no = job_request->request_no;
+            header.curl_code = job_request->curl_code;
+            header.status = job_request->response_data.status;
+            header.retry_after_ms = job_request->response_data.retry_after_ms;
+            job->message_length = sizeof(header) + job_request->response_data.length;
+            job->message = palloc(job->message_length);
+            memcpy(job->message, &header, sizeof(header));
+            if (job_request->response_data.length > 0) {
+                memcpy(job->message + sizeof(header), job_request->response_data.data, job_request->response_data.length);
+            }
+            if (job_request->response_data.data != NULL) {
+                pfree(job_request->response_data.data);
+                job_request->response_data.data = NULL;
+            }
+            job->sending = job_request->request_no;
+        }
+#if PG_VERSION_NUM >= 150000
+        res = shm_mq_send(job->mqh, job->message_length, job->message, true, true);
+#else
+        res = shm_mq_send(job->mqh, job->message_length, job->message, true);
+#endif
+        if (res == SHM_MQ_WOULD_BLOCK) return false; // the backend sets our latch once it has read
+        if (res == SHM_MQ_DETACHED) job->detached = true;
+        job->requests[job->sending].sent = true;
+        job->n_sent++;
+        job->sending = -1;
+        pfree(job->message);
+        job->message = NULL;
+    }
+    return true;
+}
+
+// end a job whose responses have all been sent, or whose backend detached; the transfers still running are dropped
+static void network_end_job(NetworkJob* job) {
+    for (int i = 0; i < job->n_requests; i++) {
+        network_finish_request(&job->requests[i], false);
+        if (job->requests[i].response_data.data != NULL) pfree(job->requests[i].response_data.data);
+    }
+    if (job->message != NULL) pfree(job->message);
+    dsm_unpin_mapping(job->seg);
+    dsm_detach(job->seg);
+    pfree(job->requests);
+    pfree(job);
+}
+
+static void network_worker_detach_shmem(int code, Datum arg) {
+    SpinLockAcquire(&network_shmem->mutex);
+    network_shmem->worker_pid = 0;
+    network_shmem->worker_latch = NULL;
+    SpinLockRelease(&network_shmem->mutex);
+}
+
+void pinecone_network_worker_main(Datum main_arg) {
+    MemoryContext loop_context;
+    MemoryContext oldcontext;
+    int running;
+
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
+    CurrentResourceOwner = ResourceOwnerCreate(NULL, "pinecone network worker");
+    loop_context = AllocSetContextCreate(TopMemoryContext, "pinecone network worker loop", ALLOCSET_DEFAULT_SIZES);
+
+    oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+    network_multi = pinecone_multi_create();
+    MemoryContextSwitchTo(oldcontext);
+    curl_multi_setopt(network_multi->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+    SpinLockAcquire(&network_shmem->mutex);
+    network_shmem->worker_pid = MyProcPid;
+    network_shmem->worker_latch = MyLatch;
+    SpinLockRelease(&network_shmem->mutex);
+    on_shmem_exit(network_worker_detach_shmem, (Datum) 0);
+
+    elog(LOG, "pinecone network worker started");
+
+    while (true) {
+        NetworkJob** job_ptr;
+
+        ResetLatch(MyLatch);
+        CHECK_FOR_INTERRUPTS();
+
+        // pick up newly submitted requests
+        while (true) {
+            dsm_handle handle;
+            bool found = false;
+            SpinLockAcquire(&network_shmem->mutex);
+            if (network_shmem->head != network_shmem->tail) {
+                handle = network_shmem->queue[network_shmem->head % PINECONE_NETWORK_QUEUE_SIZE];
+                network_shmem->head++;
+                found = true;
+            }
+            SpinLockRelease(&network_shmem->mutex);
+            if (!found) break;
+            network_start_job(handle);
+        }
+        // newly added handles only start once curl's timer fires
+        curl_multi_socket_action(network_multi->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+
+        // hand back what has completed, and drop the jobs whose backend has detached whether or not they have
+        network_collect_completed();
+        for (NetworkJob* job = network_jobs; job != NULL; job = job->next) {
+            if (pg_atomic_read_u32(&job->shared->backend_detached) != 0) job->detached = true;
+        }
+        job_ptr = &network_jobs;
+        while (*job_ptr != NULL) {
+            NetworkJob* job = *job_ptr;
+            if (network_send_responses(job)) {
+                *job_ptr = job->next;
+                network_end_job(job);
+            } else {
+                job_ptr = &job->next;
+            }
+        }
+
+        oldcontext = MemoryContextSwitchTo(loop_context);
+        pinecone_multi_wait(network_multi, -1);
+        MemoryContextSwitchTo(oldcontext);
+        MemoryContextReset(loop_context);
+        network_collect_completed();
+    }
+}
@@ -0,0 +1,257 @@
+#include "pinecone.h"
+
+#include "access/bufmask.h"
+#include "access/generic_xlog.h"
+#include "access/xlog_internal.h"
+#include "access/xloginsert.h"
+#include "access/xlogutils.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "utils/rel.h"
+
+/*
+ * WAL for the buffer
+ *
+ * By default changes to the buffer are logged with generic WAL records, which carry a delta of each page
+ * (and a full image of each new page). With pinecone.wal_rmgr on (PG15+, vector in shared_preload_libraries),
+ * they are logged with our own records instead: "append these tids to page X", "link a stripe's page after
+ * the insert page", "give a stripe a new page" and "set the buffer meta". These are a fraction of the size.
+ *
+ * The resource manager is only registered when pinecone.wal_rmgr is on at startup (it can't change without a
+ * restart), so a server that doesn't use our records never claims the resource manager id. It uses
+ * RM_EXPERIMENTAL_ID, which no other extension on the server may use at the same time. A server that has
+ * written our records, and its standbys, must keep vector preloaded and pinecone.wal_rmgr on until the records
+ * are behind a checkpoint, e.g. after a clean shutdown, or they won't be able to replay them.
+ *
+ * The changes themselves are made by the pinecone_apply_* functions below, which the insert path and redo share.
+ */
+
+bool pinecone_wal_rmgr = false;
+static bool pinecone_rmgr_registered = false;
+
+/*
+ * Shared by the insert path and redo
+ */
+
+// add tids to the end of a buffer page, and their vectors below the last one if they are stored inline
+void pinecone_page_add_tids(Page page, ItemPointer tids, char* vectors, int vector_size, int n_tids)
+{
+    PageHeader header = (PageHeader) page;
+    if (n_tids > PineconePageGetTidRoom(page, vector_size)) elog(ERROR, "Not enough room on the pinecone buffer page");
+    memcpy((char *) page + header->pd_lower, tids, sizeof(ItemPointerData) * n_tids);
+    header->pd_lower += sizeof(ItemPointerData) * n_tids;
+    for (int i = 0; i < n_tids && vector_size > 0; i++) {
+        header->pd_upper -= vector_size;
+        memcpy((char *) page + header->pd_upper, vectors + i * vector_size, vector_size);
+    }
+}
+
+// indexes created before stripes or flush times existed have a shorter meta, and GenericXLog ignores changes past pd_lower
+static void pinecone_extend_buffer_meta(Page buffer_meta_page)
+{
+    PineconeBufferMetaPage buffer_meta = PineconePageGetBufferMeta(buffer_meta_page);
+    ((PageHeader) buffer_meta_page)->pd_lower = Max(((PageHeader) buffer_meta_page)->pd_lower,
+                                                    ((char *) buffer_meta - (char *) buffer_meta_page) + sizeof(PineconeBufferMetaPageData));
+}
+
+void pinecone_apply_init_stripe(Page buffer_meta_page, int stripe, BlockNumber blkno)
+{
+    PineconePageGetBufferMeta(buffer_meta_page)->stripe_pages[stripe] = blkno;
+    pinecone_extend_buffer_meta(buffer_meta_page);
+}
+
+void pinecone_apply_set_meta(Page buffer_meta_page, PineconeBufferMetaPageData* buffer_meta)
+{
+    *PineconePageGetBufferMeta(buffer_meta_page) = *buffer_meta;
+    pinecone_extend_buffer_meta(buffer_meta_page);
+}
+
+// any of the pages may be NULL, in which case it is left alone
+void pinecone_apply_link(Page stripe_page, BlockNumber stripe_blkno, Page insert_page, Page buffer_meta_page, BlockNumber new_blkno, xl_pinecone_link *xlrec)
+{
+    if (stripe_page != NULL && xlrec->create_checkpoint) {
+        PineconeBufferOpaque stripe_opaque = PineconePageGetOpaque(stripe_page);
+        stripe_opaque->prev_checkpoint_blkno = xlrec->prev_checkpoint_blkno;
+        stripe_opaque->checkpoint = xlrec->checkpoint;
+    }
+    if (insert_page != NULL) {
+        PineconePageGetOpaque(insert_page)->nextblkno = stripe_blkno;
+    }
+    if (buffer_meta_page != NULL) {
+        PineconeBufferMetaPage buffer_meta = PineconePageGetBufferMeta(buffer_meta_page);
+        buffer_meta->insert_page = stripe_blkno;
+        buffer_meta->n_tuples_since_last_checkpoint = xlrec->n_tuples_since_last_checkpoint;
+        if (xlrec->create_checkpoint) buffer_meta->latest_checkpoint = xlrec->checkpoint;
+        buffer_meta->stripe_pages[xlrec->stripe] = new_blkno;
+    }
+}
+
+/*
+ * Logging changes
+ *
+ * pinecone_wal_start, then pinecone_wal_register every buffer (locked exclusively), then pinecone_wal_begin_changes,
+ * make the changes to the registered pages and pinecone_wal_finish. Nothing between begin_changes and finish may fail.
+ */
+
+void pinecone_wal_start(PineconeWalState* wal, Relation index)
+{
+    wal->index = index;
+    wal->n_buffers = 0;
+    wal->generic = NULL;
+    if (!pinecone_wal_rmgr || !pinecone_rmgr_registered) wal->generic = GenericXLogStart(index);
+}
+
+Page pinecone_wal_register(PineconeWalState* wal, Buffer buf, bool will_init)
+{
+    Assert(wal->n_buffers < PINECONE_WAL_MAX_BUFFERS);
+    wal->buffers[wal->n_buffers] = buf;
+    wal->will_init[wal->n_buffers] = will_init;
+    wal->n_buffers++;
+    if (wal->generic != NULL) return GenericXLogRegisterBuffer(wal->generic, buf, will_init ? GENERIC_XLOG_FULL_IMAGE : 0);
+    return BufferGetPage(buf);
+}
+
+void pinecone_wal_begin_changes(PineconeWalState* wal)
+{
+    if (wal->generic == NULL) START_CRIT_SECTION();
+}
+
+void pinecone_wal_finish(PineconeWalState* wal, uint8 info, char* data, int len)
+{
+    XLogRecPtr recptr;
+
+    if (wal->generic != NULL) {
+        GenericXLogFinish(wal->generic);
+        return;
+    }
+    for (int i = 0; i < wal->n_buffers; i++) MarkBufferDirty(wal->buffers[i]);
+    if (RelationNeedsWAL(wal->index)) {
+        XLogBeginInsert();
+        for (int i = 0; i < wal->n_buffers; i++) {
+            XLogRegisterBuffer(i, wal->buffers[i], wal->will_init[i] ? REGBUF_WILL_INIT : REGBUF_STANDARD);
+        }
+        if (len > 0) XLogRegisterData(data, len);
+        recptr = XLogInsert(PINECONE_RMGR_ID, info);
+        for (int i = 0; i < wal->n_buffers; i++) PageSetLSN(BufferGetPage(wal->buffers[i]), recptr);
+    }
+    END_CRIT_SECTION();
+}
+
+/*
+ * Resource manager
+ */
+
+#if PG_VERSION_NUM >= 150000
+static void pinecone_redo(XLogReaderState *record)
+{
+    uint8 info = XLogRecGetInfo(record) & ~XLR_INFO_MASK;
+    XLogRecPtr lsn = record->EndRecPtr;
+    Buffer buffers[PINECONE_WAL_MAX_BUFFERS];
+    BlockNumber blknos[PINECONE_WAL_MAX_BUFFERS];
+    Page pages[PINECONE_WAL_MAX_BUFFERS];
+    int n_buffers = 0;
+
+    // read the blocks that need their changes replayed; pages[i] is NULL for those that don't
+    for (int i = 0; i < PINECONE_WAL_MAX_BUFFERS && XLogRecHasBlockRef(record, i); i++) {
+        XLogRecGetBlockTag(record, i, NULL, NULL, &blknos[i]);
+        if (XLogRecGetBlock(record, i)->flags & BKPBLOCK_WILL_INIT) {
+            buffers[i] = XLogInitBufferForRedo(record, i);
+            pages[i] = BufferGetPage(buffers[i]);
+            PineconePageInit(pages[i], BufferGetPageSize(buffers[i]));
+        } else {
+            pages[i] = (XLogReadBufferForRedo(record, i, &buffers[i]) == BLK_NEEDS_REDO) ? BufferGetPage(buffers[i]) : NULL;
+        }
+        n_buffers++;
+    }
+
+    switch (info) {
+        case XLOG_PINECONE_APPEND: {
+            xl_pinecone_append* xlrec = (xl_pinecone_append*) XLogRecGetData(record);
+            if (pages[0] != NULL) pinecone_page_add_tids(pages[0], xlrec->tids, XLogPineconeAppendGetVectors(xlrec), xlrec->vector_size, xlrec->n_tids);
+            break;
+        }
+        case XLOG_PINECONE_INIT_STRIPE: {
+            xl_pinecone_init_stripe* xlrec = (xl_pinecone_init_stripe*) XLogRecGetData(record);
+            if (pages[1] != NULL) pinecone_apply_init_stripe(pages[1], xlrec->stripe, blknos[0]);
+            break;
+        }
+        case XLOG_PINECONE_LINK: {
+            xl_pinecone_link* xlrec = (xl_pinecone_link*) XLogRecGetData(record);
+            pinecone_apply_link(pages[0], blknos[0], pages[1], pages[2], blknos[3], xlrec);
+            break;
+        }
+        case XLOG_PINECONE_SET_META:
+            if (pages[0] != NULL) pinecone_apply_set_meta(pages[0], (PineconeBufferMetaPageData*) XLogRecGetData(record));
+            break;
+        default:
+            elog(PANIC, "pinecone_redo: unknown op code %u", info);
+    }
+
+    for (int i = 0; i < n_buffers; i++) {
+        if (pages[i] != NULL) {
+            PageSetLSN(pages[i], lsn);
+            MarkBufferDirty(buffers[i]);
+        }
+        if (BufferIsValid(buffers[i])) UnlockReleaseBuffer(buffers[i]);
+    }
+}
+
+static const char* pinecone_identify(uint8 info)
+{
+    switch (info & ~XLR_INFO_MASK) {
+        case XLOG_PINECONE_APPEND: return "APPEND";
+        case XLOG_PINECONE_INIT_STRIPE: return "INIT_STRIPE";
+        case XLOG_PINECONE_LINK: return "LINK";
+        case XLOG_PINECONE_SET_META: return "SET_META";
+        default: return NULL;
+    }
+}
+
+static void pinecone_desc(StringInfo buf, XLogReaderState *record)
+{
+    uint8 info = XLogRecGetInfo(record) & ~XLR_INFO_MASK;
+    char* data = XLogRecGetData(record);
+    switch (info) {
+        case XLOG_PINECONE_APPEND:
+            appendStringInfo(buf, "n_tids %d, vector_size %d", ((xl_pinecone_append*) data)->n_tids, ((xl_pinecone_append*) data)->vector_size);
+            break;
+        case XLOG_PINECONE_INIT_STRIPE:
+            appendStringInfo(buf, "stripe %d", ((xl_pinecone_init_stripe*) data)->stripe);
+            break;
+        case XLOG_PINECONE_LINK:
+            appendStringInfo(buf, "stripe %d, checkpoint %s", ((xl_pinecone_link*) data)->stripe,
+                             ((xl_pinecone_link*) data)->create_checkpoint ? "new" : "none");
+            break;
+        case XLOG_PINECONE_SET_META: {
+            PineconeBufferMetaPageData* meta = (PineconeBufferMetaPageData*) data;
+            appendStringInfo(buf, "ready %d, flush %d, latest %d", meta->ready_checkpoint.checkpoint_no,
+                             meta->flush_checkpoint.checkpoint_no, meta->latest_checkpoint.checkpoint_no);
+            break;
+        }
+    }
+}
+
+static void pinecone_mask(char *pagedata, BlockNumber blkno)
+{
+    mask_page_lsn_and_checksum(pagedata);
+    mask_unused_space(pagedata);
+}
+
+static RmgrData pinecone_rmgr = {
+    .rm_name = "pinecone",
+    .rm_redo = pinecone_redo,
+    .rm_desc = pinecone_desc,
+    .rm_identify = pinecone_identify,
+    .rm_mask = pinecone_mask,
+};
+#endif
+
+// register the resource manager if pinecone.wal_rmgr is on; only possible while shared_preload_libraries are being loaded
+void PineconeXLogInit(void)
+{
+#if PG_VERSION_NUM >= 150000
+    if (!process_shared_preload_libraries_in_progress || !pinecone_wal_rmgr) return;
+    RegisterCustomRmgr(PINECONE_RMGR_ID, &pinecone_rmgr);
+    pinecone_rmgr_registered = true;
+#endif
+}
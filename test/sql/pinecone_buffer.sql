@@ -0,0 +1,125 @@
+-- SETUP
+-- suppress output
+\o /dev/null
+delete from pinecone_mock;
+-- logging level
+SET client_min_messages = 'notice';
+-- keep the rows in the buffer
+SET pinecone.vectors_per_request = 100;
+SET pinecone.requests_per_batch = 10;
+-- disable flat scan to force use of the index
+SET enable_seqscan = off;
+-- CREATE TABLE
+DROP TABLE IF EXISTS t;
+CREATE TABLE t (id int, val vector(3));
+\o
+
+-- mock create index
+INSERT INTO pinecone_mock (url_prefix, method, response)
+VALUES ('https://api.pinecone.io/indexes', 'POST', $${
+        "name": "invalid",
+        "metric": "euclidean",
+        "dimension": 3,
+        "status": {
+                "ready": true,
+                "state": "Ready"
+        },
+        "host": "fakehost",
+        "spec": {
+                "serverless": {
+                        "cloud": "aws",
+                        "region": "us-west-2"
+                }
+        }
+}$$);
+-- mock describe index stats
+INSERT INTO pinecone_mock (url_prefix, method, response)
+VALUES ('https://fakehost/describe_index_stats', 'GET', '{"namespaces":{},"dimension":3,"indexFullness":0,"totalVectorCount":0}');
+-- mock upsert
+INSERT INTO pinecone_mock (url_prefix, method, response)
+VALUES ('https://fakehost/vectors/upsert', 'POST', '{"upsertedCount":1}');
+-- row 6 is built into pinecone, the others stay in the buffer
+INSERT INTO t (id, val) VALUES (6, '[2.5,0,0]');
+CREATE INDEX i2 ON t USING pinecone (val) WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}');
+-- mock query
+INSERT INTO pinecone_mock (url_prefix, method, response)
+VALUES ('https://fakehost/query', 'POST', '{"matches":[{"id":"000000000001","score":6.25}]}');
+
+-- COPY
+-- the copied rows are appended to the buffer when the scan begins; the query finds them there before and after the commit
+BEGIN;
+COPY t (id, val) FROM stdin;
+1	[1,0,0]
+2	[2,0,0]
+3	[3,0,0]
+4	[4,0,0]
+5	[5,0,0]
+\.
+SELECT id FROM t ORDER BY val <-> '[0,0,0]';
+COMMIT;
+SELECT id FROM t ORDER BY val <-> '[0,0,0]';
+
+-- DEDUP
+-- pinecone also returns row 3, which is still in the buffer; it is returned once, in distance order
+DELETE FROM pinecone_mock WHERE url_prefix = 'https://fakehost/query';
+INSERT INTO pinecone_mock (url_prefix, method, response)
+VALUES ('https://fakehost/query', 'POST', '{"matches":[{"id":"000000000001","score":6.25},{"id":"000000000004","score":9}]}');
+SELECT id FROM t ORDER BY val <-> '[0,0,0]';
+
+-- TOP_K
+-- only the pinecone.top_k nearest buffered rows are candidates, and pinecone's copy of row 3 is still skipped
+SET pinecone.top_k = 2;
+SELECT id FROM t ORDER BY val <-> '[0,0,0]';
+-- a deleted row doesn't take a candidate's place
+DELETE FROM t WHERE id = 1;
+SELECT id FROM t ORDER BY val <-> '[0,0,0]';
+RESET pinecone.top_k;
+
+DROP TABLE t;
+
+-- ROLLBACK
+-- one vector per batch, so that each insert flushes the batch of the one before last
+SET pinecone.vectors_per_request = 1;
+SET pinecone.requests_per_batch = 1;
+CREATE TABLE r (id int, val vector(3));
+CREATE INDEX r_idx ON r USING pinecone (val) WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}');
+-- the rolled back row 2 has no upsert mock
+DELETE FROM pinecone_mock WHERE url_prefix IN ('https://fakehost/vectors/upsert', 'https://fakehost/query');
+INSERT INTO pinecone_mock (url_prefix, method, body, response) VALUES
+    ('https://fakehost/vectors/upsert', 'POST', '{"vectors":[{"id":"000000000001","values":[1,0,0],"metadata":{}}]}', '{"upsertedCount":1}'),
+    ('https://fakehost/vectors/upsert', 'POST', '{"vectors":[{"id":"000000000003","values":[3,0,0],"metadata":{}}]}', '{"upsertedCount":1}'),
+    ('https://fakehost/vectors/upsert', 'POST', '{"vectors":[{"id":"000000000004","values":[4,0,0],"metadata":{}}]}', '{"upsertedCount":1}');
+INSERT INTO pinecone_mock (url_prefix, method, response)
+VALUES ('https://fakehost/query', 'POST', '{"matches":[]}');
+INSERT INTO r (id, val) VALUES (1, '[1,0,0]');
+-- the scan appends row 2, whose batch flushes row 1; the query sees the uncommitted row in the buffer
+BEGIN;
+INSERT INTO r (id, val) VALUES (2, '[2,0,0]');
+SELECT id FROM r ORDER BY val <-> '[0,0,0]';
+ROLLBACK;
+-- the batch of the rolled back row 2 is flushed with nothing to upsert, and the next one upserts row 3
+INSERT INTO r (id, val) VALUES (3, '[3,0,0]');
+INSERT INTO r (id, val) VALUES (4, '[4,0,0]');
+INSERT INTO r (id, val) VALUES (5, '[5,0,0]');
+-- the query flushes the batch of row 4, which the insert of row 5 left behind while committing;
+-- pinecone hasn't indexed the flushed batches yet, so the buffer is scanned from the start
+INSERT INTO pinecone_mock (url_prefix, method, response)
+VALUES ('https://fakehost/vectors/fetch', 'GET', '{"vectors":{},"namespace":""}');
+SELECT id FROM r ORDER BY val <-> '[0,0,0]';
+
+DROP TABLE r;
+
+-- LEFT BEHIND
+-- the batch that a transaction completes while committing is flushed by the next session that queries the index
+CREATE TABLE s (id int, val vector(3));
+CREATE INDEX s_idx ON s USING pinecone (val) WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}');
+DELETE FROM pinecone_mock WHERE url_prefix = 'https://fakehost/vectors/upsert';
+INSERT INTO pinecone_mock (url_prefix, method, body, response, times)
+VALUES ('https://fakehost/vectors/upsert', 'POST', '{"vectors":[{"id":"000000000001","values":[1,0,0],"metadata":{}}]}', '{"upsertedCount":1}', 1);
+INSERT INTO s (id, val) VALUES (1, '[1,0,0]'), (2, '[2,0,0]');
+SELECT times FROM pinecone_mock WHERE url_prefix = 'https://fakehost/vectors/upsert';
+\c
+SELECT id FROM s ORDER BY val <-> '[0,0,0]';
+SELECT times FROM pinecone_mock WHERE url_prefix = 'https://fakehost/vectors/upsert';
+
+DROP TABLE s;
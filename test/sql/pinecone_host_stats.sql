@@ -0,0 +1,105 @@
+-- SETUP
+-- suppress output
+\o /dev/null
+delete from pinecone_mock;
+-- logging level
+SET client_min_messages = 'notice';
+-- keep the rows inserted after the build in the buffer
+SET pinecone.vectors_per_request = 100;
+SET pinecone.requests_per_batch = 10;
+-- disable flat scan to force use of the index
+SET enable_seqscan = off;
+-- CREATE TABLE
+DROP TABLE IF EXISTS t;
+CREATE TABLE t (id int, val vector(3));
+\o
+
+-- mock create index
+INSERT INTO pinecone_mock (url_prefix, method, response)
+VALUES ('https://api.pinecone.io/indexes', 'POST', $${
+        "name": "invalid",
+        "metric": "euclidean",
+        "dimension": 3,
+        "status": {
+                "ready": true,
+                "state": "Ready"
+        },
+        "host": "fakehost",
+        "spec": {
+                "serverless": {
+                        "cloud": "aws",
+                        "region": "us-west-2"
+                }
+        }
+}$$);
+-- mock describe index stats
+INSERT INTO pinecone_mock (url_prefix, method, response)
+VALUES ('https://fakehost/describe_index_stats', 'GET', '{"namespaces":{},"dimension":3,"indexFullness":0,"totalVectorCount":0}');
+-- mock upsert
+INSERT INTO pinecone_mock (url_prefix, method, response)
+VALUES ('https://fakehost/vectors/upsert', 'POST', '{"upsertedCount":1}');
+-- row 1 is built into pinecone, rows 2 and 3 stay in the buffer
+INSERT INTO t (id, val) VALUES (1, '[1,0,0]');
+CREATE INDEX i2 ON t USING pinecone (val) WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}');
+INSERT INTO t (id, val) VALUES (2, '[1,1,0]'), (3, '[0,0,1]');
+
+-- mock query
+INSERT INTO pinecone_mock (url_prefix, method, response)
+VALUES ('https://fakehost/query', 'POST', '{"matches":[{"id":"000000000001","score":0}]}');
+SELECT id FROM t ORDER BY val <-> '[1,0,0]';
+-- enough queries for the host to have latency percentiles
+DO $$
+BEGIN
+    FOR i IN 1..20 LOOP
+        PERFORM id FROM t ORDER BY val <-> '[1,0,0]';
+    END LOOP;
+END
+$$;
+
+-- QUERY DEADLINE
+-- pinecone takes 5 seconds to answer
+DELETE FROM pinecone_mock WHERE url_prefix = 'https://fakehost/query';
+INSERT INTO pinecone_mock (url_prefix, method, response, delay_ms)
+VALUES ('https://fakehost/query', 'POST', '{"matches":[{"id":"000000000001","score":0}]}', 5000);
+SET pinecone.query_deadline = 200;
+-- answer from the buffer alone
+SET pinecone.query_deadline_action = local_only;
+SELECT id FROM t ORDER BY val <-> '[1,0,0]';
+-- or fail the query
+SET pinecone.query_deadline_action = error;
+SELECT id FROM t ORDER BY val <-> '[1,0,0]';
+RESET pinecone.query_deadline;
+RESET pinecone.query_deadline_action;
+
+-- HEDGING
+-- the first request takes 5 seconds, the one sent again is answered right away
+DELETE FROM pinecone_mock WHERE url_prefix = 'https://fakehost/query';
+INSERT INTO pinecone_mock (url_prefix, method, response, delay_ms, times)
+VALUES ('https://fakehost/query', 'POST', '{"matches":[]}', 5000, 1);
+INSERT INTO pinecone_mock (url_prefix, method, response, times)
+VALUES ('https://fakehost/query', 'POST', '{"matches":[{"id":"000000000001","score":0}]}', 1);
+SET pinecone.hedge_percentile = 50;
+SELECT id FROM t ORDER BY val <-> '[1,0,0]';
+RESET pinecone.hedge_percentile;
+-- both requests were sent
+SELECT times FROM pinecone_mock WHERE url_prefix = 'https://fakehost/query' ORDER BY id;
+
+-- HOST STATS
+SELECT queries, failures, hedged, hedge_wins, deadline_exceeded, p50_ms IS NOT NULL AS has_latencies, breaker
+FROM pinecone_host_stats() WHERE host = 'fakehost';
+
+-- CIRCUIT BREAKER
+SET pinecone.breaker_failure_threshold = 2;
+-- pinecone can't be reached
+DELETE FROM pinecone_mock WHERE url_prefix = 'https://fakehost/query';
+INSERT INTO pinecone_mock (url_prefix, method, curl_code)
+VALUES ('https://fakehost/query', 'POST', 7);
+SELECT id FROM t ORDER BY val <-> '[1,0,0]';
+-- the second failure in a row opens the breaker
+SELECT id FROM t ORDER BY val <-> '[1,0,0]';
+-- the planner doesn't use the index while the breaker is open
+SELECT id FROM t ORDER BY val <-> '[1,0,0]';
+SELECT failures, breaker FROM pinecone_host_stats() WHERE host = 'fakehost';
+RESET pinecone.breaker_failure_threshold;
+
+DROP TABLE t;
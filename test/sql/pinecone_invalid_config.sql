@@ -7,4 +7,5 @@ CREATE INDEX i2 ON t USING pinecone (val) WITH (spec = '{"serverless":{"cloud":"
 ALTER SYSTEM SET pinecone.api_key = 'fake-key';
 SELECT pg_reload_conf();
 CREATE INDEX i2 ON t USING pinecone (val);
+CREATE INDEX i2 ON t USING pinecone (val) WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}', inline_vectors = 'float8');
 DROP TABLE t;
\ No newline at end of file
@@ -0,0 +1,102 @@
+-- SETUP
+-- suppress output
+\o /dev/null
+delete from pinecone_mock;
+-- logging level
+SET client_min_messages = 'notice';
+-- one vector per upsert request
+SET pinecone.vectors_per_request = 1;
+SET pinecone.requests_per_batch = 1;
+SET pinecone.top_k = 5;
+-- disable flat scan to force use of the index
+SET enable_seqscan = off;
+-- CREATE TABLE
+DROP TABLE IF EXISTS t;
+CREATE TABLE t (id int, val vector(3), note text, score float8);
+\o
+
+-- mock create index
+INSERT INTO pinecone_mock (url_prefix, method, response)
+VALUES ('https://api.pinecone.io/indexes', 'POST', $${
+        "name": "invalid",
+        "metric": "euclidean",
+        "dimension": 3,
+        "status": {
+                "ready": true,
+                "state": "Ready"
+        },
+        "host": "fakehost",
+        "spec": {
+                "serverless": {
+                        "cloud": "aws",
+                        "region": "us-west-2"
+                }
+        }
+}$$);
+-- mock describe index stats
+INSERT INTO pinecone_mock (url_prefix, method, response)
+VALUES ('https://fakehost/describe_index_stats', 'GET', '{"namespaces":{},"dimension":3,"indexFullness":0,"totalVectorCount":0}');
+
+-- UPSERT BODIES
+-- strings are escaped, NaN and infinite metadata is sent as null and null metadata is left out
+INSERT INTO t (id, val, note, score) VALUES
+    (1, '[0.1,1e-7,3]', E'a "quoted" \\ word\tand\nnewline', 0.5),
+    (2, '[-0.5,2,0]', 'it''s', 'NaN'),
+    (3, '[1,0,0]', NULL, 'Infinity'),
+    (4, '[0,1,0]', NULL, '-Infinity'),
+    (5, '[0,0,1]', NULL, NULL);
+-- the build upserts the rows; only the exact bodies have a mock
+INSERT INTO pinecone_mock (url_prefix, method, body, response) VALUES
+    ('https://fakehost/vectors/upsert', 'POST', $${"vectors":[{"id":"000000000001","values":[0.1,1e-07,3],"metadata":{"note":"a \"quoted\" \\ word\tand\nnewline","score":0.5}}]}$$, '{"upsertedCount":1}'),
+    ('https://fakehost/vectors/upsert', 'POST', $${"vectors":[{"id":"000000000002","values":[-0.5,2,0],"metadata":{"note":"it's","score":null}}]}$$, '{"upsertedCount":1}'),
+    ('https://fakehost/vectors/upsert', 'POST', $${"vectors":[{"id":"000000000003","values":[1,0,0],"metadata":{"score":null}}]}$$, '{"upsertedCount":1}'),
+    ('https://fakehost/vectors/upsert', 'POST', $${"vectors":[{"id":"000000000004","values":[0,1,0],"metadata":{"score":null}}]}$$, '{"upsertedCount":1}'),
+    ('https://fakehost/vectors/upsert', 'POST', $${"vectors":[{"id":"000000000005","values":[0,0,1],"metadata":{}}]}$$, '{"upsertedCount":1}');
+CREATE INDEX i2 ON t USING pinecone (val, note, score) WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}');
+
+-- QUERY BODY
+-- floats are written in their shortest form
+INSERT INTO pinecone_mock (url_prefix, method, body, response)
+VALUES ('https://fakehost/query', 'POST', '{"topK":5,"vector":[0.1,1e-07,3],"filter":{"$and":[]},"includeValues":false,"includeMetadata":false}',
+        '{"matches":[{"id":"000000000001","score":0}],"namespace":""}');
+SELECT id FROM t ORDER BY val <-> '[0.1,1e-7,3]';
+
+-- MATCH PARSING
+DELETE FROM pinecone_mock WHERE url_prefix = 'https://fakehost/query';
+-- the response arrives a few bytes at a time, so matches, ids and scores are split across chunks;
+-- the escaped strings in the fields that are skipped contain brackets and quotes
+INSERT INTO pinecone_mock (url_prefix, method, response, chunk_size)
+VALUES ('https://fakehost/query', 'POST', $${"results":[],"matches":[
+    {"id":"000000000003","score":0.04,"values":[],"metadata":{"note":"}]\"{[\\"}},
+    {"id":"000000000004","score":1.64,"values":[]},
+    {"id":"000000000005","score":2.04,"values":[],"sparseValues":{"indices":[1],"values":[0.5]}}],
+    "namespace":"a \"name\" space","usage":{"readUnits":5}}$$, 5);
+SELECT id FROM t ORDER BY val <-> '[1,0.2,0]';
+
+-- an error response is reported with its message
+DELETE FROM pinecone_mock WHERE url_prefix = 'https://fakehost/query';
+INSERT INTO pinecone_mock (url_prefix, method, response)
+VALUES ('https://fakehost/query', 'POST', '{"code":3,"message":"Invalid \"topK\" of 5","details":[]}');
+SELECT id FROM t ORDER BY val <-> '[1,0.2,0]';
+
+-- a response that was cut off is an error, even though the matches before the cut were read
+DELETE FROM pinecone_mock WHERE url_prefix = 'https://fakehost/query';
+INSERT INTO pinecone_mock (url_prefix, method, response, chunk_size)
+VALUES ('https://fakehost/query', 'POST', '{"matches":[{"id":"000000000003","score":0.04},{"id":"0000000', 5);
+SELECT id FROM t ORDER BY val <-> '[1,0.2,0]';
+
+-- a match with an id that isn't a tid is skipped
+DELETE FROM pinecone_mock WHERE url_prefix = 'https://fakehost/query';
+INSERT INTO pinecone_mock (url_prefix, method, response)
+VALUES ('https://fakehost/query', 'POST', '{"matches":[{"id":"not-a-tid","score":0},{"id":"000000000003","score":0.04}]}');
+SELECT id FROM t ORDER BY val <-> '[1,0.2,0]';
+
+-- more matches than pinecone.top_k
+SET pinecone.top_k = 2;
+DELETE FROM pinecone_mock WHERE url_prefix = 'https://fakehost/query';
+INSERT INTO pinecone_mock (url_prefix, method, response)
+VALUES ('https://fakehost/query', 'POST', $${"matches":[{"id":"000000000003","score":0.04},{"id":"000000000004","score":1.64},
+    {"id":"000000000005","score":2.04},{"id":"000000000002","score":5.49},{"id":"000000000001","score":9.85}]}$$);
+SELECT id FROM t ORDER BY val <-> '[1,0.2,0]';
+
+DROP TABLE t;
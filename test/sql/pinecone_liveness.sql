@@ -0,0 +1,128 @@
+-- SETUP
+-- suppress output
+\o /dev/null
+delete from pinecone_mock;
+-- logging level
+SET client_min_messages = 'notice';
+-- one vector per upsert request, so that every insert completes a batch
+SET pinecone.vectors_per_request = 1;
+SET pinecone.requests_per_batch = 1;
+-- disable flat scan to force use of the index
+SET enable_seqscan = off;
+-- CREATE TABLE
+DROP TABLE IF EXISTS t;
+CREATE TABLE t (id int, val vector(3));
+\o
+
+-- mock create index
+INSERT INTO pinecone_mock (url_prefix, method, response)
+VALUES ('https://api.pinecone.io/indexes', 'POST', $${
+        "name": "invalid",
+        "metric": "euclidean",
+        "dimension": 3,
+        "status": {
+                "ready": true,
+                "state": "Ready"
+        },
+        "host": "fakehost",
+        "spec": {
+                "serverless": {
+                        "cloud": "aws",
+                        "region": "us-west-2"
+                }
+        }
+}$$);
+-- mock describe index stats
+INSERT INTO pinecone_mock (url_prefix, method, response)
+VALUES ('https://fakehost/describe_index_stats', 'GET', '{"namespaces":{},"dimension":3,"indexFullness":0,"totalVectorCount":0}');
+-- mock upsert
+INSERT INTO pinecone_mock (url_prefix, method, response)
+VALUES ('https://fakehost/vectors/upsert', 'POST', '{"upsertedCount":1}');
+CREATE INDEX i2 ON t USING pinecone (val) WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}');
+-- each insert flushes the batch of the one before last
+INSERT INTO t (id, val) VALUES (1, '[1,0,0]');
+INSERT INTO t (id, val) VALUES (2, '[2,0,0]');
+INSERT INTO t (id, val) VALUES (3, '[3,0,0]');
+INSERT INTO t (id, val) VALUES (4, '[4,0,0]');
+INSERT INTO t (id, val) VALUES (5, '[5,0,0]');
+-- mock query; pinecone answers nothing, so only the rows scanned in the buffer are found
+INSERT INTO pinecone_mock (url_prefix, method, response)
+VALUES ('https://fakehost/query', 'POST', '{"matches":[]}');
+
+-- LIVENESS CACHE
+SET pinecone.liveness_max_age = '1h';
+-- a fetch that fails tells nothing, so it isn't kept
+INSERT INTO pinecone_mock (url_prefix, method, response, status, times)
+VALUES ('https://fakehost/vectors/fetch', 'GET', '{"code":14,"message":"Unavailable"}', 503, 1);
+SELECT id FROM t ORDER BY val <-> '[0,0,0]' LIMIT 1;
+-- and the next query fetches the flushed checkpoints again, none of which pinecone has indexed yet
+INSERT INTO pinecone_mock (url_prefix, method, response, times)
+VALUES ('https://fakehost/vectors/fetch', 'GET', '{"vectors":{},"namespace":""}', 1);
+SELECT id FROM t ORDER BY val <-> '[0,0,0]' LIMIT 1;
+-- the next one uses what that fetch found instead of fetching again (which would find no mock)
+SELECT id FROM t ORDER BY val <-> '[0,0,0]' LIMIT 1;
+-- unless it is older than pinecone.liveness_max_age
+SET pinecone.liveness_max_age = 0;
+INSERT INTO pinecone_mock (url_prefix, method, response, times)
+VALUES ('https://fakehost/vectors/fetch', 'GET', '{"vectors":{},"namespace":""}', 1);
+SELECT id FROM t ORDER BY val <-> '[0,0,0]' LIMIT 1;
+SELECT times FROM pinecone_mock WHERE url_prefix = 'https://fakehost/vectors/fetch' ORDER BY id;
+
+-- PRESUMED READY CHECKPOINTS
+-- from now on pinecone has indexed every flushed batch by the time it is fetched,
+-- and the buffer is only scanned from the newest checkpoint found ready
+DELETE FROM pinecone_mock WHERE url_prefix = 'https://fakehost/vectors/fetch';
+INSERT INTO pinecone_mock (url_prefix, method, response)
+VALUES ('https://fakehost/vectors/fetch', 'GET', '{"vectors":{"000000000001":{},"000000000002":{},"000000000003":{},"000000000004":{},"000000000005":{},"000000000006":{},"000000000007":{},"000000000008":{},"000000000009":{},"00000000000a":{},"00000000000b":{}},"namespace":""}');
+SELECT id FROM t ORDER BY val <-> '[0,0,0]' LIMIT 1;
+-- each fetch also measures how long pinecone took to index a batch
+INSERT INTO t (id, val) VALUES (6, '[6,0,0]');
+SELECT id FROM t ORDER BY val <-> '[0,0,0]' LIMIT 1;
+INSERT INTO t (id, val) VALUES (7, '[7,0,0]');
+SELECT id FROM t ORDER BY val <-> '[0,0,0]' LIMIT 1;
+INSERT INTO t (id, val) VALUES (8, '[8,0,0]');
+SELECT id FROM t ORDER BY val <-> '[0,0,0]' LIMIT 1;
+INSERT INTO t (id, val) VALUES (9, '[9,0,0]');
+SELECT id FROM t ORDER BY val <-> '[0,0,0]' LIMIT 1;
+-- flush two more batches and stop fetching
+INSERT INTO t (id, val) VALUES (10, '[10,0,0]');
+INSERT INTO t (id, val) VALUES (11, '[11,0,0]');
+SET pinecone.liveness_max_age = '1h';
+-- the batches flushed since the last fetch are scanned
+SET pinecone.presume_ready_factor = 0;
+SELECT id FROM t ORDER BY val <-> '[0,0,0]';
+-- unless they were flushed long enough ago to be presumed indexed
+SET pinecone.presume_ready_factor = 0.001;
+SELECT id FROM t ORDER BY val <-> '[0,0,0]';
+RESET pinecone.presume_ready_factor;
+
+DROP TABLE t;
+
+-- ROLLED BACK CHECKPOINT ROW
+-- two vectors per batch; a checkpoint is looked for by the first row its batch upserted, not the row it started with
+SET pinecone.vectors_per_request = 2;
+SET pinecone.liveness_max_age = 0;
+CREATE TABLE u (id int, val vector(3));
+CREATE INDEX u_idx ON u USING pinecone (val) WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}');
+DELETE FROM pinecone_mock WHERE url_prefix = 'https://fakehost/vectors/fetch';
+INSERT INTO u (id, val) VALUES (1, '[1,0,0]'), (2, '[2,0,0]');
+-- the scan appends row 3, which starts the second batch and is rolled back
+BEGIN;
+INSERT INTO u (id, val) VALUES (3, '[3,0,0]');
+SELECT id FROM u ORDER BY val <-> '[0,0,0]';
+ROLLBACK;
+-- row 4 completes the second batch, which is flushed with row 4 alone
+INSERT INTO u (id, val) VALUES (4, '[4,0,0]');
+INSERT INTO u (id, val) VALUES (5, '[5,0,0]'), (6, '[6,0,0]');
+INSERT INTO u (id, val) VALUES (7, '[7,0,0]'), (8, '[8,0,0]');
+-- pinecone has indexed the second batch, but not the third
+INSERT INTO pinecone_mock (url_prefix, method, response)
+VALUES ('https://fakehost/vectors/fetch', 'GET', '{"vectors":{"000000000004":{}},"namespace":""}');
+SELECT id FROM u ORDER BY val <-> '[0,0,0]';
+-- so the buffer is scanned from the second batch
+SET pinecone.liveness_max_age = '1h';
+SELECT id FROM u ORDER BY val <-> '[0,0,0]';
+RESET pinecone.liveness_max_age;
+RESET pinecone.vectors_per_request;
+
+DROP TABLE u;
@@ -0,0 +1,93 @@
+-- SETUP
+-- suppress output
+\o /dev/null
+delete from pinecone_mock;
+-- logging level
+SET client_min_messages = 'notice';
+-- one vector per upsert request
+SET pinecone.vectors_per_request = 1;
+SET pinecone.requests_per_batch = 1;
+-- CREATE TABLE
+DROP TABLE IF EXISTS t;
+CREATE TABLE t (id int, val vector(3));
+\o
+
+-- mock create index
+INSERT INTO pinecone_mock (url_prefix, method, response)
+VALUES ('https://api.pinecone.io/indexes', 'POST', $${
+        "name": "invalid",
+        "metric": "euclidean",
+        "dimension": 3,
+        "status": {
+                "ready": true,
+                "state": "Ready"
+        },
+        "host": "fakehost",
+        "spec": {
+                "serverless": {
+                        "cloud": "aws",
+                        "region": "us-west-2"
+                }
+        }
+}$$);
+-- mock describe index stats
+INSERT INTO pinecone_mock (url_prefix, method, response)
+VALUES ('https://fakehost/describe_index_stats', 'GET', '{"namespaces":{},"dimension":3,"indexFullness":0,"totalVectorCount":0}');
+-- each build upserts this row
+INSERT INTO t (id, val) VALUES (1, '[1,0,0]');
+
+-- COMPRESSION
+SET pinecone.compress_upserts = on;
+-- the host doesn't take the gzipped body, so it is sent again uncompressed
+INSERT INTO pinecone_mock (url_prefix, method, response, status, times)
+VALUES ('https://fakehost/vectors/upsert', 'POST', '{"code":3,"message":"Unsupported content encoding"}', 415, 1);
+INSERT INTO pinecone_mock (url_prefix, method, response)
+VALUES ('https://fakehost/vectors/upsert', 'POST', '{"upsertedCount":1}');
+CREATE INDEX i1 ON t USING pinecone (val) WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}');
+SELECT upsert_bytes, upsert_bytes_sent <> upsert_bytes AS compressed, failures FROM pinecone_host_stats() WHERE host = 'fakehost';
+SELECT upsert_bytes - upsert_bytes_sent AS saved FROM pinecone_host_stats() WHERE host = 'fakehost' \gset
+-- the host is remembered and later upserts aren't compressed
+CREATE INDEX i2 ON t USING pinecone (val) WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}');
+SELECT upsert_bytes, upsert_bytes - upsert_bytes_sent = :saved AS uncompressed FROM pinecone_host_stats() WHERE host = 'fakehost';
+RESET pinecone.compress_upserts;
+
+-- RETRIES
+-- the host throttles the first request, which is sent again after a backoff
+DELETE FROM pinecone_mock WHERE url_prefix = 'https://fakehost/vectors/upsert';
+INSERT INTO pinecone_mock (url_prefix, method, response, status, times)
+VALUES ('https://fakehost/vectors/upsert', 'POST', '{"code":8,"message":"Too many requests"}', 429, 1);
+INSERT INTO pinecone_mock (url_prefix, method, response)
+VALUES ('https://fakehost/vectors/upsert', 'POST', '{"upsertedCount":1}');
+CREATE INDEX i3 ON t USING pinecone (val) WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}');
+SELECT throttled, upsert_retries, failures FROM pinecone_host_stats() WHERE host = 'fakehost';
+-- without retries the upsert fails
+SET pinecone.upsert_max_retries = 0;
+DELETE FROM pinecone_mock WHERE url_prefix = 'https://fakehost/vectors/upsert';
+INSERT INTO pinecone_mock (url_prefix, method, response, status)
+VALUES ('https://fakehost/vectors/upsert', 'POST', '{"code":8,"message":"Too many requests"}', 429);
+CREATE INDEX i4 ON t USING pinecone (val) WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}');
+RESET pinecone.upsert_max_retries;
+
+-- FLUSH
+-- a flush that fails only warns: the insert goes through and the vectors stay in the buffer
+DELETE FROM pinecone_mock WHERE url_prefix = 'https://fakehost/vectors/upsert';
+CREATE TABLE u (id int, val vector(3));
+CREATE INDEX u_idx ON u USING pinecone (val) WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}');
+SET pinecone.upsert_max_retries = 0;
+INSERT INTO pinecone_mock (url_prefix, method, response, status, times)
+VALUES ('https://fakehost/vectors/upsert', 'POST', '{"code":8,"message":"Too many requests"}', 429, 1);
+INSERT INTO pinecone_mock (url_prefix, method, response, times)
+VALUES ('https://fakehost/vectors/upsert', 'POST', '{"upsertedCount":1}', 2);
+-- each insert flushes the batch of the one before last
+INSERT INTO u (id, val) VALUES (1, '[1,0,0]');
+INSERT INTO u (id, val) VALUES (2, '[2,0,0]');
+INSERT INTO u (id, val) VALUES (3, '[3,0,0]');
+SELECT times FROM pinecone_mock WHERE url_prefix = 'https://fakehost/vectors/upsert' ORDER BY times;
+-- once pinecone.flush_naptime has passed, the next insert sends the batch again along with the one after it
+SELECT pg_sleep(1);
+INSERT INTO u (id, val) VALUES (4, '[4,0,0]');
+SELECT times FROM pinecone_mock WHERE url_prefix = 'https://fakehost/vectors/upsert' ORDER BY times;
+RESET pinecone.upsert_max_retries;
+DROP TABLE u;
+
+DROP TABLE t;